@@ -2,46 +2,702 @@
  * Command Functions
  ****************************************************************************/
 
+/*
+ * Architectures with block memory accessors provide gdb_sys_mem_read() and
+ * gdb_sys_mem_write() and set GDB_HAVE_SYS_MEM_BLOCK. Everything else falls
+ * back to one gdb_sys_mem_readb()/gdb_sys_mem_writeb() per byte.
+ *
+ * The block accessors return the number of bytes transferred before the
+ * first fault. width is an access size hint: 1, 2, 4 or 8 asks for accesses
+ * of exactly that size, 0 lets the target pick the widest aligned access.
+ * Targets without 64-bit loads and stores, such as i386, do width 8 as two
+ * 4 byte accesses.
+ */
+#ifndef GDB_HAVE_SYS_MEM_BLOCK
+#if defined(GDBSTUB_ARCH_MOCK) || defined(GDBSTUB_ARCH_X86)
+#define GDB_HAVE_SYS_MEM_BLOCK 1
+#else
+#define GDB_HAVE_SYS_MEM_BLOCK 0
+#endif
+#endif
+
+#if GDB_HAVE_SYS_MEM_BLOCK
+int gdb_sys_mem_read(struct gdb_state *state, address addr, char *buf,
+                     unsigned int len, unsigned int width);
+int gdb_sys_mem_write(struct gdb_state *state, address addr, const char *buf,
+                      unsigned int len, unsigned int width);
+#endif
+
 /**
- * @brief Read from memory and encode into buf.
- * 
+ * @brief Pick the access width hint for a memory transfer.
+ *
+ * A naturally aligned 2, 4 or 8 byte transfer is done as a single access of
+ * that size, which is what a debugger reading or writing one device register
+ * expects, except that 8 bytes take two accesses on 32-bit targets. Anything
+ * else is left to the target.
+ *
+ * @param addr Memory address of the transfer
+ * @param len Number of bytes to transfer
+ *
+ * @return Access width hint for gdb_sys_mem_read()/gdb_sys_mem_write()
+ */
+static unsigned int gdb_mem_width(address addr, unsigned int len)
+{
+    if ((len == 2 || len == 4 || len == 8) && (addr & (len-1)) == 0) {
+        return len;
+    }
+    return 0;
+}
+
+/**
+ * @brief Copy from system memory into buf.
+ *
  * @param state Pointer to the GDB state object
- * @param buf Buffer to write the encoded data to
- * @param buf_len Length of the buffer
  * @param addr Memory address to read from
+ * @param buf Buffer to read into
  * @param len Number of bytes to read
- * @param enc Encoding function
- * 
- * @return Number of bytes written to buf, or GDB_EOF if the buffer is too small
+ * @param width Access width hint, see gdb_mem_width()
+ *
+ * @return Number of bytes read before the first fault
  */
-static int gdb_mem_read(struct gdb_state *state, char *buf,
-                        unsigned int buf_len, address addr, unsigned int len,
-                        gdb_enc_func enc)
+static unsigned int gdb_mem_read_block(struct gdb_state *state, address addr,
+                                       char *buf, unsigned int len,
+                                       unsigned int width)
 {
-    char data[64];
+#if GDB_HAVE_SYS_MEM_BLOCK
+    return gdb_sys_mem_read(state, addr, buf, len, width);
+#else
     unsigned int pos;
 
-    if (len > sizeof(data)) {
-        return GDB_EOF;
+    for (pos = 0; pos < len; pos++) {
+        if (gdb_sys_mem_readb(state, addr+pos, &buf[pos])) {
+            break;
+        }
     }
+    return pos;
+#endif
+}
+
+/**
+ * @brief Copy from buf into system memory.
+ *
+ * @param state Pointer to the GDB state object
+ * @param addr Memory address to write to
+ * @param buf Buffer to write from
+ * @param len Number of bytes to write
+ * @param width Access width hint, see gdb_mem_width()
+ *
+ * @return Number of bytes written before the first fault
+ */
+static unsigned int gdb_mem_write_block(struct gdb_state *state, address addr,
+                                        const char *buf, unsigned int len,
+                                        unsigned int width)
+{
+#if GDB_HAVE_SYS_MEM_BLOCK
+    return gdb_sys_mem_write(state, addr, buf, len, width);
+#else
+    unsigned int pos;
 
-    /* Read from system memory */
     for (pos = 0; pos < len; pos++) {
-        if (gdb_sys_mem_readb(state, addr+pos, &data[pos])) {
-            /* Failed to read */
+        if (gdb_sys_mem_writeb(state, addr+pos, buf[pos])) {
+            break;
+        }
+    }
+    return pos;
+#endif
+}
+
+/// Software breakpoint instruction (x86 int3)
+#ifndef GDB_SW_BREAK_INSN
+#define GDB_SW_BREAK_INSN 0xcc
+#endif
+
+/// log2 of the number of slots in the software breakpoint table
+#ifndef GDB_SW_BREAK_BITS
+#define GDB_SW_BREAK_BITS 7
+#endif
+
+#define GDB_SW_BREAK_SLOTS (1<<GDB_SW_BREAK_BITS)
+
+/// Most software breakpoints set at once, keeping the table at most half full
+#define GDB_SW_BREAK_MAX (GDB_SW_BREAK_SLOTS/2)
+
+#define GDB_SW_BREAK_WANTED   1 ///< The debugger has the breakpoint set
+#define GDB_SW_BREAK_INSERTED 2 ///< The instruction is in memory
+#define GDB_SW_BREAK_TRACE    4 ///< A running trace has a tracepoint here
+
+/// Flags that keep the instruction in memory
+#define GDB_SW_BREAK_OWNERS (GDB_SW_BREAK_WANTED | GDB_SW_BREAK_TRACE)
+
+/**
+ * @brief Software breakpoint table, open addressed by address.
+ *
+ * 'Z0'/'z0' only update the table. Memory is patched in gdb_continue() and
+ * gdb_step(), and only for breakpoints whose wanted and inserted states
+ * differ, so the usual remove-all-on-stop, insert-all-on-resume pattern of
+ * gdb costs no memory writes at all. Memory reads and writes by the debugger
+ * see through inserted instructions.
+ */
+struct gdb_sw_breaks {
+    struct {
+        address addr;  ///< Breakpoint address
+        char    orig;  ///< Memory contents replaced by the instruction
+        uint8_t flags; ///< GDB_SW_BREAK_* bits, 0 for a free slot
+    } slots[GDB_SW_BREAK_SLOTS];
+    unsigned int count;    ///< Used slots
+    unsigned int inserted; ///< Slots with the instruction in memory
+    int          pending;  ///< Some slot needs inserting or removing
+};
+
+static struct gdb_sw_breaks gdb_sw_breaks;
+
+/**
+ * @brief Home slot of an address in the software breakpoint table.
+ *
+ * @param addr Breakpoint address
+ * @return Slot index
+ */
+static unsigned int gdb_sw_break_hash(address addr)
+{
+    /* Fibonacci hashing spreads the low, often aligned, bits */
+    return ((uint32_t)addr * 0x9e3779b1u) >> (32-GDB_SW_BREAK_BITS);
+}
+
+/**
+ * @brief Find the slot of a software breakpoint, or the free slot it would go in.
+ *
+ * @param addr Breakpoint address
+ * @return Slot index
+ */
+static unsigned int gdb_sw_break_find(address addr)
+{
+    unsigned int i;
+
+    i = gdb_sw_break_hash(addr);
+    while (gdb_sw_breaks.slots[i].flags && gdb_sw_breaks.slots[i].addr != addr) {
+        i = (i+1) & (GDB_SW_BREAK_SLOTS-1);
+    }
+    return i;
+}
+
+/**
+ * @brief Free a slot of the software breakpoint table.
+ *
+ * Later entries of the same probe run are shifted back, so lookups never
+ * need tombstones.
+ *
+ * @param i Slot index
+ */
+static void gdb_sw_break_free(unsigned int i)
+{
+    unsigned int j, home;
+
+    gdb_sw_breaks.count -= 1;
+    for (j = i; ; ) {
+        gdb_sw_breaks.slots[i].flags = 0;
+        do {
+            j = (j+1) & (GDB_SW_BREAK_SLOTS-1);
+            if (!gdb_sw_breaks.slots[j].flags) {
+                return;
+            }
+            home = gdb_sw_break_hash(gdb_sw_breaks.slots[j].addr);
+            /* Keep the entry at j if its home lies cyclically in (i, j] */
+        } while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+        gdb_sw_breaks.slots[i] = gdb_sw_breaks.slots[j];
+        i = j;
+    }
+}
+
+#if GDB_FEATURE_BREAK || GDB_FEATURE_TRACE
+/**
+ * @brief Set a software breakpoint.
+ *
+ * A new breakpoint's address is read and written back unchanged straight
+ * away, so an address that can't be patched is refused here rather than
+ * failing silently on resume.
+ *
+ * @param state Pointer to the GDB state object
+ * @param addr Breakpoint address
+ * @param owner GDB_SW_BREAK_WANTED for the debugger, GDB_SW_BREAK_TRACE for
+ *        a tracepoint
+ * @return 0 on success, or GDB_EOF
+ */
+static int gdb_sw_break_set(struct gdb_state *state, address addr,
+                            uint8_t owner)
+{
+    unsigned int i;
+    char orig;
+
+    i = gdb_sw_break_find(addr);
+    if (!gdb_sw_breaks.slots[i].flags) {
+        if (gdb_sw_breaks.count >= GDB_SW_BREAK_MAX ||
+            gdb_mem_read_block(state, addr, &orig, 1, 1) != 1 ||
+            gdb_mem_write_block(state, addr, &orig, 1, 1) != 1) {
+            return GDB_EOF;
+        }
+        gdb_sw_breaks.slots[i].addr = addr;
+        gdb_sw_breaks.slots[i].orig = orig;
+        gdb_sw_breaks.count += 1;
+    }
+
+    gdb_sw_breaks.slots[i].flags |= owner;
+    if (!(gdb_sw_breaks.slots[i].flags & GDB_SW_BREAK_INSERTED)) {
+        gdb_sw_breaks.pending = 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Clear a software breakpoint.
+ *
+ * The instruction stays while another owner still wants it.
+ *
+ * @param addr Breakpoint address
+ * @param owner Owner flag passed to gdb_sw_break_set()
+ */
+static void gdb_sw_break_clear(address addr, uint8_t owner)
+{
+    unsigned int i;
+
+    i = gdb_sw_break_find(addr);
+    if (!gdb_sw_breaks.slots[i].flags) {
+        return;
+    }
+
+    gdb_sw_breaks.slots[i].flags &= ~owner;
+    if (gdb_sw_breaks.slots[i].flags & GDB_SW_BREAK_OWNERS) {
+        return;
+    }
+    if (gdb_sw_breaks.slots[i].flags & GDB_SW_BREAK_INSERTED) {
+        gdb_sw_breaks.pending = 1;
+    } else {
+        gdb_sw_break_free(i);
+    }
+}
+#endif
+
+/**
+ * @brief Bring memory in line with the software breakpoint table.
+ *
+ * Called before the target resumes.
+ *
+ * @param state Pointer to the GDB state object
+ */
+static void gdb_sw_break_apply(struct gdb_state *state)
+{
+    unsigned int i;
+    uint8_t flags;
+    char insn;
+
+    if (!gdb_sw_breaks.pending) {
+        return;
+    }
+    gdb_sw_breaks.pending = 0;
+
+    insn = (char)GDB_SW_BREAK_INSN;
+    for (i = 0; i < GDB_SW_BREAK_SLOTS; ) {
+        flags = gdb_sw_breaks.slots[i].flags;
+        if ((flags & GDB_SW_BREAK_OWNERS) && !(flags & GDB_SW_BREAK_INSERTED)) {
+            if (gdb_mem_write_block(state, gdb_sw_breaks.slots[i].addr,
+                                    &insn, 1, 1) == 1) {
+                gdb_sw_breaks.slots[i].flags |= GDB_SW_BREAK_INSERTED;
+                gdb_sw_breaks.inserted += 1;
+            } else {
+                /* Checked when set, so the target changed under us */
+                gdb_sw_break_free(i);
+                continue;
+            }
+        } else if (flags == GDB_SW_BREAK_INSERTED) {
+            gdb_mem_write_block(state, gdb_sw_breaks.slots[i].addr,
+                                &gdb_sw_breaks.slots[i].orig, 1, 1);
+            gdb_sw_breaks.inserted -= 1;
+            /* Frees i, shifting a later entry into it */
+            gdb_sw_break_free(i);
+            continue;
+        }
+        i++;
+    }
+}
+
+/**
+ * @brief Hide inserted breakpoint instructions from data read from memory.
+ *
+ * @param addr Address the data was read from
+ * @param buf Data read
+ * @param len Length of the data
+ */
+static void gdb_sw_break_shadow(address addr, char *buf, unsigned int len)
+{
+    unsigned int i;
+
+    if (!gdb_sw_breaks.inserted) {
+        return;
+    }
+
+    for (i = 0; i < GDB_SW_BREAK_SLOTS; i++) {
+        if ((gdb_sw_breaks.slots[i].flags & GDB_SW_BREAK_INSERTED) &&
+            gdb_sw_breaks.slots[i].addr-addr < len) {
+            buf[gdb_sw_breaks.slots[i].addr-addr] = gdb_sw_breaks.slots[i].orig;
+        }
+    }
+}
+
+/**
+ * @brief Keep inserted breakpoints over data just written to memory.
+ *
+ * The written data becomes the contents the breakpoint instruction hides.
+ *
+ * @param state Pointer to the GDB state object
+ * @param addr Address the data was written to
+ * @param buf Data written
+ * @param len Length of the data
+ */
+static void gdb_sw_break_rewrite(struct gdb_state *state, address addr,
+                                 const char *buf, unsigned int len)
+{
+    unsigned int i;
+    char insn;
+
+    if (!gdb_sw_breaks.inserted) {
+        return;
+    }
+
+    insn = (char)GDB_SW_BREAK_INSN;
+    for (i = 0; i < GDB_SW_BREAK_SLOTS; i++) {
+        if ((gdb_sw_breaks.slots[i].flags & GDB_SW_BREAK_INSERTED) &&
+            gdb_sw_breaks.slots[i].addr-addr < len) {
+            gdb_sw_breaks.slots[i].orig = buf[gdb_sw_breaks.slots[i].addr-addr];
+            gdb_mem_write_block(state, gdb_sw_breaks.slots[i].addr, &insn, 1, 1);
+        }
+    }
+}
+
+/**
+ * @brief Take the instruction of an inserted breakpoint out of memory, or
+ * put it back.
+ *
+ * Lets the architecture step over a breakpoint without a stop. The table
+ * is left as is, so the instruction must be put back before the next stop.
+ *
+ * @param state Pointer to the GDB state object
+ * @param addr Breakpoint address
+ * @param insert 1 to put the instruction back, 0 to take it out
+ * @return 0 on success, or GDB_EOF if no breakpoint is inserted at addr
+ */
+int gdb_sw_break_lift(struct gdb_state *state, address addr, int insert)
+{
+    unsigned int i;
+    char insn;
+
+    i = gdb_sw_break_find(addr);
+    if (!(gdb_sw_breaks.slots[i].flags & GDB_SW_BREAK_INSERTED)) {
+        return GDB_EOF;
+    }
+
+    insn = insert ? (char)GDB_SW_BREAK_INSN : gdb_sw_breaks.slots[i].orig;
+    if (gdb_mem_write_block(state, addr, &insn, 1, 1) != 1) {
+        return GDB_EOF;
+    }
+    return 0;
+}
+
+/// Frames held by the trace buffer, a power of two
+#ifndef GDB_TRACE_FRAMES
+#define GDB_TRACE_FRAMES 16
+#endif
+
+/// Bytes of collected memory, with block headers, one trace frame holds
+#ifndef GDB_TRACE_FRAME_DATA
+#define GDB_TRACE_FRAME_DATA 256
+#endif
+
+typedef char gdb_trace_frames_check[(GDB_TRACE_FRAMES & (GDB_TRACE_FRAMES-1)) ? -1 : 1];
+
+/// Header of a memory block in a trace frame: address, then 16 bit length
+#define GDB_TRACE_BLOCK_HDR (sizeof(address)+2)
+
+/**
+ * @brief One trace frame, what a tracepoint collected on one hit.
+ *
+ * The registers are always collected. Memory is a run of blocks, each a
+ * GDB_TRACE_BLOCK_HDR header followed by the bytes.
+ */
+struct gdb_trace_frame {
+    unsigned int tpnum; ///< Tracepoint that created the frame
+    unsigned int len;   ///< Bytes of data used
+    reg          regs[GDB_CPU_NUM_REGISTERS];
+    char         data[GDB_TRACE_FRAME_DATA];
+};
+
+/**
+ * @brief Trace buffer, a ring of preallocated frames.
+ *
+ * Frames are filled at trap time without entering the packet loop, and
+ * fetched by the debugger once the target stops. Frame numbers count from
+ * the oldest frame held.
+ */
+struct gdb_trace_buf {
+    struct gdb_trace_frame frames[GDB_TRACE_FRAMES];
+    unsigned int head;     ///< Oldest frame
+    unsigned int count;    ///< Frames held
+    unsigned int created;  ///< Frames created since the trace started
+    int          circular; ///< A full buffer drops its oldest frame
+    int          selected; ///< A frame is selected with 'QTFrame'
+    unsigned int frame;    ///< Selected frame
+};
+
+static struct gdb_trace_buf gdb_trace_buf;
+
+/**
+ * @brief Look up a trace frame by number.
+ *
+ * @param n Frame number
+ * @return The frame, or NULL if there is no such frame
+ */
+static struct gdb_trace_frame *gdb_trace_frame_get(unsigned int n)
+{
+    if (n >= gdb_trace_buf.count) {
+        return NULL;
+    }
+    return &gdb_trace_buf.frames[(gdb_trace_buf.head+n) &
+                                 (GDB_TRACE_FRAMES-1)];
+}
+
+/**
+ * @brief Trace frame selected with 'QTFrame'.
+ *
+ * @return The frame, or NULL if the debugger looks at the live target
+ */
+static struct gdb_trace_frame *gdb_trace_frame_selected(void)
+{
+    if (!gdb_trace_buf.selected) {
+        return NULL;
+    }
+    return gdb_trace_frame_get(gdb_trace_buf.frame);
+}
+
+/**
+ * @brief Registers shown to the debugger, those of the selected trace
+ * frame, if any.
+ *
+ * @param state Pointer to the GDB state object
+ * @return Register file
+ */
+static const reg *gdb_trace_frame_regs(struct gdb_state *state)
+{
+    struct gdb_trace_frame *frame;
+
+    frame = gdb_trace_frame_selected();
+    return frame ? frame->regs : state->registers;
+}
+
+/**
+ * @brief Read memory collected in the selected trace frame.
+ *
+ * @param addr Memory address to read from
+ * @param buf Buffer to read into
+ * @param len Number of bytes to read
+ * @return Number of bytes read, up to the end of the block holding addr
+ */
+static unsigned int gdb_trace_frame_read(address addr, char *buf,
+                                         unsigned int len)
+{
+    struct gdb_trace_frame *frame;
+    unsigned int pos;
+    address block;
+    uint16_t size;
+
+    frame = gdb_trace_frame_selected();
+    if (!frame) {
+        return 0;
+    }
+
+    for (pos = 0; pos < frame->len; pos += GDB_TRACE_BLOCK_HDR+size) {
+        gdb_memcpy((char *)&block, frame->data+pos, sizeof(block));
+        gdb_memcpy((char *)&size, frame->data+pos+sizeof(block), 2);
+        if (addr-block < size) {
+            if (len > size-(addr-block)) {
+                len = size-(addr-block);
+            }
+            gdb_memcpy(buf, frame->data+pos+GDB_TRACE_BLOCK_HDR+(addr-block),
+                       len);
+            return len;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Collect a memory range into a trace frame.
+ *
+ * The range is cut short where memory stops being readable or the frame
+ * runs out of room.
+ *
+ * @param state Pointer to the GDB state object
+ * @param frame Frame being filled
+ * @param addr Address of the range
+ * @param len Length of the range
+ * @param nz Nonzero to stop after the first zero byte, for strings
+ */
+static void gdb_trace_collect_mem(struct gdb_state *state,
+                                  struct gdb_trace_frame *frame, address addr,
+                                  unsigned int len, int nz)
+{
+    char *data;
+    unsigned int room, i;
+    uint16_t size;
+
+    room = GDB_TRACE_FRAME_DATA-frame->len;
+    if (room <= GDB_TRACE_BLOCK_HDR) {
+        return;
+    }
+    room -= GDB_TRACE_BLOCK_HDR;
+    if (len > room) {
+        len = room;
+    }
+    if (len > 0xffff) {
+        len = 0xffff;
+    }
+
+    data = frame->data+frame->len+GDB_TRACE_BLOCK_HDR;
+    len = gdb_mem_read_block(state, addr, data, len, gdb_mem_width(addr, len));
+    gdb_sw_break_shadow(addr, data, len);
+    if (nz) {
+        for (i = 0; i < len && data[i]; i++);
+        if (i < len) {
+            len = i+1;
+        }
+    }
+    if (!len) {
+        return;
+    }
+
+    size = len;
+    gdb_memcpy(data-GDB_TRACE_BLOCK_HDR, (const char *)&addr, sizeof(addr));
+    gdb_memcpy(data-2, (const char *)&size, 2);
+    frame->len += GDB_TRACE_BLOCK_HDR+len;
+}
+
+/**
+ * @brief Read from memory and stage it, encoded, in the reply packet.
+ *
+ * Memory is read chunk by chunk straight into the free end of the transmit
+ * staging buffer and encoded in place towards its front, summing the packet
+ * checksum in the same pass, so the size of the transfer is not bounded by
+ * any buffer. enc must therefore tolerate its input overlapping its output at
+ * or after the output position; expanding encoders that work front to back,
+ * such as gdb_enc_hex_csum and gdb_enc_bin_csum, do. If memory becomes
+ * unreadable part way through, the reply is cut short, as the protocol allows.
+ *
+ * @param state Pointer to the GDB state object
+ * @param addr Memory address to read from
+ * @param len Number of bytes to read
+ * @param enc Encoding function, producing at most 2 bytes per input byte
+ *
+ * @return 0 on success, or GDB_EOF if no memory could be read
+ */
+static int gdb_mem_stage(struct gdb_state *state, address addr,
+                         unsigned int len, gdb_enc_csum_func enc)
+{
+    unsigned int pos, chunk, space, i;
+    char *out, *raw;
+    unsigned int width;
+    int status;
+
+    width = gdb_mem_width(addr, len);
+
+    for (pos = 0; pos < len; pos += chunk) {
+        space = gdb_tx_space();
+        if (space < GDB_TX_MIN_SPACE) {
+            if (gdb_tx_flush(state) == GDB_EOF) {
+                return GDB_EOF;
+            }
+            space = gdb_tx_space();
+        }
+
+        chunk = space/2;
+        if (chunk > len-pos) {
+            chunk = len-pos;
+        }
+
+        /* Read system memory into the end of the free space. If it fails
+         * part way, send what we have */
+        out = gdb_tx.buf+gdb_tx.pos;
+        raw = out+space-chunk;
+        if (gdb_trace_buf.selected) {
+            /* Looking at a trace frame, not at the live target */
+            i = gdb_trace_frame_read(addr+pos, raw, chunk);
+        } else {
+            i = gdb_mem_read_block(state, addr+pos, raw, chunk, width);
+            gdb_sw_break_shadow(addr+pos, raw, i);
+        }
+
+        /* Encode data */
+        status = enc(out, space, raw, i, &gdb_tx.csum);
+        if (status == GDB_EOF) {
             return GDB_EOF;
         }
+        gdb_tx_commit_summed(status);
+
+        if (i < chunk) {
+            if (pos+i == 0) {
+                return GDB_EOF;
+            }
+            break;
+        }
     }
 
-    /* Encode data */
-    return enc(buf, buf_len, data, len);
+    return 0;
+}
+
+/**
+ * @brief Read from memory and send it, encoded, as the reply packet.
+ *
+ * Replies too large for the transmit staging buffer are streamed, see
+ * gdb_mem_stage(). They can't be resent from the buffer, so on a NACK the
+ * whole reply is read and sent again.
+ *
+ * @param state Pointer to the GDB state object
+ * @param prefix Data to start the reply with
+ * @param prefix_len Length of prefix, small enough to never be flushed
+ * @param addr Memory address to read from
+ * @param len Number of bytes to read
+ * @param enc Encoding function, producing at most 2 bytes per input byte
+ *
+ * @return Status of the packet sending operation, or GDB_EOF if no memory
+ *         could be read, in which case nothing more was sent
+ */
+static int gdb_mem_read(struct gdb_state *state, const char *prefix,
+                        unsigned int prefix_len, address addr,
+                        unsigned int len, gdb_enc_csum_func enc)
+{
+    unsigned int tries;
+    int status, streamed;
+
+    for (tries = 0; ; tries++) {
+        gdb_tx_begin();
+        gdb_tx_copy(prefix, prefix_len);
+
+        if (gdb_mem_stage(state, addr, len, enc) == GDB_EOF) {
+            return GDB_EOF;
+        }
+
+        streamed = (gdb_tx.start == 0);
+        status   = gdb_tx_end(state);
+        if (!gdb_tx_resend(status, streamed, tries)) {
+            return status;
+        }
+    }
 }
 
 /**
  * @brief Write to memory from encoded buf.
+ *
+ * The data is decoded in place in buf, which is usually the received packet,
+ * so the size of the transfer is only bounded by the receive buffer.
  * 
  * @param state Pointer to the GDB state object
- * @param buf Encoded buffer to read data from
+ * @param buf Encoded buffer to read data from, overwritten with the decoded data
  * @param buf_len Length of the buffer
  * @param addr Memory address to write to
  * @param len Number of bytes to write
@@ -49,55 +705,3118 @@ static int gdb_mem_read(struct gdb_state *state, char *buf,
  * 
  * @return 0 on success, or GDB_EOF on failure
  */
-static int gdb_mem_write(struct gdb_state *state, const char *buf,
+static int gdb_mem_write(struct gdb_state *state, char *buf,
                          unsigned int buf_len, address addr, unsigned int len,
                          gdb_dec_func dec)
 {
-    char data[64];
-    unsigned int pos;
-
-    if (len > sizeof(data)) {
+    if (len > buf_len) {
         return GDB_EOF;
     }
 
     /* Decode data */
-    if (dec(buf, buf_len, data, len) == GDB_EOF) {
+    if (dec(buf, buf_len, buf, len) != (int) len) {
         return GDB_EOF;
     }
 
     /* Write to system memory */
-    for (pos = 0; pos < len; pos++) {
-        if (gdb_sys_mem_writeb(state, addr+pos, data[pos])) {
-            /* Failed to write */
-            return GDB_EOF;
-        }
+    if (gdb_mem_write_block(state, addr, buf, len,
+                            gdb_mem_width(addr, len)) != len) {
+        /* Failed to write */
+        return GDB_EOF;
     }
+    gdb_sw_break_rewrite(state, addr, buf, len);
 
     return 0;
 }
 
 /**
- * @brief Continue program execution at PC.
- * 
- * @param state Pointer to the GDB state object
- * 
- * @return 0 on success
+ * @brief Protocol features negotiated with the debugger through qSupported.
  */
-int gdb_continue(struct gdb_state *state)
+struct gdb_features {
+    int binary_upload; ///< 'x' replies carry the 'b' prefix (gdb), not bare data (lldb)
+    int hwbreak;       ///< Stop replies may carry the 'hwbreak' reason
+};
+
+static struct gdb_features gdb_features;
+
+/**
+ * @brief Parse the 'addr,length' arguments of a memory command.
+ *
+ * @param buf Pointer to the arguments.
+ * @param buf_len Length of the arguments.
+ * @param addr Set to the parsed address.
+ * @param length Set to the parsed length.
+ * @param endptr Set to the first character following the length.
+ *
+ * @return 0 on success, or GDB_EOF if the arguments are malformed
+ */
+static int gdb_parse_mem_args(const char *buf, unsigned int buf_len,
+                              address *addr, unsigned int *length,
+                              const char **endptr)
 {
-    gdb_sys_continue(state);
+    const char *end;
+
+    end = buf+buf_len;
+
+    *addr = gdb_strtol(buf, buf_len, 16, endptr);
+    if (!*endptr || *endptr >= end || **endptr != ',') {
+        return GDB_EOF;
+    }
+
+    buf = *endptr+1;
+    *length = gdb_strtol(buf, end-buf, 16, endptr);
+    if (!*endptr) {
+        return GDB_EOF;
+    }
+
     return 0;
 }
 
 /**
- * @brief Step one instruction in the program.
- * 
+ * @brief Handle 'qSupported[:gdbfeature;...]', negotiate protocol features.
+ *
  * @param state Pointer to the GDB state object
- * 
- * @return 0 on success
+ * @param pkt_buf Received packet
+ * @param pkt_len Length of the received packet
+ *
+ * @return Status of the packet sending operation
  */
-int gdb_step(struct gdb_state *state)
+static int gdb_cmd_query_supported(struct gdb_state *state, char *pkt_buf,
+                                   unsigned int pkt_len)
 {
-    gdb_sys_step(state);
-    return 0;
+    char buf[256];
+    const char *ptr, *sep, *end;
+
+    gdb_features.binary_upload = 0;
+    gdb_features.hwbreak = 0;
+
+    /* Debuggers speaking qSupported all expand run-length encoded replies */
+    gdb_tx.rle = GDB_USE_RLE;
+
+    ptr = pkt_buf+10;
+    end = pkt_buf+pkt_len;
+    if (ptr < end && *ptr == ':') {
+        ptr += 1;
+    }
+
+    for (; ptr < end; ptr = sep+1) {
+        sep = gdb_memchr(ptr, ';', end-ptr);
+        if (!sep) {
+            sep = end;
+        }
+
+        if (!gdb_strmatch(ptr, sep-ptr, "binary-upload+")) {
+            gdb_features.binary_upload = 1;
+        } else if (!gdb_strmatch(ptr, sep-ptr, "hwbreak+")) {
+            gdb_features.hwbreak = 1;
+        }
+    }
+
+    return gdb_send_supported_packet(state, buf, sizeof(buf));
+}
+
+#if GDB_FEATURE_NO_ACK
+/**
+ * @brief Handle 'QStartNoAckMode', stop acknowledging packets.
+ *
+ * The 'OK' reply itself is still acknowledged by the debugger.
+ *
+ * @param state Pointer to the GDB state object
+ * @param pkt_buf Received packet
+ * @param pkt_len Length of the received packet
+ *
+ * @return Status of the packet sending operation
+ */
+static int gdb_cmd_start_no_ack(struct gdb_state *state, char *pkt_buf,
+                                unsigned int pkt_len)
+{
+    char buf[4];
+    int status;
+
+    status = gdb_send_ok_packet(state, buf, sizeof(buf));
+    if (status == 0) {
+        gdb_no_ack_mode = 1;
+    }
+
+    return status;
+}
+#endif
+
+/**
+ * @brief Handle 'M addr,length:XX...', write hex data to memory.
+ *
+ * @param state Pointer to the GDB state object
+ * @param pkt_buf Received packet, decoded in place
+ * @param pkt_len Length of the received packet
+ *
+ * @return Status of the packet sending operation
+ */
+static int gdb_cmd_write_mem(struct gdb_state *state, char *pkt_buf,
+                             unsigned int pkt_len)
+{
+    char buf[4];
+    const char *ptr_next;
+    address addr;
+    unsigned int length;
+    char *data;
+
+    if (gdb_parse_mem_args(pkt_buf+1, pkt_len-1, &addr, &length,
+                           &ptr_next) == GDB_EOF ||
+        ptr_next >= pkt_buf+pkt_len || *ptr_next != ':') {
+        return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+    }
+
+    data = pkt_buf+(ptr_next-pkt_buf)+1;
+    if (gdb_mem_write(state, data, pkt_len-(data-pkt_buf), addr, length,
+                      gdb_dec_hex) == GDB_EOF) {
+        return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+    }
+
+    return gdb_send_ok_packet(state, buf, sizeof(buf));
+}
+
+/**
+ * @brief Handle 'm addr,length', read memory as hex.
+ *
+ * @param state Pointer to the GDB state object
+ * @param pkt_buf Received packet
+ * @param pkt_len Length of the received packet
+ *
+ * @return Status of the packet sending operation
+ */
+static int gdb_cmd_read_mem(struct gdb_state *state, char *pkt_buf,
+                            unsigned int pkt_len)
+{
+    char buf[4];
+    const char *ptr_next;
+    address addr;
+    unsigned int length;
+    int status;
+
+    if (gdb_parse_mem_args(pkt_buf+1, pkt_len-1, &addr, &length,
+                           &ptr_next) == GDB_EOF) {
+        return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+    }
+
+    status = gdb_mem_read(state, "", 0, addr, length, gdb_enc_hex_csum);
+    if (status == GDB_EOF) {
+        return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+    }
+
+    return status;
+}
+
+#if GDB_FEATURE_MEM_BIN
+/**
+ * @brief Handle 'X addr,length:XX...', write binary data to memory.
+ *
+ * @param state Pointer to the GDB state object
+ * @param pkt_buf Received packet, decoded in place
+ * @param pkt_len Length of the received packet
+ *
+ * @return Status of the packet sending operation
+ */
+static int gdb_cmd_write_mem_bin(struct gdb_state *state, char *pkt_buf,
+                                 unsigned int pkt_len)
+{
+    char buf[4];
+    const char *ptr_next;
+    address addr;
+    unsigned int length;
+    char *data;
+
+    if (gdb_parse_mem_args(pkt_buf+1, pkt_len-1, &addr, &length,
+                           &ptr_next) == GDB_EOF ||
+        ptr_next >= pkt_buf+pkt_len || *ptr_next != ':') {
+        return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+    }
+
+    data = pkt_buf+(ptr_next-pkt_buf)+1;
+    if (gdb_mem_write(state, data, pkt_len-(data-pkt_buf), addr, length,
+                      gdb_dec_bin) == GDB_EOF) {
+        return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+    }
+
+    return gdb_send_ok_packet(state, buf, sizeof(buf));
+}
+
+/**
+ * @brief Handle 'x addr,length', read memory as binary data.
+ *
+ * gdb expects the data behind a 'b' prefix once it has negotiated
+ * binary-upload. lldb expects bare data and probes support with a zero length
+ * read, which is answered with 'OK'.
+ *
+ * @param state Pointer to the GDB state object
+ * @param pkt_buf Received packet
+ * @param pkt_len Length of the received packet
+ *
+ * @return Status of the packet sending operation
+ */
+static int gdb_cmd_read_mem_bin(struct gdb_state *state, char *pkt_buf,
+                                unsigned int pkt_len)
+{
+    char buf[4];
+    const char *ptr_next;
+    address addr;
+    unsigned int length;
+    int status;
+
+    if (gdb_parse_mem_args(pkt_buf+1, pkt_len-1, &addr, &length,
+                           &ptr_next) == GDB_EOF) {
+        return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+    }
+
+    if (length == 0 && !gdb_features.binary_upload) {
+        return gdb_send_ok_packet(state, buf, sizeof(buf));
+    }
+
+    status = gdb_mem_read(state, "b", gdb_features.binary_upload ? 1 : 0,
+                          addr, length, gdb_enc_bin_csum);
+    if (status == GDB_EOF) {
+        return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+    }
+
+    return status;
+}
+#endif /* GDB_FEATURE_MEM_BIN */
+
+/*
+ * Architectures with registers beyond gdb_state.registers (FPU, vector)
+ * provide gdb_sys_ext_reg_read() and gdb_sys_ext_reg_write() and set
+ * GDB_HAVE_SYS_EXT_REGS. They are reached with 'p'/'P' using register
+ * numbers from GDB_CPU_NUM_REGISTERS up, and are never part of 'g'.
+ *
+ * gdb_sys_ext_reg_read() returns the size of the register in bytes, and
+ * gdb_sys_ext_reg_write() 0. Both return GDB_EOF for an unknown register
+ * or a size mismatch.
+ */
+#ifndef GDB_HAVE_SYS_EXT_REGS
+#ifdef GDBSTUB_ARCH_X86
+#define GDB_HAVE_SYS_EXT_REGS 1
+#else
+#define GDB_HAVE_SYS_EXT_REGS 0
+#endif
+#endif
+
+#if GDB_HAVE_SYS_EXT_REGS
+int gdb_sys_ext_reg_read(struct gdb_state *state, unsigned int regno,
+                         char *buf, unsigned int buf_len);
+int gdb_sys_ext_reg_write(struct gdb_state *state, unsigned int regno,
+                          const char *buf, unsigned int len);
+#endif
+
+/// Size of the largest register handled by 'p'/'P'
+#define GDB_REG_MAX_SIZE 16
+
+/**
+ * @brief Registers written by the debugger since the target stopped, one bit
+ * per entry of gdb_state.registers.
+ *
+ * Architectures that load the register file from a saved frame write back
+ * only the registers marked here when the target resumes, then clear it.
+ */
+uint32_t gdb_regs_dirty;
+
+/* Fails to compile if the register file outgrows gdb_regs_dirty */
+typedef char gdb_regs_dirty_check[(GDB_CPU_NUM_REGISTERS <= 32) ? 1 : -1];
+
+/**
+ * @brief Set a register, marking it dirty if its value changes.
+ *
+ * @param state Pointer to the GDB state object
+ * @param regno Register number, below GDB_CPU_NUM_REGISTERS
+ * @param val New value
+ */
+static void gdb_reg_set(struct gdb_state *state, unsigned int regno, reg val)
+{
+    if (state->registers[regno] != val) {
+        state->registers[regno] = val;
+        gdb_regs_dirty |= (uint32_t)1 << regno;
+    }
+}
+
+/**
+ * @brief Parse the register number of a 'p'/'P' command.
+ *
+ * @param buf Pointer to the register number.
+ * @param buf_len Length of the arguments.
+ * @param endptr Set to the first character following the register number.
+ *
+ * @return The register number, or GDB_EOF if it is malformed
+ */
+static int gdb_parse_reg_arg(const char *buf, unsigned int buf_len,
+                             const char **endptr)
+{
+    int regno;
+
+    regno = gdb_strtol(buf, buf_len, 16, endptr);
+    if (!*endptr || regno < 0) {
+        return GDB_EOF;
+    }
+
+    return regno;
+}
+
+/**
+ * @brief Handle 'g', read all registers.
+ *
+ * @param state Pointer to the GDB state object
+ * @param pkt_buf Received packet
+ * @param pkt_len Length of the received packet
+ *
+ * @return Status of the packet sending operation
+ */
+static int gdb_cmd_read_regs(struct gdb_state *state, char *pkt_buf,
+                             unsigned int pkt_len)
+{
+    char buf[sizeof(state->registers)*2];
+    int status;
+
+    status = gdb_enc_hex(buf, sizeof(buf),
+                         (const char *)gdb_trace_frame_regs(state),
+                         sizeof(state->registers));
+    if (status == GDB_EOF) {
+        return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+    }
+
+    return gdb_send_packet(state, buf, status);
+}
+
+/**
+ * @brief Handle 'G XX...', write all registers.
+ *
+ * gdb sends the whole register file even when it changes one register, so
+ * only the registers whose value differs are marked dirty.
+ *
+ * @param state Pointer to the GDB state object
+ * @param pkt_buf Received packet
+ * @param pkt_len Length of the received packet
+ *
+ * @return Status of the packet sending operation
+ */
+static int gdb_cmd_write_regs(struct gdb_state *state, char *pkt_buf,
+                              unsigned int pkt_len)
+{
+    char buf[4];
+    reg regs[GDB_CPU_NUM_REGISTERS];
+    unsigned int i;
+
+    if (gdb_dec_hex(pkt_buf+1, pkt_len-1, (char *)regs,
+                    sizeof(regs)) == GDB_EOF) {
+        return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+    }
+
+    for (i = 0; i < GDB_CPU_NUM_REGISTERS; i++) {
+        gdb_reg_set(state, i, regs[i]);
+    }
+
+    return gdb_send_ok_packet(state, buf, sizeof(buf));
+}
+
+/**
+ * @brief Handle 'p n', read one register.
+ *
+ * @param state Pointer to the GDB state object
+ * @param pkt_buf Received packet
+ * @param pkt_len Length of the received packet
+ *
+ * @return Status of the packet sending operation
+ */
+static int gdb_cmd_read_reg(struct gdb_state *state, char *pkt_buf,
+                            unsigned int pkt_len)
+{
+    char buf[GDB_REG_MAX_SIZE*2];
+    char val[GDB_REG_MAX_SIZE];
+    const char *ptr_next;
+    int regno, size, status;
+
+    regno = gdb_parse_reg_arg(pkt_buf+1, pkt_len-1, &ptr_next);
+    if (regno == GDB_EOF) {
+        return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+    }
+
+    if (regno < GDB_CPU_NUM_REGISTERS) {
+        gdb_memcpy(val, (const char *)&gdb_trace_frame_regs(state)[regno],
+                   sizeof(reg));
+        size = sizeof(reg);
+    } else {
+#if GDB_HAVE_SYS_EXT_REGS
+        size = gdb_sys_ext_reg_read(state, regno, val, sizeof(val));
+#else
+        size = GDB_EOF;
+#endif
+    }
+    if (size == GDB_EOF) {
+        return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+    }
+
+    if (regno >= GDB_CPU_NUM_REGISTERS && gdb_trace_buf.selected) {
+        /* Trace frames don't hold these, report them unavailable */
+        for (status = 0; status < size*2; status++) {
+            buf[status] = 'x';
+        }
+        return gdb_send_packet(state, buf, status);
+    }
+
+    status = gdb_enc_hex(buf, sizeof(buf), val, size);
+    if (status == GDB_EOF) {
+        return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+    }
+
+    return gdb_send_packet(state, buf, status);
+}
+
+/**
+ * @brief Handle 'P n=XX...', write one register.
+ *
+ * @param state Pointer to the GDB state object
+ * @param pkt_buf Received packet
+ * @param pkt_len Length of the received packet
+ *
+ * @return Status of the packet sending operation
+ */
+static int gdb_cmd_write_reg(struct gdb_state *state, char *pkt_buf,
+                             unsigned int pkt_len)
+{
+    char buf[4];
+    char val[GDB_REG_MAX_SIZE];
+    const char *ptr_next;
+    unsigned int len;
+    int regno;
+    reg tmp;
+
+    regno = gdb_parse_reg_arg(pkt_buf+1, pkt_len-1, &ptr_next);
+    if (regno == GDB_EOF || ptr_next >= pkt_buf+pkt_len || *ptr_next != '=') {
+        return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+    }
+
+    ptr_next += 1;
+    len = pkt_len-(ptr_next-pkt_buf);
+    if (len > sizeof(val)*2 ||
+        gdb_dec_hex(ptr_next, len, val, len/2) == GDB_EOF) {
+        return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+    }
+    len /= 2;
+
+    if (regno < GDB_CPU_NUM_REGISTERS) {
+        if (len != sizeof(reg)) {
+            return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+        }
+        gdb_memcpy((char *)&tmp, val, sizeof(reg));
+        gdb_reg_set(state, regno, tmp);
+    } else {
+#if GDB_HAVE_SYS_EXT_REGS
+        if (gdb_sys_ext_reg_write(state, regno, val, len) == GDB_EOF) {
+            return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+        }
+#else
+        return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+#endif
+    }
+
+    return gdb_send_ok_packet(state, buf, sizeof(buf));
+}
+
+/*
+ * Agent expressions are gdb's bytecode for expressions evaluated on the
+ * target. The stub evaluates breakpoint conditions with them, so a
+ * breakpoint whose condition is false resumes without a round trip to the
+ * debugger. Values are 64 bits wide, whatever the target word size.
+ */
+
+/// Depth of the agent expression value stack
+#ifndef GDB_AX_STACK
+#define GDB_AX_STACK 32
+#endif
+
+/// Most bytecodes run by one evaluation, bounding backward gotos
+#ifndef GDB_AX_MAX_STEPS
+#define GDB_AX_MAX_STEPS 1024
+#endif
+
+/**
+ * @brief Agent expression opcodes handled by the stub.
+ *
+ * Floating point, trace state variable and printf opcodes fail the
+ * evaluation, and so do the trace opcodes outside a tracepoint.
+ */
+enum GDB_AX_OP {
+    GDB_AX_ADD          = 0x02,
+    GDB_AX_SUB          = 0x03,
+    GDB_AX_MUL          = 0x04,
+    GDB_AX_DIV_SIGNED   = 0x05,
+    GDB_AX_DIV_UNSIGNED = 0x06,
+    GDB_AX_REM_SIGNED   = 0x07,
+    GDB_AX_REM_UNSIGNED = 0x08,
+    GDB_AX_LSH          = 0x09,
+    GDB_AX_RSH_SIGNED   = 0x0a,
+    GDB_AX_RSH_UNSIGNED = 0x0b,
+    GDB_AX_TRACE        = 0x0c,
+    GDB_AX_TRACE_QUICK  = 0x0d,
+    GDB_AX_LOG_NOT      = 0x0e,
+    GDB_AX_BIT_AND      = 0x0f,
+    GDB_AX_BIT_OR       = 0x10,
+    GDB_AX_BIT_XOR      = 0x11,
+    GDB_AX_BIT_NOT      = 0x12,
+    GDB_AX_EQUAL        = 0x13,
+    GDB_AX_LESS_SIGNED  = 0x14,
+    GDB_AX_LESS_UNSIGNED= 0x15,
+    GDB_AX_EXT          = 0x16,
+    GDB_AX_REF8         = 0x17,
+    GDB_AX_REF16        = 0x18,
+    GDB_AX_REF32        = 0x19,
+    GDB_AX_REF64        = 0x1a,
+    GDB_AX_IF_GOTO      = 0x20,
+    GDB_AX_GOTO         = 0x21,
+    GDB_AX_CONST8       = 0x22,
+    GDB_AX_CONST16      = 0x23,
+    GDB_AX_CONST32      = 0x24,
+    GDB_AX_CONST64      = 0x25,
+    GDB_AX_REG          = 0x26,
+    GDB_AX_END          = 0x27,
+    GDB_AX_DUP          = 0x28,
+    GDB_AX_POP          = 0x29,
+    GDB_AX_ZERO_EXT     = 0x2a,
+    GDB_AX_SWAP         = 0x2b,
+    GDB_AX_TRACENZ      = 0x2f,
+    GDB_AX_TRACE16      = 0x30,
+    GDB_AX_PICK         = 0x32,
+    GDB_AX_ROT          = 0x33,
+};
+
+/**
+ * @brief Size of the immediate operand following an opcode.
+ *
+ * @param op Opcode
+ * @return Operand size in bytes
+ */
+static unsigned int gdb_ax_imm_size(unsigned char op)
+{
+    switch (op) {
+    case GDB_AX_EXT:
+    case GDB_AX_ZERO_EXT:
+    case GDB_AX_PICK:
+    case GDB_AX_TRACE_QUICK:
+    case GDB_AX_CONST8:   return 1;
+    case GDB_AX_TRACE16:
+    case GDB_AX_IF_GOTO:
+    case GDB_AX_GOTO:
+    case GDB_AX_REG:
+    case GDB_AX_CONST16:  return 2;
+    case GDB_AX_CONST32:  return 4;
+    case GDB_AX_CONST64:  return 8;
+    default:              return 0;
+    }
+}
+
+/**
+ * @brief Read a register for an agent expression.
+ *
+ * @param state Pointer to the GDB state object
+ * @param regno Register number
+ * @param val Set to the register value, zero extended
+ * @return 0 on success, or GDB_EOF for an unknown register
+ */
+static int gdb_ax_reg(struct gdb_state *state, unsigned int regno,
+                      uint64_t *val)
+{
+#if GDB_HAVE_SYS_EXT_REGS
+    unsigned char buf[GDB_REG_MAX_SIZE];
+    int size;
+#endif
+
+    if (regno < GDB_CPU_NUM_REGISTERS) {
+        *val = state->registers[regno];
+        return 0;
+    }
+
+#if GDB_HAVE_SYS_EXT_REGS
+    size = gdb_sys_ext_reg_read(state, regno, (char *)buf, sizeof(buf));
+    if (size == GDB_EOF) {
+        return GDB_EOF;
+    }
+
+    /* Little endian, wider registers are truncated */
+    if (size > 8) {
+        size = 8;
+    }
+    *val = 0;
+    while (size--) {
+        *val = (*val << 8) | buf[size];
+    }
+    return 0;
+#else
+    return GDB_EOF;
+#endif
+}
+
+/**
+ * @brief Read target memory for an agent expression.
+ *
+ * @param state Pointer to the GDB state object
+ * @param addr Address to read
+ * @param len Number of bytes, 1, 2, 4 or 8
+ * @param val Set to the little endian value read, zero extended
+ * @return 0 on success, or GDB_EOF if the memory can't be read
+ */
+static int gdb_ax_ref(struct gdb_state *state, address addr, unsigned int len,
+                      uint64_t *val)
+{
+    unsigned char buf[8];
+
+    if (gdb_mem_read_block(state, addr, (char *)buf, len,
+                           gdb_mem_width(addr, len)) != len) {
+        return GDB_EOF;
+    }
+    gdb_sw_break_shadow(addr, (char *)buf, len);
+
+    *val = 0;
+    while (len--) {
+        *val = (*val << 8) | buf[len];
+    }
+    return 0;
+}
+
+/**
+ * @brief Evaluate an agent expression.
+ *
+ * Every operand, stack access and jump target is bounds checked, so a
+ * malformed expression fails instead of running off its buffer.
+ *
+ * @param state Pointer to the GDB state object
+ * @param frame Trace frame the trace opcodes collect into, or NULL
+ * @param code Bytecode
+ * @param len Length of the bytecode
+ * @param result Set to the value on top of the stack at 'end'
+ * @return 0 on success, or GDB_EOF if the evaluation failed
+ */
+static int gdb_ax_eval(struct gdb_state *state, struct gdb_trace_frame *frame,
+                       const unsigned char *code, unsigned int len,
+                       uint64_t *result)
+{
+    uint64_t stack[GDB_AX_STACK];
+    uint64_t a, b, imm;
+    unsigned int sp, pc, steps, n;
+    unsigned char op;
+
+#define GDB_AX_NEED(n)  do { if (sp < (n)) return GDB_EOF; } while (0)
+#define GDB_AX_PUSH(v)  do { if (sp == GDB_AX_STACK) return GDB_EOF; \
+                             stack[sp] = (v); sp++; } while (0)
+
+    sp = 0;
+    pc = 0;
+    a  = 0;
+    b  = 0;
+    for (steps = 0; steps < GDB_AX_MAX_STEPS; steps++) {
+        if (pc >= len) {
+            return GDB_EOF;
+        }
+        op = code[pc++];
+
+        /* Immediates are big endian */
+        n = gdb_ax_imm_size(op);
+        if (n > len-pc) {
+            return GDB_EOF;
+        }
+        for (imm = 0; n; n--) {
+            imm = (imm << 8) | code[pc++];
+        }
+
+        /* Binary operators pop b, then a, and push a op b */
+        if (op <= GDB_AX_LESS_UNSIGNED && op != GDB_AX_LOG_NOT &&
+            op != GDB_AX_BIT_NOT && op != GDB_AX_TRACE &&
+            op != GDB_AX_TRACE_QUICK) {
+            GDB_AX_NEED(2);
+            b = stack[--sp];
+            a = stack[sp-1];
+        }
+
+        switch (op) {
+        case GDB_AX_ADD:           a += b; break;
+        case GDB_AX_SUB:           a -= b; break;
+        case GDB_AX_MUL:           a *= b; break;
+        case GDB_AX_BIT_AND:       a &= b; break;
+        case GDB_AX_BIT_OR:        a |= b; break;
+        case GDB_AX_BIT_XOR:       a ^= b; break;
+        case GDB_AX_EQUAL:         a = (a == b); break;
+        case GDB_AX_LESS_SIGNED:   a = ((int64_t)a < (int64_t)b); break;
+        case GDB_AX_LESS_UNSIGNED: a = (a < b); break;
+        case GDB_AX_LSH:           a = (b < 64) ? a << b : 0; break;
+        case GDB_AX_RSH_UNSIGNED:  a = (b < 64) ? a >> b : 0; break;
+        case GDB_AX_RSH_SIGNED:
+            a = (uint64_t)((int64_t)a >> (b < 64 ? b : 63));
+            break;
+        case GDB_AX_DIV_UNSIGNED:
+        case GDB_AX_REM_UNSIGNED:
+            if (b == 0) {
+                return GDB_EOF;
+            }
+            a = (op == GDB_AX_DIV_UNSIGNED) ? a / b : a % b;
+            break;
+        case GDB_AX_DIV_SIGNED:
+        case GDB_AX_REM_SIGNED:
+            if (b == 0) {
+                return GDB_EOF;
+            }
+            if ((int64_t)b == -1) {
+                /* Sidesteps the overflow of INT64_MIN / -1 */
+                a = (op == GDB_AX_DIV_SIGNED) ? -a : 0;
+            } else if (op == GDB_AX_DIV_SIGNED) {
+                a = (uint64_t)((int64_t)a / (int64_t)b);
+            } else {
+                a = (uint64_t)((int64_t)a % (int64_t)b);
+            }
+            break;
+
+        case GDB_AX_TRACE:
+        case GDB_AX_TRACENZ:
+            /* addr size => */
+            GDB_AX_NEED(2);
+            b = stack[--sp];
+            a = stack[--sp];
+            if (!frame) {
+                return GDB_EOF;
+            }
+            if (b > GDB_TRACE_FRAME_DATA) {
+                b = GDB_TRACE_FRAME_DATA;
+            }
+            gdb_trace_collect_mem(state, frame, a, b, op == GDB_AX_TRACENZ);
+            continue;
+        case GDB_AX_TRACE_QUICK:
+        case GDB_AX_TRACE16:
+            /* addr => addr */
+            GDB_AX_NEED(1);
+            if (!frame) {
+                return GDB_EOF;
+            }
+            gdb_trace_collect_mem(state, frame, stack[sp-1], imm, 0);
+            continue;
+        case GDB_AX_LOG_NOT:
+            GDB_AX_NEED(1);
+            stack[sp-1] = !stack[sp-1];
+            continue;
+        case GDB_AX_BIT_NOT:
+            GDB_AX_NEED(1);
+            stack[sp-1] = ~stack[sp-1];
+            continue;
+        case GDB_AX_EXT:
+            GDB_AX_NEED(1);
+            if (imm == 0 || imm > 64) {
+                return GDB_EOF;
+            }
+            if (imm < 64) {
+                b = (uint64_t)1 << (imm-1);
+                stack[sp-1] &= (b << 1)-1;
+                stack[sp-1] = (stack[sp-1] ^ b) - b;
+            }
+            continue;
+        case GDB_AX_ZERO_EXT:
+            GDB_AX_NEED(1);
+            if (imm < 64) {
+                stack[sp-1] &= ((uint64_t)1 << imm)-1;
+            }
+            continue;
+        case GDB_AX_REF8:
+        case GDB_AX_REF16:
+        case GDB_AX_REF32:
+        case GDB_AX_REF64:
+            GDB_AX_NEED(1);
+            if (gdb_ax_ref(state, stack[sp-1], 1 << (op-GDB_AX_REF8),
+                           &stack[sp-1]) == GDB_EOF) {
+                return GDB_EOF;
+            }
+            continue;
+        case GDB_AX_IF_GOTO:
+            GDB_AX_NEED(1);
+            if (stack[--sp]) {
+                pc = imm;
+            }
+            continue;
+        case GDB_AX_GOTO:
+            pc = imm;
+            continue;
+        case GDB_AX_CONST8:
+        case GDB_AX_CONST16:
+        case GDB_AX_CONST32:
+        case GDB_AX_CONST64:
+            GDB_AX_PUSH(imm);
+            continue;
+        case GDB_AX_REG:
+            if (gdb_ax_reg(state, imm, &a) == GDB_EOF) {
+                return GDB_EOF;
+            }
+            GDB_AX_PUSH(a);
+            continue;
+        case GDB_AX_END:
+            GDB_AX_NEED(1);
+            *result = stack[sp-1];
+            return 0;
+        case GDB_AX_DUP:
+            GDB_AX_NEED(1);
+            GDB_AX_PUSH(stack[sp-1]);
+            continue;
+        case GDB_AX_POP:
+            GDB_AX_NEED(1);
+            sp -= 1;
+            continue;
+        case GDB_AX_SWAP:
+            GDB_AX_NEED(2);
+            a = stack[sp-1];
+            stack[sp-1] = stack[sp-2];
+            stack[sp-2] = a;
+            continue;
+        case GDB_AX_PICK:
+            GDB_AX_NEED(imm+1);
+            GDB_AX_PUSH(stack[sp-1-imm]);
+            continue;
+        case GDB_AX_ROT:
+            /* a b c => c a b */
+            GDB_AX_NEED(3);
+            a = stack[sp-1];
+            stack[sp-1] = stack[sp-2];
+            stack[sp-2] = stack[sp-3];
+            stack[sp-3] = a;
+            continue;
+        default:
+            return GDB_EOF;
+        }
+
+        /* Binary operator result replaces a */
+        stack[sp-1] = a;
+    }
+
+#undef GDB_AX_NEED
+#undef GDB_AX_PUSH
+
+    return GDB_EOF;
+}
+
+/// Breakpoint conditions held at once, over all breakpoints
+#ifndef GDB_BREAK_COND_MAX
+#define GDB_BREAK_COND_MAX 16
+#endif
+
+/// Longest breakpoint condition bytecode
+#ifndef GDB_BREAK_COND_LEN
+#define GDB_BREAK_COND_LEN 64
+#endif
+
+/**
+ * @brief Conditions attached to 'Z0'/'Z1' breakpoints, keyed by address.
+ *
+ * A breakpoint with several conditions stops when any of them is true.
+ */
+struct gdb_break_conds {
+    struct {
+        address       addr; ///< Breakpoint address
+        unsigned int  len;  ///< Bytecode length, 0 for a free entry
+        unsigned char code[GDB_BREAK_COND_LEN];
+    } conds[GDB_BREAK_COND_MAX];
+    unsigned int count; ///< Used entries
+};
+
+static struct gdb_break_conds gdb_break_conds;
+
+#if GDB_FEATURE_BREAK
+/**
+ * @brief Drop the conditions of a breakpoint.
+ *
+ * @param addr Breakpoint address
+ */
+static void gdb_break_cond_clear(address addr)
+{
+    unsigned int i;
+
+    for (i = 0; gdb_break_conds.count && i < GDB_BREAK_COND_MAX; i++) {
+        if (gdb_break_conds.conds[i].len &&
+            gdb_break_conds.conds[i].addr == addr) {
+            gdb_break_conds.conds[i].len = 0;
+            gdb_break_conds.count -= 1;
+        }
+    }
+}
+
+/**
+ * @brief Parse the condition list of a 'Z' packet, 'Xlen,expr' repeated.
+ *
+ * gdb sends the conditions back to back, a ';' between them is accepted
+ * too. Parsing stops at anything else, such as a 'cmds:' list.
+ *
+ * @param addr Breakpoint address
+ * @param buf Condition list
+ * @param buf_len Length of the condition list
+ * @return 0 on success, or GDB_EOF if malformed or out of room
+ */
+static int gdb_break_cond_parse(address addr, const char *buf,
+                                unsigned int buf_len)
+{
+    const char *ptr, *end, *ptr_next;
+    unsigned int i, len;
+
+    ptr = buf;
+    end = buf+buf_len;
+    i = 0;
+    for (;;) {
+        if (ptr < end && *ptr == ';') {
+            ptr += 1;
+        }
+        if (ptr >= end || *ptr != 'X') {
+            return 0;
+        }
+        ptr += 1;
+
+        len = gdb_strtol(ptr, end-ptr, 16, &ptr_next);
+        if (!ptr_next || ptr_next >= end || *ptr_next != ',' ||
+            len == 0 || len > GDB_BREAK_COND_LEN ||
+            (unsigned int)(end-ptr_next-1) < len*2) {
+            return GDB_EOF;
+        }
+        ptr = ptr_next+1;
+
+        while (i < GDB_BREAK_COND_MAX && gdb_break_conds.conds[i].len) {
+            i++;
+        }
+        if (i == GDB_BREAK_COND_MAX ||
+            gdb_dec_hex(ptr, len*2, (char *)gdb_break_conds.conds[i].code,
+                        len) == GDB_EOF) {
+            return GDB_EOF;
+        }
+        gdb_break_conds.conds[i].addr = addr;
+        gdb_break_conds.conds[i].len  = len;
+        gdb_break_conds.count += 1;
+        ptr += len*2;
+    }
+}
+#endif
+
+/**
+ * @brief Decide whether a breakpoint hit is reported to the debugger.
+ *
+ * Called by the architecture on a breakpoint trap, with the registers
+ * loaded, before entering gdb_main(), by architectures that set
+ * GDB_HAVE_SYS_BREAK_COND. A condition that fails to evaluate counts as true,
+ * so a bad expression never hides a stop.
+ *
+ * @param state Pointer to the GDB state object
+ * @param addr Address of the breakpoint that was hit
+ * @return 1 to report the stop, 0 to resume silently
+ */
+int gdb_break_cond_check(struct gdb_state *state, address addr)
+{
+    unsigned int i;
+    int found;
+    uint64_t val;
+
+    if (!gdb_break_conds.count) {
+        return 1;
+    }
+
+    found = 0;
+    for (i = 0; i < GDB_BREAK_COND_MAX; i++) {
+        if (!gdb_break_conds.conds[i].len ||
+            gdb_break_conds.conds[i].addr != addr) {
+            continue;
+        }
+        found = 1;
+        if (gdb_ax_eval(state, NULL, gdb_break_conds.conds[i].code,
+                        gdb_break_conds.conds[i].len, &val) == GDB_EOF ||
+            val) {
+            return 1;
+        }
+    }
+
+    return !found;
+}
+
+/// Tracepoint locations defined at once
+#ifndef GDB_TRACE_POINTS
+#define GDB_TRACE_POINTS 16
+#endif
+
+/// Collection actions, over all tracepoints
+#ifndef GDB_TRACE_ACTIONS
+#define GDB_TRACE_ACTIONS 32
+#endif
+
+/// Bytes of condition and action bytecode, over all tracepoints
+#ifndef GDB_TRACE_CODE
+#define GDB_TRACE_CODE 512
+#endif
+
+/// Base register of a memory action collecting from a fixed address
+#define GDB_TRACE_ABSOLUTE 0xffffffffu
+
+/**
+ * @brief One location of a tracepoint, defined with 'QTDP'.
+ */
+struct gdb_tracepoint {
+    unsigned int number;   ///< Tracepoint number, shared by its locations
+    address      addr;     ///< Location address
+    int          enabled;  ///< Collects when hit
+    unsigned int pass;     ///< Hits that stop the trace, 0 for no limit
+    unsigned int hits;     ///< Hits since the trace started
+    unsigned int cond;     ///< Offset of the condition in the code pool
+    unsigned int cond_len; ///< Length of the condition, 0 for none
+    unsigned int action;   ///< First action
+    unsigned int actions;  ///< Number of actions
+};
+
+/**
+ * @brief Something a tracepoint collects besides the registers.
+ */
+struct gdb_trace_action {
+    char         type;    ///< 'M' for a memory range, 'X' for an expression
+    unsigned int basereg; ///< 'M': register the range is relative to, or GDB_TRACE_ABSOLUTE
+    address      offset;  ///< 'M': start of the range; 'X': offset in the code pool
+    unsigned int len;     ///< 'M': length of the range; 'X': length of the bytecode
+};
+
+/**
+ * @brief Tracepoint definitions and trace run state.
+ *
+ * Definitions only grow between 'QTinit' packets, so the actions of a
+ * tracepoint and all bytecode live in flat pools.
+ */
+struct gdb_trace {
+    struct gdb_tracepoint   points[GDB_TRACE_POINTS];
+    struct gdb_trace_action actions[GDB_TRACE_ACTIONS];
+    unsigned char           code[GDB_TRACE_CODE];
+    unsigned int npoints;     ///< Used entries of points
+    unsigned int nactions;    ///< Used entries of actions
+    unsigned int ncode;       ///< Used bytes of code
+    int          running;     ///< Tracepoints collect when hit
+    const char  *stop_reason; ///< 'qTStatus' stop reason field, NULL if never run
+    unsigned int stop_tp;     ///< Tracepoint that stopped the trace
+};
+
+static struct gdb_trace gdb_trace;
+
+/**
+ * @brief Stop the trace from trap time.
+ *
+ * The breakpoint instructions stay in memory until the next 'QTStop',
+ * 'QTStart' or 'QTinit', and hits on them resume without collecting.
+ *
+ * @param reason Stop reason field reported by 'qTStatus'
+ * @param tp Tracepoint that stopped the trace
+ */
+static void gdb_trace_halt(const char *reason, unsigned int tp)
+{
+    gdb_trace.running     = 0;
+    gdb_trace.stop_reason = reason;
+    gdb_trace.stop_tp     = tp;
+}
+
+/**
+ * @brief Fill a new trace frame for a tracepoint hit.
+ *
+ * @param state Pointer to the GDB state object
+ * @param tp Tracepoint that was hit
+ */
+static void gdb_trace_collect(struct gdb_state *state,
+                              struct gdb_tracepoint *tp)
+{
+    struct gdb_trace_frame *frame;
+    struct gdb_trace_action *act;
+    unsigned int i;
+    uint64_t val;
+
+    if (gdb_trace_buf.count == GDB_TRACE_FRAMES) {
+        if (!gdb_trace_buf.circular) {
+            gdb_trace_halt(";tfull:", 0);
+            return;
+        }
+        gdb_trace_buf.head = (gdb_trace_buf.head+1) & (GDB_TRACE_FRAMES-1);
+        gdb_trace_buf.count -= 1;
+    }
+
+    frame = &gdb_trace_buf.frames[(gdb_trace_buf.head+gdb_trace_buf.count) &
+                                  (GDB_TRACE_FRAMES-1)];
+    gdb_trace_buf.count   += 1;
+    gdb_trace_buf.created += 1;
+
+    frame->tpnum = tp->number;
+    frame->len   = 0;
+    gdb_memcpy((char *)frame->regs, (const char *)state->registers,
+               sizeof(frame->regs));
+    /* The frame shows the tracepoint address, not where the trap left PC */
+    frame->regs[GDB_CPU_REG_PC] = tp->addr;
+
+    for (i = 0; i < tp->actions; i++) {
+        act = &gdb_trace.actions[tp->action+i];
+        if (act->type == 'X') {
+            gdb_ax_eval(state, frame, gdb_trace.code+act->offset, act->len,
+                        &val);
+            continue;
+        }
+
+        val = 0;
+        if (act->basereg != GDB_TRACE_ABSOLUTE &&
+            gdb_ax_reg(state, act->basereg, &val) == GDB_EOF) {
+            continue;
+        }
+        gdb_trace_collect_mem(state, frame, val+act->offset, act->len, 0);
+    }
+
+    tp->hits += 1;
+    if (tp->pass && tp->hits >= tp->pass) {
+        gdb_trace_halt(";tpasscount:", tp->number);
+    }
+}
+
+/**
+ * @brief Handle a breakpoint trap at a possible tracepoint.
+ *
+ * Called by the architecture on a breakpoint trap, with the registers
+ * loaded, before entering gdb_main(). Every enabled location at addr whose
+ * condition holds collects a frame.
+ *
+ * @param state Pointer to the GDB state object
+ * @param addr Address of the breakpoint that was hit
+ * @return 1 if the trap belongs to tracing alone and the target should
+ *         resume, 0 if the debugger has a breakpoint there too, or none of
+ *         this is tracing's
+ */
+int gdb_trace_hit(struct gdb_state *state, address addr)
+{
+    struct gdb_tracepoint *tp;
+    unsigned int i, slot;
+    uint64_t val;
+
+    slot = gdb_sw_break_find(addr);
+    if (!(gdb_sw_breaks.slots[slot].flags & GDB_SW_BREAK_TRACE)) {
+        return 0;
+    }
+
+    for (i = 0; gdb_trace.running && i < gdb_trace.npoints; i++) {
+        tp = &gdb_trace.points[i];
+        if (tp->addr != addr || !tp->enabled) {
+            continue;
+        }
+        if (tp->cond_len &&
+            (gdb_ax_eval(state, NULL, gdb_trace.code+tp->cond, tp->cond_len,
+                         &val) == GDB_EOF || !val)) {
+            continue;
+        }
+        gdb_trace_collect(state, tp);
+    }
+
+    return !(gdb_sw_breaks.slots[slot].flags & GDB_SW_BREAK_WANTED);
+}
+
+#if GDB_FEATURE_TRACE
+/**
+ * @brief Take the breakpoint instructions of all tracepoints out of the
+ * software breakpoint table.
+ */
+static void gdb_trace_unplant(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < gdb_trace.npoints; i++) {
+        gdb_sw_break_clear(gdb_trace.points[i].addr, GDB_SW_BREAK_TRACE);
+    }
+}
+
+/**
+ * @brief Parse a hex number followed by a separator.
+ *
+ * @param ptr Start of the number, moved past the separator
+ * @param end End of the packet
+ * @param sep Separator that must follow, or '\0' for any
+ * @param val Set to the number
+ * @return 0 on success, or GDB_EOF if malformed
+ */
+static int gdb_trace_parse_hex(const char **ptr, const char *end, char sep,
+                               address *val)
+{
+    const char *ptr_next;
+
+    *val = gdb_strtol(*ptr, end-*ptr, 16, &ptr_next);
+    if (!ptr_next) {
+        return GDB_EOF;
+    }
+    if (sep) {
+        if (ptr_next >= end || *ptr_next != sep) {
+            return GDB_EOF;
+        }
+        ptr_next += 1;
+    }
+    *ptr = ptr_next;
+    return 0;
+}
+
+/**
+ * @brief Parse 'len,bytecode' into the code pool.
+ *
+ * @param ptr Start of the length, moved past the bytecode
+ * @param end End of the packet
+ * @param off Set to the offset of the bytecode in the pool
+ * @param len Set to the length of the bytecode
+ * @return 0 on success, or GDB_EOF if malformed or out of room
+ */
+static int gdb_trace_parse_code(const char **ptr, const char *end,
+                                unsigned int *off, unsigned int *len)
+{
+    address n;
+
+    if (gdb_trace_parse_hex(ptr, end, ',', &n) == GDB_EOF ||
+        n == 0 || n > GDB_TRACE_CODE-gdb_trace.ncode ||
+        (address)(end-*ptr) < n*2 ||
+        gdb_dec_hex(*ptr, n*2, (char *)gdb_trace.code+gdb_trace.ncode,
+                    n) == GDB_EOF) {
+        return GDB_EOF;
+    }
+
+    *off = gdb_trace.ncode;
+    *len = n;
+    gdb_trace.ncode += n;
+    *ptr += n*2;
+    return 0;
+}
+
+/**
+ * @brief Handle 'QTinit', drop all tracepoints and trace frames.
+ *
+ * @param state Pointer to the GDB state object
+ * @param pkt_buf Received packet
+ * @param pkt_len Length of the received packet
+ *
+ * @return Status of the packet sending operation
+ */
+static int gdb_cmd_trace_init(struct gdb_state *state, char *pkt_buf,
+                              unsigned int pkt_len)
+{
+    char buf[4];
+
+    gdb_trace_unplant();
+    gdb_trace.npoints     = 0;
+    gdb_trace.nactions    = 0;
+    gdb_trace.ncode       = 0;
+    gdb_trace.running     = 0;
+    gdb_trace.stop_reason = NULL;
+
+    gdb_trace_buf.head     = 0;
+    gdb_trace_buf.count    = 0;
+    gdb_trace_buf.created  = 0;
+    gdb_trace_buf.selected = 0;
+
+    return gdb_send_ok_packet(state, buf, sizeof(buf));
+}
+
+/**
+ * @brief Handle 'QTDP', define a tracepoint location or add actions to it.
+ *
+ * 'QTDP:n:addr:E|D:step:pass[:Xlen,cond][-]' defines a location, and
+ * 'QTDP:-n:addr:action...[-]' adds 'R', 'M' and 'X' actions to the location
+ * defined last. The registers are collected on every hit, so 'R' masks are
+ * ignored. While-stepping actions and fast tracepoints are refused.
+ *
+ * @param state Pointer to the GDB state object
+ * @param pkt_buf Received packet
+ * @param pkt_len Length of the received packet
+ *
+ * @return Status of the packet sending operation
+ */
+static int gdb_cmd_trace_define(struct gdb_state *state, char *pkt_buf,
+                                unsigned int pkt_len)
+{
+    char buf[4];
+    const char *ptr, *end;
+    struct gdb_tracepoint *tp;
+    struct gdb_trace_action *act;
+    address number, addr, val;
+    unsigned int off, len;
+
+    ptr = pkt_buf+5;
+    end = pkt_buf+pkt_len;
+    if (gdb_trace.running) {
+        return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+    }
+
+    if (ptr < end && *ptr == '-') {
+        ptr += 1;
+        if (gdb_trace_parse_hex(&ptr, end, ':', &number) == GDB_EOF ||
+            gdb_trace_parse_hex(&ptr, end, ':', &addr) == GDB_EOF ||
+            !gdb_trace.npoints) {
+            return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+        }
+        tp = &gdb_trace.points[gdb_trace.npoints-1];
+        if (tp->number != number || tp->addr != addr) {
+            return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+        }
+
+        while (ptr < end && *ptr != '-') {
+            if (*ptr == 'R') {
+                ptr += 1;
+                if (gdb_trace_parse_hex(&ptr, end, '\0', &val) == GDB_EOF) {
+                    return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+                }
+                continue;
+            }
+            if ((*ptr != 'M' && *ptr != 'X') ||
+                gdb_trace.nactions == GDB_TRACE_ACTIONS ||
+                tp->action+tp->actions != gdb_trace.nactions) {
+                return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+            }
+
+            act = &gdb_trace.actions[gdb_trace.nactions];
+            act->type = *ptr++;
+            if (act->type == 'M') {
+                if (gdb_trace_parse_hex(&ptr, end, ',', &val) == GDB_EOF ||
+                    gdb_trace_parse_hex(&ptr, end, ',', &act->offset) == GDB_EOF ||
+                    gdb_trace_parse_hex(&ptr, end, '\0', &addr) == GDB_EOF) {
+                    return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+                }
+                act->basereg = val;
+                act->len     = addr;
+            } else {
+                if (gdb_trace_parse_code(&ptr, end, &off, &len) == GDB_EOF) {
+                    return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+                }
+                act->offset = off;
+                act->len    = len;
+            }
+            gdb_trace.nactions += 1;
+            tp->actions += 1;
+        }
+
+        return gdb_send_ok_packet(state, buf, sizeof(buf));
+    }
+
+    if (gdb_trace.npoints == GDB_TRACE_POINTS) {
+        return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+    }
+    tp = &gdb_trace.points[gdb_trace.npoints];
+
+    if (gdb_trace_parse_hex(&ptr, end, ':', &number) == GDB_EOF ||
+        gdb_trace_parse_hex(&ptr, end, ':', &addr) == GDB_EOF ||
+        ptr+1 >= end || (*ptr != 'E' && *ptr != 'D') || ptr[1] != ':') {
+        return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+    }
+    tp->enabled = (*ptr == 'E');
+    ptr += 2;
+
+    /* No while-stepping */
+    if (gdb_trace_parse_hex(&ptr, end, ':', &val) == GDB_EOF || val != 0 ||
+        gdb_trace_parse_hex(&ptr, end, '\0', &val) == GDB_EOF) {
+        return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+    }
+    tp->number   = number;
+    tp->addr     = addr;
+    tp->pass     = val;
+    tp->hits     = 0;
+    tp->cond_len = 0;
+    tp->action   = gdb_trace.nactions;
+    tp->actions  = 0;
+
+    /* A condition may follow */
+    while (ptr < end && *ptr == ':') {
+        ptr += 1;
+        if (ptr >= end || *ptr != 'X') {
+            return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+        }
+        ptr += 1;
+        if (gdb_trace_parse_code(&ptr, end, &tp->cond,
+                                 &tp->cond_len) == GDB_EOF) {
+            return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+        }
+    }
+
+    gdb_trace.npoints += 1;
+    return gdb_send_ok_packet(state, buf, sizeof(buf));
+}
+
+/**
+ * @brief Handle 'QTStart', plant the tracepoints and start collecting.
+ *
+ * @param state Pointer to the GDB state object
+ * @param pkt_buf Received packet
+ * @param pkt_len Length of the received packet
+ *
+ * @return Status of the packet sending operation
+ */
+static int gdb_cmd_trace_start(struct gdb_state *state, char *pkt_buf,
+                               unsigned int pkt_len)
+{
+    char buf[4];
+    unsigned int i;
+
+    gdb_trace_unplant();
+    for (i = 0; i < gdb_trace.npoints; i++) {
+        gdb_trace.points[i].hits = 0;
+        if (gdb_trace.points[i].enabled &&
+            gdb_sw_break_set(state, gdb_trace.points[i].addr,
+                             GDB_SW_BREAK_TRACE) == GDB_EOF) {
+            gdb_trace_unplant();
+            return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+        }
+    }
+
+    gdb_trace_buf.head     = 0;
+    gdb_trace_buf.count    = 0;
+    gdb_trace_buf.created  = 0;
+    gdb_trace_buf.selected = 0;
+
+    gdb_trace.running     = 1;
+    gdb_trace.stop_reason = ";tnotrun:";
+    gdb_trace.stop_tp     = 0;
+
+    return gdb_send_ok_packet(state, buf, sizeof(buf));
+}
+
+/**
+ * @brief Handle 'QTStop', stop collecting and remove the tracepoints.
+ *
+ * @param state Pointer to the GDB state object
+ * @param pkt_buf Received packet
+ * @param pkt_len Length of the received packet
+ *
+ * @return Status of the packet sending operation
+ */
+static int gdb_cmd_trace_stop(struct gdb_state *state, char *pkt_buf,
+                              unsigned int pkt_len)
+{
+    char buf[4];
+
+    if (gdb_trace.running) {
+        gdb_trace_halt(";tstop:", 0);
+    }
+    gdb_trace_unplant();
+
+    return gdb_send_ok_packet(state, buf, sizeof(buf));
+}
+
+/**
+ * @brief Handle 'QTBuffer:circular:n', choose what a full buffer does.
+ *
+ * @param state Pointer to the GDB state object
+ * @param pkt_buf Received packet
+ * @param pkt_len Length of the received packet
+ *
+ * @return Status of the packet sending operation
+ */
+static int gdb_cmd_trace_buffer(struct gdb_state *state, char *pkt_buf,
+                                unsigned int pkt_len)
+{
+    char buf[4];
+
+    if (pkt_len != 19 || gdb_strmatch(pkt_buf, 18, "QTBuffer:circular:") ||
+        (pkt_buf[18] != '0' && pkt_buf[18] != '1')) {
+        return gdb_send_packet(state, "", 0);
+    }
+    gdb_trace_buf.circular = (pkt_buf[18] == '1');
+
+    return gdb_send_ok_packet(state, buf, sizeof(buf));
+}
+
+/**
+ * @brief Append 'key' and a hex value to a reply being built.
+ *
+ * @param buf Reply buffer
+ * @param buf_len Size of the reply buffer
+ * @param size Bytes of the reply so far, updated
+ * @param key Text to append before the value
+ * @param val Value to append
+ * @return 0 on success, or GDB_EOF if the buffer is too small
+ */
+static int gdb_trace_append(char *buf, unsigned int buf_len,
+                            unsigned int *size, const char *key,
+                            unsigned int val)
+{
+    int status;
+
+    status = gdb_strcpy(buf+*size, buf_len-*size, key);
+    if (status == GDB_EOF) {
+        return GDB_EOF;
+    }
+    *size += status;
+
+    status = gdb_utoa(buf+*size, buf_len-*size, val, 16);
+    if (status == GDB_EOF) {
+        return GDB_EOF;
+    }
+    *size += status;
+    return 0;
+}
+
+/**
+ * @brief Handle 'qTStatus', report whether a trace runs and the buffer use.
+ *
+ * @param state Pointer to the GDB state object
+ * @param pkt_buf Received packet
+ * @param pkt_len Length of the received packet
+ *
+ * @return Status of the packet sending operation
+ */
+static int gdb_cmd_trace_status(struct gdb_state *state, char *pkt_buf,
+                                unsigned int pkt_len)
+{
+    char buf[160];
+    unsigned int size;
+    const char *reason;
+
+    reason = gdb_trace.stop_reason ? gdb_trace.stop_reason : ";tnotrun:";
+
+    size = 0;
+    if (gdb_trace_append(buf, sizeof(buf), &size, "T",
+                         gdb_trace.running) == GDB_EOF ||
+        gdb_trace_append(buf, sizeof(buf), &size, reason,
+                         gdb_trace.stop_tp) == GDB_EOF ||
+        gdb_trace_append(buf, sizeof(buf), &size, ";tframes:",
+                         gdb_trace_buf.count) == GDB_EOF ||
+        gdb_trace_append(buf, sizeof(buf), &size, ";tcreated:",
+                         gdb_trace_buf.created) == GDB_EOF ||
+        gdb_trace_append(buf, sizeof(buf), &size, ";tfree:",
+                         (GDB_TRACE_FRAMES-gdb_trace_buf.count) *
+                         sizeof(struct gdb_trace_frame)) == GDB_EOF ||
+        gdb_trace_append(buf, sizeof(buf), &size, ";tsize:",
+                         sizeof(gdb_trace_buf.frames)) == GDB_EOF ||
+        gdb_trace_append(buf, sizeof(buf), &size, ";circular:",
+                         gdb_trace_buf.circular) == GDB_EOF ||
+        gdb_trace_append(buf, sizeof(buf), &size, ";disconn:", 0) == GDB_EOF) {
+        return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+    }
+
+    return gdb_send_packet(state, buf, size);
+}
+
+/**
+ * @brief Handle 'QTFrame', select the trace frame the debugger looks at.
+ *
+ * 'QTFrame:n' selects frame n, and -1 goes back to the live target.
+ * 'pc:addr', 'tdp:t', 'range:start:end' and 'outside:start:end' select the
+ * next frame after the selected one that matches. A frame that isn't found
+ * also goes back to the live target.
+ *
+ * @param state Pointer to the GDB state object
+ * @param pkt_buf Received packet
+ * @param pkt_len Length of the received packet
+ *
+ * @return Status of the packet sending operation
+ */
+static int gdb_cmd_trace_frame(struct gdb_state *state, char *pkt_buf,
+                               unsigned int pkt_len)
+{
+    char buf[24];
+    const char *ptr, *end, *sep;
+    struct gdb_trace_frame *frame;
+    unsigned int i, size;
+    address lo, hi, pc;
+    char mode;
+
+    ptr = pkt_buf+8;
+    end = pkt_buf+pkt_len;
+    sep = gdb_memchr(ptr, ':', end-ptr);
+    mode = 'n';
+    if (sep) {
+        if (!gdb_strmatch(ptr, sep-ptr, "pc")) {
+            mode = 'p';
+        } else if (!gdb_strmatch(ptr, sep-ptr, "tdp")) {
+            mode = 't';
+        } else if (!gdb_strmatch(ptr, sep-ptr, "range")) {
+            mode = 'r';
+        } else if (!gdb_strmatch(ptr, sep-ptr, "outside")) {
+            mode = 'o';
+        } else {
+            return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+        }
+        ptr = sep+1;
+    }
+
+    hi = 0;
+    if (gdb_trace_parse_hex(&ptr, end, (mode == 'r' || mode == 'o') ? ':'
+                                                                    : '\0',
+                            &lo) == GDB_EOF ||
+        ((mode == 'r' || mode == 'o') &&
+         gdb_trace_parse_hex(&ptr, end, '\0', &hi) == GDB_EOF)) {
+        return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+    }
+
+    if (mode == 'n') {
+        i = lo;
+        frame = gdb_trace_frame_get(i);
+    } else {
+        i = gdb_trace_buf.selected ? gdb_trace_buf.frame+1 : 0;
+        for (; (frame = gdb_trace_frame_get(i)); i++) {
+            pc = frame->regs[GDB_CPU_REG_PC];
+            if ((mode == 'p' && pc == lo) ||
+                (mode == 't' && frame->tpnum == lo) ||
+                (mode == 'r' && pc >= lo && pc <= hi) ||
+                (mode == 'o' && (pc < lo || pc > hi))) {
+                break;
+            }
+        }
+    }
+
+    if (!frame) {
+        gdb_trace_buf.selected = 0;
+        return gdb_send_packet(state, "F-1", 3);
+    }
+    gdb_trace_buf.selected = 1;
+    gdb_trace_buf.frame    = i;
+
+    size = 0;
+    if (gdb_trace_append(buf, sizeof(buf), &size, "F", i) == GDB_EOF ||
+        gdb_trace_append(buf, sizeof(buf), &size, "T",
+                         frame->tpnum) == GDB_EOF) {
+        return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+    }
+    return gdb_send_packet(state, buf, size);
+}
+#endif /* GDB_FEATURE_TRACE */
+
+#if GDB_FEATURE_BREAK
+/**
+ * @brief Handle 'Z type,addr,kind' and 'z type,addr,kind', set or clear a
+ * breakpoint or watchpoint.
+ *
+ * Types the stub can't handle get an empty reply, so gdb falls back to
+ * other means. Running out of hardware slots gets an error, which gdb
+ * reports to the user.
+ *
+ * Breakpoints ('Z0'/'Z1') may carry a condition list. Setting a breakpoint
+ * again replaces its conditions, and one set without any stops always.
+ *
+ * @param state Pointer to the GDB state object
+ * @param pkt_buf Received packet
+ * @param pkt_len Length of the received packet
+ *
+ * @return Status of the packet sending operation
+ */
+static int gdb_cmd_break(struct gdb_state *state, char *pkt_buf,
+                         unsigned int pkt_len)
+{
+    char buf[4];
+    const char *ptr_next;
+    address addr;
+    unsigned int kind, type;
+    int set, status, cond_status;
+
+    set = (pkt_buf[0] == 'Z');
+    status = 0;
+    cond_status = 0;
+    if (pkt_len < 3 || pkt_buf[2] != ',' ||
+        gdb_parse_mem_args(pkt_buf+3, pkt_len-3, &addr, &kind,
+                           &ptr_next) == GDB_EOF) {
+        return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+    }
+
+    type = pkt_buf[1]-'0';
+    if (type > GDB_HW_WATCH_ACCESS ||
+        (type && !(GDB_HW_BREAK_TYPES & (1<<type)))) {
+        return gdb_send_packet(state, "", 0);
+    }
+
+    /* kind of a software breakpoint is the size of the instruction */
+    if (type == 0 && kind != 1) {
+        return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+    }
+
+    /* Conditions apply to breakpoints, not watchpoints */
+    if (type <= GDB_HW_BREAK_EXEC) {
+        gdb_break_cond_clear(addr);
+        if (set && gdb_break_cond_parse(addr, ptr_next,
+                                        pkt_len-(ptr_next-pkt_buf)) == GDB_EOF) {
+            /* Don't leave the breakpoint stopping unconditionally */
+            gdb_break_cond_clear(addr);
+            set = 0;
+            cond_status = GDB_EOF;
+        }
+    }
+
+    if (type == 0) {
+        if (set) {
+            status = gdb_sw_break_set(state, addr, GDB_SW_BREAK_WANTED);
+        } else {
+            gdb_sw_break_clear(addr, GDB_SW_BREAK_WANTED);
+            status = 0;
+        }
+    } else {
+#if GDB_HAVE_SYS_HW_BREAK
+        if (set) {
+            status = gdb_sys_hw_break_set(state, type, addr, kind);
+        } else {
+            status = gdb_sys_hw_break_clear(state, type, addr, kind);
+        }
+#endif
+    }
+
+    if (status == GDB_EOF || cond_status == GDB_EOF) {
+        if (set) {
+            gdb_break_cond_clear(addr);
+        }
+        return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+    }
+
+    return gdb_send_ok_packet(state, buf, sizeof(buf));
+}
+#endif
+
+/*
+ * Architectures with more than one CPU provide the CPU hooks below and set
+ * GDB_HAVE_SYS_CPUS. Each CPU is a thread to gdb, with thread id cpu+1.
+ *
+ * gdb_sys_cpu_next() returns the next CPU after cpu, the first for GDB_EOF,
+ * or GDB_EOF when there are no more; unless in non-stop mode, they are all
+ * stopped. gdb_sys_cpu_stopped() returns the CPU running the stub, whose
+ * trap is being reported. gdb_sys_cpu_select() puts a CPU's registers in
+ * gdb_state.registers, and returns GDB_EOF if it isn't stopped.
+ */
+#ifndef GDB_HAVE_SYS_CPUS
+#ifdef GDBSTUB_ARCH_X86
+#define GDB_HAVE_SYS_CPUS 1
+#else
+#define GDB_HAVE_SYS_CPUS 0
+#endif
+#endif
+
+#if GDB_HAVE_SYS_CPUS
+int gdb_sys_cpu_next(struct gdb_state *state, int cpu);
+int gdb_sys_cpu_stopped(struct gdb_state *state);
+int gdb_sys_cpu_select(struct gdb_state *state, int cpu);
+
+/**
+ * @brief Thread state set by gdb.
+ */
+struct gdb_threads {
+    int resume; ///< Thread 'c'/'s' act on, from 'Hc' or vCont; 0 or -1 for any
+    int next;   ///< CPU 'qsThreadInfo' lists from
+};
+
+static struct gdb_threads gdb_threads;
+
+#if GDB_FEATURE_THREADS || GDB_FEATURE_VCONT
+/**
+ * @brief Parse a thread id: -1 for all threads, 0 for any, else cpu+1.
+ *
+ * @param buf Pointer to the thread id.
+ * @param buf_len Length of the thread id, which must be all of it.
+ * @param thread Set to the thread id.
+ *
+ * @return 0 on success, or GDB_EOF if it is malformed
+ */
+static int gdb_thread_parse(const char *buf, unsigned int buf_len, int *thread)
+{
+    const char *end;
+
+    *thread = gdb_strtol(buf, buf_len, 16, &end);
+    if (!end || end != buf+buf_len || *thread < -1) {
+        return GDB_EOF;
+    }
+
+    return 0;
+}
+#endif
+
+/**
+ * @brief Map a thread id to its CPU. Any or all threads mean the CPU that
+ * stopped.
+ *
+ * @param state Pointer to the GDB state object
+ * @param thread Thread id
+ *
+ * @return The CPU number
+ */
+static int gdb_thread_cpu(struct gdb_state *state, int thread)
+{
+    return (thread > 0) ? thread-1 : gdb_sys_cpu_stopped(state);
+}
+
+#if GDB_FEATURE_THREADS || GDB_FEATURE_VCONT
+/**
+ * @brief Check that a thread id names a CPU.
+ *
+ * @param state Pointer to the GDB state object
+ * @param thread Thread id
+ *
+ * @return 1 if it does, 0 otherwise
+ */
+static int gdb_thread_alive(struct gdb_state *state, int thread)
+{
+    int cpu;
+
+    if (thread <= 0) {
+        return 1;
+    }
+    for (cpu = gdb_sys_cpu_next(state, GDB_EOF); cpu != GDB_EOF;
+         cpu = gdb_sys_cpu_next(state, cpu)) {
+        if (cpu == thread-1) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+#endif
+
+#if GDB_FEATURE_THREADS
+/**
+ * @brief Send the next part of the thread list, starting at a CPU.
+ *
+ * As many threads as fit go in each reply, 'l' ends the list.
+ *
+ * @param state Pointer to the GDB state object
+ * @param cpu First CPU to list, or GDB_EOF if the list is done
+ *
+ * @return Status of the packet sending operation
+ */
+static int gdb_thread_list(struct gdb_state *state, int cpu)
+{
+    char buf[64];
+    unsigned int size;
+    int status;
+
+    if (cpu == GDB_EOF) {
+        return gdb_send_packet(state, "l", 1);
+    }
+
+    size = 0;
+    while (cpu != GDB_EOF) {
+        buf[size] = size ? ',' : 'm';
+        status = gdb_utoa(buf+size+1, sizeof(buf)-size-1, cpu+1, 16);
+        if (status == GDB_EOF) {
+            /* The rest goes in the next reply */
+            break;
+        }
+        size += 1+status;
+        cpu = gdb_sys_cpu_next(state, cpu);
+    }
+    gdb_threads.next = cpu;
+
+    return gdb_send_packet(state, buf, size);
+}
+
+/**
+ * @brief Handle 'qfThreadInfo', start listing the threads.
+ *
+ * @param state Pointer to the GDB state object
+ * @param pkt_buf Received packet
+ * @param pkt_len Length of the received packet
+ *
+ * @return Status of the packet sending operation
+ */
+static int gdb_cmd_thread_info_first(struct gdb_state *state, char *pkt_buf,
+                                     unsigned int pkt_len)
+{
+    return gdb_thread_list(state, gdb_sys_cpu_next(state, GDB_EOF));
+}
+
+/**
+ * @brief Handle 'qsThreadInfo', continue listing the threads.
+ *
+ * @param state Pointer to the GDB state object
+ * @param pkt_buf Received packet
+ * @param pkt_len Length of the received packet
+ *
+ * @return Status of the packet sending operation
+ */
+static int gdb_cmd_thread_info_next(struct gdb_state *state, char *pkt_buf,
+                                    unsigned int pkt_len)
+{
+    return gdb_thread_list(state, gdb_threads.next);
+}
+
+/**
+ * @brief Handle 'qC', report the thread that stopped.
+ *
+ * @param state Pointer to the GDB state object
+ * @param pkt_buf Received packet
+ * @param pkt_len Length of the received packet
+ *
+ * @return Status of the packet sending operation
+ */
+static int gdb_cmd_current_thread(struct gdb_state *state, char *pkt_buf,
+                                  unsigned int pkt_len)
+{
+    char buf[16];
+    int status;
+
+    buf[0] = 'Q';
+    buf[1] = 'C';
+    status = gdb_utoa(buf+2, sizeof(buf)-2, gdb_sys_cpu_stopped(state)+1, 16);
+    if (status == GDB_EOF) {
+        return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+    }
+
+    return gdb_send_packet(state, buf, 2+status);
+}
+
+/**
+ * @brief Handle 'Hg thread' and 'Hc thread', pick the thread later register
+ * and resume commands act on.
+ *
+ * @param state Pointer to the GDB state object
+ * @param pkt_buf Received packet
+ * @param pkt_len Length of the received packet
+ *
+ * @return Status of the packet sending operation
+ */
+static int gdb_cmd_set_thread(struct gdb_state *state, char *pkt_buf,
+                              unsigned int pkt_len)
+{
+    char buf[4];
+    int thread;
+
+    if (pkt_len < 3 ||
+        gdb_thread_parse(pkt_buf+2, pkt_len-2, &thread) == GDB_EOF ||
+        !gdb_thread_alive(state, thread)) {
+        return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+    }
+
+    switch (pkt_buf[1]) {
+    case 'g':
+        /* A running thread's registers can't be read */
+        if (gdb_sys_cpu_select(state, gdb_thread_cpu(state, thread)) ==
+            GDB_EOF) {
+            return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+        }
+        break;
+    case 'c':
+        gdb_threads.resume = thread;
+        break;
+    default:
+        return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+    }
+
+    return gdb_send_ok_packet(state, buf, sizeof(buf));
+}
+
+/**
+ * @brief Handle 'T thread', check whether a thread is alive.
+ *
+ * @param state Pointer to the GDB state object
+ * @param pkt_buf Received packet
+ * @param pkt_len Length of the received packet
+ *
+ * @return Status of the packet sending operation
+ */
+static int gdb_cmd_thread_alive(struct gdb_state *state, char *pkt_buf,
+                                unsigned int pkt_len)
+{
+    char buf[4];
+    int thread;
+
+    if (pkt_len < 2 ||
+        gdb_thread_parse(pkt_buf+1, pkt_len-1, &thread) == GDB_EOF ||
+        thread <= 0 || !gdb_thread_alive(state, thread)) {
+        return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+    }
+
+    return gdb_send_ok_packet(state, buf, sizeof(buf));
+}
+#endif /* GDB_FEATURE_THREADS */
+#endif /* GDB_HAVE_SYS_CPUS */
+
+/**
+ * Returned by a command handler that resumed the target, to leave gdb_main().
+ * It must differ from every status the packet sending functions return.
+ */
+#define GDB_RESUME (-2)
+
+/* Fails to compile if GDB_RESUME collides with a packet sending status */
+typedef char gdb_resume_check[(GDB_RESUME == 0 || GDB_RESUME == 1 ||
+                               GDB_RESUME == GDB_EOF) ? -1 : 1];
+
+/**
+ * @brief Range being stepped through for 'vCont;r'.
+ */
+struct gdb_range_step {
+    int     active; ///< Range stepping is in progress
+    address start;  ///< First address of the range
+    address end;    ///< First address past the range
+};
+
+static struct gdb_range_step gdb_range_step;
+
+/**
+ * @brief Decide whether a single-step trap is swallowed by range stepping.
+ *
+ * Called by the architecture on a plain single-step trap, with the registers
+ * loaded, before entering gdb_main(). While PC stays in the range the target
+ * is stepped again without telling the debugger.
+ *
+ * @param state Pointer to the GDB state object
+ *
+ * @return 1 to resume stepping silently, 0 to stop and report
+ */
+int gdb_range_step_continue(struct gdb_state *state)
+{
+    address pc;
+
+    if (!gdb_range_step.active) {
+        return 0;
+    }
+
+    pc = state->registers[GDB_CPU_REG_PC];
+    if (pc-gdb_range_step.start < gdb_range_step.end-gdb_range_step.start) {
+        return 1;
+    }
+
+    gdb_range_step.active = 0;
+    return 0;
+}
+
+#if GDB_FEATURE_VCONT
+/**
+ * @brief Handle 'vCont?', list the supported vCont actions.
+ *
+ * @param state Pointer to the GDB state object
+ * @param pkt_buf Received packet
+ * @param pkt_len Length of the received packet
+ *
+ * @return Status of the packet sending operation
+ */
+static int gdb_cmd_vcont_query(struct gdb_state *state, char *pkt_buf,
+                               unsigned int pkt_len)
+{
+#if GDB_FEATURE_NONSTOP
+    return gdb_send_packet(state, "vCont;c;C;s;S;r;t", 17);
+#else
+    return gdb_send_packet(state, "vCont;c;C;s;S;r", 15);
+#endif
+}
+#endif
+
+int gdb_continue(struct gdb_state *state);
+int gdb_step(struct gdb_state *state);
+
+#if GDB_HAVE_SYS_HW_BREAK || GDB_HAVE_SYS_NONSTOP
+/**
+ * @brief Name the stop reason for a hardware breakpoint or watchpoint hit.
+ *
+ * @param hit GDB_HW_* type of the breakpoint that fired, or 0
+ * @param with_addr Set to 1 if the reason takes the address, 0 if not
+ *
+ * @return The reason, or NULL to leave it out
+ */
+static const char *gdb_stop_reason(unsigned int hit, int *with_addr)
+{
+    *with_addr = 1;
+    switch (hit) {
+    case GDB_HW_BREAK_EXEC:
+        *with_addr = 0;
+        return gdb_features.hwbreak ? "hwbreak" : NULL;
+    case GDB_HW_WATCH_WRITE:
+        return "watch";
+    case GDB_HW_WATCH_READ:
+        return "rwatch";
+    case GDB_HW_WATCH_ACCESS:
+        return "awatch";
+    }
+
+    return NULL;
+}
+#endif
+
+#if GDB_HAVE_SYS_NONSTOP
+/*
+ * In non-stop mode (QNonStop:1) a CPU that stops doesn't stop the others.
+ * It queues a stop event with gdb_nonstop_push(), and the CPU running the
+ * stub tells gdb with a %Stop notification, then hands over the rest of the
+ * queue as gdb asks for it with 'vStopped'.
+ *
+ * gdb_sys_cpu_resume() lets a stopped CPU run with the registers
+ * gdb_sys_continue() or gdb_sys_step() set up for it, and returns 1 if it is
+ * the CPU running the stub, which then leaves gdb_main(). gdb_sys_cpu_stop()
+ * asks a running CPU to stop; it queues its stop event with signal 0 once it
+ * has. gdb_sys_cpu_running() tells the two apart. gdb_sys_cpu_signal()
+ * returns the signal a stopped CPU last stopped with, 0 if gdb stopped it.
+ */
+typedef char gdb_nonstop_cpus_check[GDB_HAVE_SYS_CPUS ? 1 : -1];
+
+int gdb_sys_cpu_resume(struct gdb_state *state, int cpu);
+int gdb_sys_cpu_stop(struct gdb_state *state, int cpu);
+int gdb_sys_cpu_running(struct gdb_state *state, int cpu);
+int gdb_sys_cpu_signal(struct gdb_state *state, int cpu);
+
+/// Stop events waiting to be reported, a power of two no smaller than the
+/// number of CPUs, as each CPU has at most one
+#ifndef GDB_NONSTOP_EVENTS
+#define GDB_NONSTOP_EVENTS 32
+#endif
+
+typedef char gdb_nonstop_events_check[
+    (GDB_NONSTOP_EVENTS & (GDB_NONSTOP_EVENTS-1)) ? -1 : 1];
+
+/// Most actions in a non-stop 'vCont'
+#define GDB_NONSTOP_ACTIONS 8
+
+/**
+ * @brief A stop waiting to be reported to gdb.
+ */
+struct gdb_stop_event {
+    unsigned int seq;    ///< Queue position this slot is ready for, see gdb_nonstop_push()
+    int          thread; ///< Thread that stopped
+    int          signum; ///< Signal it stopped with
+    unsigned int hit;    ///< GDB_HW_* type of the breakpoint that fired, or 0
+    address      addr;   ///< Address of that breakpoint
+};
+
+/**
+ * @brief Non-stop mode state.
+ *
+ * Stop events go through a bounded ring where each slot carries the queue
+ * position it is next ready for: any CPU can add to it without taking a
+ * lock, and only the CPU running the stub takes from it.
+ */
+struct gdb_nonstop {
+    struct gdb_stop_event events[GDB_NONSTOP_EVENTS];
+    unsigned int tail;     ///< Next position to fill
+    unsigned int head;     ///< Next position to report
+    int          enabled;  ///< QNonStop:1 is in effect
+    int          notified; ///< A %Stop was sent and gdb hasn't drained the queue
+};
+
+static struct gdb_nonstop gdb_nonstop;
+
+#if GDB_FEATURE_NONSTOP
+/**
+ * @brief Empty the stop event queue.
+ *
+ * Only while no CPU can be adding to it.
+ */
+static void gdb_nonstop_reset(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < GDB_NONSTOP_EVENTS; i++) {
+        gdb_nonstop.events[i].seq = i;
+    }
+    gdb_nonstop.head = 0;
+    gdb_nonstop.notified = 0;
+    __atomic_store_n(&gdb_nonstop.tail, 0, __ATOMIC_RELEASE);
+}
+#endif
+
+/**
+ * @brief Report whether non-stop mode is in effect.
+ *
+ * @return 1 if it is, 0 otherwise
+ */
+int gdb_nonstop_active(void)
+{
+    return __atomic_load_n(&gdb_nonstop.enabled, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Queue a stop to be reported to gdb. Safe to call from any CPU.
+ *
+ * A slot at position pos is free once its seq reads pos. The CPU that moves
+ * tail past pos owns it, fills it in, and publishes it by setting seq to
+ * pos+1. The reader frees it again for the next lap with pos+GDB_NONSTOP_EVENTS.
+ *
+ * @param thread Thread that stopped
+ * @param signum Signal it stopped with
+ * @param hit GDB_HW_* type of the breakpoint that fired, or 0
+ * @param addr Address of that breakpoint
+ *
+ * @return 0 on success, or GDB_EOF if the queue is full
+ */
+int gdb_nonstop_push(int thread, int signum, unsigned int hit, address addr)
+{
+    struct gdb_stop_event *event;
+    unsigned int pos, seq;
+
+    pos = __atomic_load_n(&gdb_nonstop.tail, __ATOMIC_RELAXED);
+    for (;;) {
+        event = &gdb_nonstop.events[pos & (GDB_NONSTOP_EVENTS-1)];
+        seq = __atomic_load_n(&event->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            /* A failed exchange reloads pos */
+            if (__atomic_compare_exchange_n(&gdb_nonstop.tail, &pos, pos+1, 0,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if ((int)(seq-pos) < 0) {
+            /* Not yet read since the last lap */
+            return GDB_EOF;
+        } else {
+            /* Another CPU took the slot first */
+            pos = __atomic_load_n(&gdb_nonstop.tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    event->thread = thread;
+    event->signum = signum;
+    event->hit    = hit;
+    event->addr   = addr;
+    __atomic_store_n(&event->seq, pos+1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * @brief Take the oldest stop event off the queue.
+ *
+ * @param event Set to the event
+ *
+ * @return 0 on success, or GDB_EOF if there is none
+ */
+static int gdb_nonstop_pop(struct gdb_stop_event *event)
+{
+    struct gdb_stop_event *slot;
+    unsigned int pos;
+
+    pos  = gdb_nonstop.head;
+    slot = &gdb_nonstop.events[pos & (GDB_NONSTOP_EVENTS-1)];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos+1) {
+        return GDB_EOF;
+    }
+
+    *event = *slot;
+    gdb_nonstop.head = pos+1;
+    __atomic_store_n(&slot->seq, pos+GDB_NONSTOP_EVENTS, __ATOMIC_RELEASE);
+    return 0;
+}
+
+#if GDB_FEATURE_NONSTOP
+/**
+ * @brief Check whether a thread has a stop waiting in the queue.
+ *
+ * Only looks at published events; one still being added isn't seen.
+ *
+ * @param thread Thread to look for
+ *
+ * @return 1 if it has, 0 otherwise
+ */
+static int gdb_nonstop_queued(int thread)
+{
+    struct gdb_stop_event *slot;
+    unsigned int pos;
+
+    for (pos = gdb_nonstop.head;; pos++) {
+        slot = &gdb_nonstop.events[pos & (GDB_NONSTOP_EVENTS-1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos+1) {
+            return 0;
+        }
+        if (slot->thread == thread) {
+            return 1;
+        }
+    }
+}
+#endif
+
+/**
+ * @brief Format a stop event as a stop reply.
+ *
+ * @param buf Buffer to format into
+ * @param buf_len Size of buf
+ * @param event The stop event
+ *
+ * @return Length of the stop reply, or GDB_EOF if it does not fit
+ */
+static int gdb_nonstop_format(char *buf, unsigned int buf_len,
+                              const struct gdb_stop_event *event)
+{
+    const char *reason;
+    int with_addr;
+
+    reason = gdb_stop_reason(event->hit, &with_addr);
+    return gdb_fmt_stop_packet(buf, buf_len, event->signum, reason,
+                               with_addr ? &event->addr : NULL,
+                               event->thread);
+}
+
+/**
+ * @brief Send a %Stop notification for the oldest queued stop, unless gdb
+ * is still draining the queue after the last one.
+ *
+ * Called by the architecture whenever the stub waits for gdb.
+ *
+ * @param state Pointer to the GDB state object
+ *
+ * @return 0 on success, or GDB_EOF if the notification couldn't be sent
+ */
+int gdb_nonstop_notify(struct gdb_state *state)
+{
+    struct gdb_stop_event event;
+    char buf[48];
+    int size;
+
+    if (!gdb_nonstop.enabled || gdb_nonstop.notified ||
+        gdb_nonstop_pop(&event) == GDB_EOF) {
+        return 0;
+    }
+
+    gdb_nonstop.notified = 1;
+    size = gdb_nonstop_format(buf, sizeof(buf), &event);
+    if (size == GDB_EOF) {
+        return GDB_EOF;
+    }
+
+    return gdb_send_notification(state, "Stop", buf, size);
+}
+
+#if GDB_FEATURE_NONSTOP
+/**
+ * @brief Reply with the next queued stop, or 'OK' once there are no more.
+ *
+ * @param state Pointer to the GDB state object
+ *
+ * @return Status of the packet sending operation
+ */
+static int gdb_nonstop_reply(struct gdb_state *state)
+{
+    struct gdb_stop_event event;
+    char buf[48];
+    int size;
+
+    if (gdb_nonstop_pop(&event) == GDB_EOF) {
+        gdb_nonstop.notified = 0;
+        return gdb_send_ok_packet(state, buf, sizeof(buf));
+    }
+
+    size = gdb_nonstop_format(buf, sizeof(buf), &event);
+    if (size == GDB_EOF) {
+        return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+    }
+
+    return gdb_send_packet(state, buf, size);
+}
+
+/**
+ * @brief Handle 'QNonStop:0' and 'QNonStop:1', leave or enter non-stop mode.
+ *
+ * gdb only switches while every thread is stopped.
+ *
+ * @param state Pointer to the GDB state object
+ * @param pkt_buf Received packet
+ * @param pkt_len Length of the received packet
+ *
+ * @return Status of the packet sending operation
+ */
+static int gdb_cmd_nonstop(struct gdb_state *state, char *pkt_buf,
+                           unsigned int pkt_len)
+{
+    char buf[4];
+
+    if (pkt_len != 10 || (pkt_buf[9] != '0' && pkt_buf[9] != '1')) {
+        return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+    }
+
+    if (pkt_buf[9] == '1' && !gdb_nonstop.enabled) {
+        gdb_nonstop_reset();
+    }
+    __atomic_store_n(&gdb_nonstop.enabled, pkt_buf[9]-'0', __ATOMIC_RELEASE);
+
+    return gdb_send_ok_packet(state, buf, sizeof(buf));
+}
+
+/**
+ * @brief Handle 'vStopped', report the next queued stop.
+ *
+ * @param state Pointer to the GDB state object
+ * @param pkt_buf Received packet
+ * @param pkt_len Length of the received packet
+ *
+ * @return Status of the packet sending operation
+ */
+static int gdb_cmd_vstopped(struct gdb_state *state, char *pkt_buf,
+                            unsigned int pkt_len)
+{
+    return gdb_nonstop_reply(state);
+}
+
+/**
+ * @brief Handle '?' in non-stop mode, report every stopped thread.
+ *
+ * Every stopped thread without a stop already queued gets one, with the
+ * signal it stopped with. The queue is left as it is otherwise: other CPUs
+ * may be adding to it, and only they know what hit them. The oldest stop is
+ * the reply, gdb asks for the others with 'vStopped'. A stop queued while
+ * this runs may be reported twice, which gdb ignores.
+ *
+ * @param state Pointer to the GDB state object
+ * @param pkt_buf Received packet
+ * @param pkt_len Length of the received packet
+ *
+ * @return Status of the packet sending operation
+ */
+static int gdb_cmd_nonstop_status(struct gdb_state *state, char *pkt_buf,
+                                  unsigned int pkt_len)
+{
+    int cpu;
+
+    for (cpu = gdb_sys_cpu_next(state, GDB_EOF); cpu != GDB_EOF;
+         cpu = gdb_sys_cpu_next(state, cpu)) {
+        if (!gdb_sys_cpu_running(state, cpu) && !gdb_nonstop_queued(cpu+1)) {
+            gdb_nonstop_push(cpu+1, gdb_sys_cpu_signal(state, cpu), 0, 0);
+        }
+    }
+
+    gdb_nonstop.notified = 1;
+    return gdb_nonstop_reply(state);
+}
+#endif /* GDB_FEATURE_NONSTOP */
+
+/**
+ * @brief Let one stopped CPU run in non-stop mode.
+ *
+ * @param state Pointer to the GDB state object
+ * @param cpu CPU to resume
+ * @param step Nonzero to single-step it
+ *
+ * @return GDB_RESUME if it is the CPU running the stub, 0 otherwise
+ */
+static int gdb_nonstop_resume(struct gdb_state *state, int cpu, int step)
+{
+    if (gdb_sys_cpu_select(state, cpu) == GDB_EOF) {
+        /* Already running */
+        return 0;
+    }
+
+    if (step) {
+        gdb_sys_step(state);
+    } else {
+        gdb_sys_continue(state);
+    }
+
+    return gdb_sys_cpu_resume(state, cpu) ? GDB_RESUME : 0;
+}
+
+#if GDB_FEATURE_NONSTOP
+/**
+ * @brief Handle 'vCont[;action[:thread-id]]...' in non-stop mode.
+ *
+ * Each thread takes the first action that names it or no thread at all,
+ * and threads no action applies to are left as they are. 'c' and 's' resume
+ * stopped threads, 't' stops running ones. Single-stepping a range with 'r'
+ * only takes one step, gdb steps again until the thread leaves the range.
+ * The reply is 'OK' right away, stops are reported as they happen.
+ *
+ * @param state Pointer to the GDB state object
+ * @param ptr First action
+ * @param end End of the received packet
+ *
+ * @return GDB_RESUME if the CPU running the stub was resumed, otherwise the
+ *         status of the packet sending operation
+ */
+static int gdb_nonstop_vcont(struct gdb_state *state, const char *ptr,
+                             const char *end)
+{
+    char buf[4];
+    char ops[GDB_NONSTOP_ACTIONS];
+    int threads[GDB_NONSTOP_ACTIONS];
+    const char *action_end, *colon;
+    unsigned int count, i;
+    int cpu, status;
+
+    /* Parse every action first, the first that matches a thread wins */
+    for (count = 0; ptr < end; count++) {
+        action_end = gdb_memchr(ptr, ';', end-ptr);
+        if (!action_end) {
+            action_end = end;
+        }
+        if (count == GDB_NONSTOP_ACTIONS || action_end == ptr) {
+            return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+        }
+
+        ops[count] = *ptr;
+        threads[count] = -1;
+        colon = gdb_memchr(ptr, ':', action_end-ptr);
+        if ((colon &&
+             gdb_thread_parse(colon+1, action_end-colon-1,
+                              &threads[count]) == GDB_EOF) ||
+            !gdb_memchr("cCsSrt", ops[count], 6)) {
+            return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+        }
+
+        ptr = action_end+1;
+    }
+
+    gdb_range_step.active = 0;
+    gdb_sw_break_apply(state);
+
+    status = 0;
+    for (cpu = gdb_sys_cpu_next(state, GDB_EOF); cpu != GDB_EOF;
+         cpu = gdb_sys_cpu_next(state, cpu)) {
+        for (i = 0; i < count; i++) {
+            if (threads[i] <= 0 || threads[i] == cpu+1) {
+                break;
+            }
+        }
+        if (i == count) {
+            continue;
+        }
+
+        if (ops[i] == 't') {
+            if (gdb_sys_cpu_running(state, cpu)) {
+                gdb_sys_cpu_stop(state, cpu);
+            }
+        } else if (gdb_nonstop_resume(state, cpu,
+                                      ops[i] != 'c' && ops[i] != 'C')) {
+            status = GDB_RESUME;
+        }
+    }
+
+    if (gdb_send_ok_packet(state, buf, sizeof(buf)) == GDB_EOF) {
+        return GDB_EOF;
+    }
+
+    return status;
+}
+#endif
+#endif /* GDB_HAVE_SYS_NONSTOP */
+
+#if GDB_FEATURE_VCONT
+/**
+ * @brief Handle 'vCont[;action[:thread-id]]...', resume the target.
+ *
+ * The first action applies, to its thread if it names one, and every other
+ * CPU continues. Signals passed with 'C'/'S' can't be delivered and are
+ * dropped. 'r start,end' steps while PC
+ * stays in [start, end), reporting only once it leaves, so stepping over a
+ * source line takes one round trip rather than one per instruction.
+ *
+ * @param state Pointer to the GDB state object
+ * @param pkt_buf Received packet
+ * @param pkt_len Length of the received packet
+ *
+ * @return GDB_RESUME if the target was resumed, otherwise the status of the
+ *         packet sending operation
+ */
+static int gdb_cmd_vcont(struct gdb_state *state, char *pkt_buf,
+                         unsigned int pkt_len)
+{
+    char buf[4];
+    const char *ptr, *end, *ptr_next;
+    address start, stop;
+#if GDB_HAVE_SYS_CPUS
+    const char *action_end, *colon;
+    int thread;
+#endif
+
+    ptr = pkt_buf+5;
+    end = pkt_buf+pkt_len;
+    if (ptr+1 >= end || *ptr != ';') {
+        return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+    }
+    ptr += 1;
+
+#if GDB_FEATURE_NONSTOP
+    if (gdb_nonstop.enabled) {
+        return gdb_nonstop_vcont(state, ptr, end);
+    }
+#endif
+
+#if GDB_HAVE_SYS_CPUS
+    action_end = gdb_memchr(ptr, ';', end-ptr);
+    if (!action_end) {
+        action_end = end;
+    }
+    thread = 0;
+    colon = gdb_memchr(ptr, ':', action_end-ptr);
+    if (colon) {
+        if (gdb_thread_parse(colon+1, action_end-colon-1, &thread) == GDB_EOF ||
+            !gdb_thread_alive(state, thread)) {
+            return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+        }
+        end = colon;
+    }
+    gdb_threads.resume = thread;
+#endif
+
+    switch (*ptr) {
+    case 'c':
+    case 'C':
+        return gdb_continue(state);
+    case 's':
+    case 'S':
+        return gdb_step(state);
+    case 'r':
+        ptr += 1;
+        start = gdb_strtol(ptr, end-ptr, 16, &ptr_next);
+        if (!ptr_next || ptr_next >= end || *ptr_next != ',') {
+            break;
+        }
+        ptr = ptr_next+1;
+        stop = gdb_strtol(ptr, end-ptr, 16, &ptr_next);
+        if (!ptr_next) {
+            break;
+        }
+        gdb_step(state);
+        gdb_range_step.start  = start;
+        gdb_range_step.end    = stop;
+        gdb_range_step.active = 1;
+        return GDB_RESUME;
+    }
+
+    return gdb_send_error_packet(state, buf, sizeof(buf), 0x00);
+}
+#endif
+
+/**
+ * @brief Send the stop reply for the current stop.
+ *
+ * Names the hardware breakpoint or watchpoint that fired, if any, so gdb
+ * needn't work out why the target stopped, and the thread that stopped. In
+ * non-stop mode stops are queued instead, and the oldest is sent as a
+ * notification.
+ *
+ * @param state Pointer to the GDB state object
+ *
+ * @return Status of the packet sending operation
+ */
+static int gdb_send_stop_reply(struct gdb_state *state)
+{
+    char buf[48];
+    const char *reason;
+    address addr;
+    int thread, with_addr;
+
+#if GDB_HAVE_SYS_NONSTOP
+    if (gdb_nonstop.enabled) {
+        return gdb_nonstop_notify(state);
+    }
+#endif
+
+#if GDB_HAVE_SYS_CPUS
+    thread = gdb_sys_cpu_stopped(state)+1;
+#else
+    thread = 0;
+#endif
+
+    reason = NULL;
+    with_addr = 0;
+#if GDB_HAVE_SYS_HW_BREAK
+    reason = gdb_stop_reason(gdb_sys_hw_break_hit(state, &addr), &with_addr);
+#endif
+
+    if (reason || thread) {
+        return gdb_send_stop_packet(state, buf, sizeof(buf), state->signum,
+                                    reason, with_addr ? &addr : NULL, thread);
+    }
+    return gdb_send_signal_packet(state, buf, sizeof(buf), state->signum);
+}
+
+/**
+ * @brief Continue program execution at PC.
+ *
+ * In non-stop mode only the thread picked with 'Hc' continues.
+ * 
+ * @param state Pointer to the GDB state object
+ * 
+ * @return GDB_RESUME if the CPU running the stub continues, 0 if it stays
+ *         stopped
+ */
+int gdb_continue(struct gdb_state *state)
+{
+    gdb_range_step.active = 0;
+    gdb_sw_break_apply(state);
+#if GDB_HAVE_SYS_NONSTOP
+    if (gdb_nonstop.enabled) {
+        return gdb_nonstop_resume(state,
+                   gdb_thread_cpu(state, gdb_threads.resume), 0);
+    }
+#endif
+#if GDB_HAVE_SYS_CPUS
+    gdb_sys_cpu_select(state, gdb_thread_cpu(state, gdb_threads.resume));
+#endif
+    gdb_sys_continue(state);
+    return GDB_RESUME;
+}
+
+/**
+ * @brief Step one instruction in the program.
+ *
+ * In non-stop mode only the thread picked with 'Hc' steps.
+ * 
+ * @param state Pointer to the GDB state object
+ * 
+ * @return GDB_RESUME if the CPU running the stub steps, 0 if it stays
+ *         stopped
+ */
+int gdb_step(struct gdb_state *state)
+{
+    gdb_range_step.active = 0;
+    gdb_sw_break_apply(state);
+#if GDB_HAVE_SYS_NONSTOP
+    if (gdb_nonstop.enabled) {
+        return gdb_nonstop_resume(state,
+                   gdb_thread_cpu(state, gdb_threads.resume), 1);
+    }
+#endif
+#if GDB_HAVE_SYS_CPUS
+    gdb_sys_cpu_select(state, gdb_thread_cpu(state, gdb_threads.resume));
+#endif
+    gdb_sys_step(state);
+    return GDB_RESUME;
+}
+
+/**
+ * @brief Handle '?', report why the target stopped.
+ *
+ * @param state Pointer to the GDB state object
+ * @param pkt_buf Received packet
+ * @param pkt_len Length of the received packet
+ *
+ * @return Status of the packet sending operation
+ */
+static int gdb_cmd_stop_status(struct gdb_state *state, char *pkt_buf,
+                               unsigned int pkt_len)
+{
+#if GDB_FEATURE_NONSTOP
+    if (gdb_nonstop.enabled) {
+        return gdb_cmd_nonstop_status(state, pkt_buf, pkt_len);
+    }
+#endif
+
+    return gdb_send_stop_reply(state);
+}
+
+/**
+ * @brief Handle 'c [addr]', continue the target.
+ *
+ * gdb no longer sends the address, it is ignored. In non-stop mode, where
+ * another thread may be the one continuing, the reply is 'OK'.
+ *
+ * @param state Pointer to the GDB state object
+ * @param pkt_buf Received packet
+ * @param pkt_len Length of the received packet
+ *
+ * @return GDB_RESUME if the target was resumed, otherwise the status of the
+ *         packet sending operation
+ */
+static int gdb_cmd_continue(struct gdb_state *state, char *pkt_buf,
+                            unsigned int pkt_len)
+{
+    char buf[4];
+
+    if (gdb_continue(state) == GDB_RESUME) {
+        return GDB_RESUME;
+    }
+
+    return gdb_send_ok_packet(state, buf, sizeof(buf));
+}
+
+/**
+ * @brief Handle 's [addr]', step the target one instruction.
+ *
+ * gdb no longer sends the address, it is ignored. In non-stop mode, where
+ * another thread may be the one stepping, the reply is 'OK'.
+ *
+ * @param state Pointer to the GDB state object
+ * @param pkt_buf Received packet
+ * @param pkt_len Length of the received packet
+ *
+ * @return GDB_RESUME if the target was resumed, otherwise the status of the
+ *         packet sending operation
+ */
+static int gdb_cmd_step(struct gdb_state *state, char *pkt_buf,
+                        unsigned int pkt_len)
+{
+    char buf[4];
+
+    if (gdb_step(state) == GDB_RESUME) {
+        return GDB_RESUME;
+    }
+
+    return gdb_send_ok_packet(state, buf, sizeof(buf));
+}
+
+/**
+ * @brief Let the target run on once gdb is gone.
+ *
+ * In non-stop mode every thread gdb kept stopped is resumed, as nobody is
+ * left to do it. The next debugger to connect starts with acknowledgements
+ * on, so no-ack mode ends here too.
+ *
+ * @param state Pointer to the GDB state object
+ */
+static void gdb_release(struct gdb_state *state)
+{
+#if GDB_HAVE_SYS_NONSTOP
+    int cpu;
+#endif
+
+    gdb_no_ack_mode = 0;
+
+#if GDB_HAVE_SYS_CPUS
+    gdb_threads.resume = 0;
+#endif
+    gdb_continue(state);
+
+#if GDB_HAVE_SYS_NONSTOP
+    if (gdb_nonstop.enabled) {
+        for (cpu = gdb_sys_cpu_next(state, GDB_EOF); cpu != GDB_EOF;
+             cpu = gdb_sys_cpu_next(state, cpu)) {
+            gdb_nonstop_resume(state, cpu, 0);
+        }
+    }
+#endif
+}
+
+/**
+ * @brief Handle 'D', detach the debugger and let the target run.
+ *
+ * gdb has removed its breakpoints by now.
+ *
+ * @param state Pointer to the GDB state object
+ * @param pkt_buf Received packet
+ * @param pkt_len Length of the received packet
+ *
+ * @return GDB_RESUME, or GDB_EOF if the reply couldn't be sent
+ */
+static int gdb_cmd_detach(struct gdb_state *state, char *pkt_buf,
+                          unsigned int pkt_len)
+{
+    char buf[4];
+
+    if (gdb_send_ok_packet(state, buf, sizeof(buf)) == GDB_EOF) {
+        return GDB_EOF;
+    }
+
+    gdb_release(state);
+    return GDB_RESUME;
+}
+
+/**
+ * @brief Handle 'k', kill the target.
+ *
+ * A bare machine can't be killed, so the target is let go as on 'D'. gdb
+ * expects no reply and drops the connection.
+ *
+ * @param state Pointer to the GDB state object
+ * @param pkt_buf Received packet
+ * @param pkt_len Length of the received packet
+ *
+ * @return GDB_RESUME
+ */
+static int gdb_cmd_kill(struct gdb_state *state, char *pkt_buf,
+                        unsigned int pkt_len)
+{
+    gdb_release(state);
+    return GDB_RESUME;
+}
+
+/**
+ * @brief Command handler, called with the whole received packet.
+ *
+ * Returns GDB_RESUME if the target was resumed and gdb_main() must return,
+ * otherwise the status of sending the reply.
+ */
+typedef int (*gdb_cmd_func)(struct gdb_state *state, char *pkt_buf,
+                            unsigned int pkt_len);
+
+/*
+ * 'q', 'Q' and 'v' packets are named, the name running up to the first ':',
+ * ';' or ','. Names are looked up in a perfect hash table built at compile
+ * time, keyed by their second and last characters and their length, which
+ * is enough to tell apart every name the stub knows. A lookup is one hash and
+ * one compare. The key characters are spelled out in the list because the
+ * compiler won't index string literals in constant expressions.
+ *
+ * The entries of a left out feature expand to nothing.
+ */
+#define GDB_QUERY_SLOTS 32
+
+/// Slot of a name, from its second and last characters and its length
+#define GDB_QUERY_HASH(second, last, len) \
+    ((((unsigned int)(second)<<1)+(unsigned int)(last)+((len)<<2)) & \
+     (GDB_QUERY_SLOTS-1))
+
+#define GDB_QUERIES_CORE(Q) \
+    Q("qSupported",      'S', 'd', gdb_cmd_query_supported)
+
+#if GDB_FEATURE_NO_ACK
+#define GDB_QUERIES_NO_ACK(Q) \
+    Q("QStartNoAckMode", 'S', 'e', gdb_cmd_start_no_ack)
+#else
+#define GDB_QUERIES_NO_ACK(Q)
+#endif
+
+#if GDB_FEATURE_TRACE
+#define GDB_QUERIES_TRACE(Q) \
+    Q("QTinit",          'T', 't', gdb_cmd_trace_init) \
+    Q("QTDP",            'T', 'P', gdb_cmd_trace_define) \
+    Q("QTStart",         'T', 't', gdb_cmd_trace_start) \
+    Q("QTStop",          'T', 'p', gdb_cmd_trace_stop) \
+    Q("QTBuffer",        'T', 'r', gdb_cmd_trace_buffer) \
+    Q("qTStatus",        'T', 's', gdb_cmd_trace_status) \
+    Q("QTFrame",         'T', 'e', gdb_cmd_trace_frame)
+#else
+#define GDB_QUERIES_TRACE(Q)
+#endif
+
+#if GDB_FEATURE_THREADS && GDB_HAVE_SYS_CPUS
+#define GDB_QUERIES_THREADS(Q) \
+    Q("qfThreadInfo",    'f', 'o', gdb_cmd_thread_info_first) \
+    Q("qsThreadInfo",    's', 'o', gdb_cmd_thread_info_next) \
+    Q("qC",              'C', 'C', gdb_cmd_current_thread)
+#else
+#define GDB_QUERIES_THREADS(Q)
+#endif
+
+#if GDB_FEATURE_VCONT
+#define GDB_QUERIES_VCONT(Q) \
+    Q("vCont",           'C', 't', gdb_cmd_vcont) \
+    Q("vCont?",          'C', '?', gdb_cmd_vcont_query)
+#else
+#define GDB_QUERIES_VCONT(Q)
+#endif
+
+#if GDB_FEATURE_NONSTOP
+#define GDB_QUERIES_NONSTOP(Q) \
+    Q("QNonStop",        'N', 'p', gdb_cmd_nonstop) \
+    Q("vStopped",        'S', 'd', gdb_cmd_vstopped)
+#else
+#define GDB_QUERIES_NONSTOP(Q)
+#endif
+
+#define GDB_QUERIES(Q) \
+    GDB_QUERIES_CORE(Q) GDB_QUERIES_NO_ACK(Q) GDB_QUERIES_TRACE(Q) \
+    GDB_QUERIES_THREADS(Q) GDB_QUERIES_VCONT(Q) GDB_QUERIES_NONSTOP(Q)
+
+/// Non-stop mode is driven with vCont and thread ids
+typedef char gdb_feature_nonstop_check[
+    (!GDB_FEATURE_NONSTOP || (GDB_HAVE_SYS_NONSTOP && GDB_FEATURE_VCONT &&
+                              GDB_FEATURE_THREADS)) ? 1 : -1];
+
+/**
+ * @brief Named command in the query table.
+ */
+struct gdb_query {
+    const char   *name; ///< Full name, NULL for an empty slot
+    unsigned int  len;  ///< Length of the name
+    gdb_cmd_func  func; ///< Handler
+};
+
+#define GDB_QUERY_ENTRY(name, second, last, func) \
+    [GDB_QUERY_HASH(second, last, sizeof(name)-1)] = \
+        { name, sizeof(name)-1, func },
+
+static const struct gdb_query gdb_queries[GDB_QUERY_SLOTS] = {
+    GDB_QUERIES(GDB_QUERY_ENTRY)
+};
+
+/*
+ * The slots of all names, summed and or-ed together as bits, only agree
+ * when no two names share a slot. A new name that collides fails here, and
+ * the hash needs other constants.
+ */
+#define GDB_QUERY_SUM(name, second, last, func) \
+    +(1ULL<<GDB_QUERY_HASH(second, last, sizeof(name)-1))
+#define GDB_QUERY_OR(name, second, last, func) \
+    |(1ULL<<GDB_QUERY_HASH(second, last, sizeof(name)-1))
+
+typedef char gdb_query_hash_check[
+    ((0 GDB_QUERIES(GDB_QUERY_SUM)) == (0 GDB_QUERIES(GDB_QUERY_OR))) ? 1 : -1];
+
+#undef GDB_QUERY_ENTRY
+#undef GDB_QUERY_SUM
+#undef GDB_QUERY_OR
+
+/**
+ * @brief Handle a 'q', 'Q' or 'v' packet, looking up its name.
+ *
+ * Unknown names get the empty reply.
+ *
+ * @param state Pointer to the GDB state object
+ * @param pkt_buf Received packet
+ * @param pkt_len Length of the received packet
+ *
+ * @return GDB_RESUME if the target was resumed, otherwise the status of the
+ *         packet sending operation
+ */
+static int gdb_cmd_query(struct gdb_state *state, char *pkt_buf,
+                         unsigned int pkt_len)
+{
+    const struct gdb_query *query;
+    unsigned int len;
+
+    for (len = 1; len < pkt_len; len++) {
+        if (pkt_buf[len] == ':' || pkt_buf[len] == ';' ||
+            pkt_buf[len] == ',') {
+            break;
+        }
+    }
+
+    if (len >= 2) {
+        query = &gdb_queries[GDB_QUERY_HASH(pkt_buf[1], pkt_buf[len-1], len)];
+        if (query->name && query->len == len &&
+            !gdb_strmatch(pkt_buf, len, query->name)) {
+            return query->func(state, pkt_buf, pkt_len);
+        }
+    }
+
+    return gdb_send_packet(state, "", 0);
+}
+
+/**
+ * @brief Command handlers, indexed by the first byte of the packet.
+ *
+ * Commands that are left out, or that the stub doesn't know, have no entry
+ * and get the empty reply.
+ */
+static const gdb_cmd_func gdb_cmds[128] = {
+    ['?'] = gdb_cmd_stop_status,
+    ['D'] = gdb_cmd_detach,
+    ['G'] = gdb_cmd_write_regs,
+    ['M'] = gdb_cmd_write_mem,
+    ['P'] = gdb_cmd_write_reg,
+    ['Q'] = gdb_cmd_query,
+    ['c'] = gdb_cmd_continue,
+    ['g'] = gdb_cmd_read_regs,
+    ['k'] = gdb_cmd_kill,
+    ['m'] = gdb_cmd_read_mem,
+    ['p'] = gdb_cmd_read_reg,
+    ['q'] = gdb_cmd_query,
+    ['s'] = gdb_cmd_step,
+    ['v'] = gdb_cmd_query,
+#if GDB_FEATURE_MEM_BIN
+    ['X'] = gdb_cmd_write_mem_bin,
+    ['x'] = gdb_cmd_read_mem_bin,
+#endif
+#if GDB_FEATURE_BREAK
+    ['Z'] = gdb_cmd_break,
+    ['z'] = gdb_cmd_break,
+#endif
+#if GDB_FEATURE_THREADS && GDB_HAVE_SYS_CPUS
+    ['H'] = gdb_cmd_set_thread,
+    ['T'] = gdb_cmd_thread_alive,
+#endif
+};
+
+/**
+ * @brief Main debug loop. Serves the debugger until it resumes the target.
+ *
+ * The stop is reported first, in non-stop mode as a notification if one is
+ * due. The loop then ends when a command resumes the CPU running the stub,
+ * or when nothing more can be received, which the architecture uses to take
+ * back a CPU that serves gdb while running.
+ *
+ * @param state Pointer to the GDB state object
+ *
+ * @return 0 once the target was resumed, or GDB_EOF if receiving failed
+ */
+int gdb_main(struct gdb_state *state)
+{
+    char *pkt_buf;
+    unsigned int pkt_len;
+    gdb_cmd_func func;
+
+    gdb_send_stop_reply(state);
+
+    while (1) {
+        if (gdb_recv_packet(state, &pkt_buf, &pkt_len) == GDB_EOF) {
+            return GDB_EOF;
+        }
+
+        func = NULL;
+        if (pkt_len > 0 && (unsigned char)pkt_buf[0] < 128) {
+            func = gdb_cmds[(unsigned char)pkt_buf[0]];
+        }
+
+        if (!func) {
+            /* Not supported */
+            gdb_send_packet(state, "", 0);
+        } else if (func(state, pkt_buf, pkt_len) == GDB_RESUME) {
+#if GDB_PROFILE
+            gdb_profile_cancel();
+#endif
+            return 0;
+        }
+    }
 }
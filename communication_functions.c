@@ -2,6 +2,23 @@
  * Communication Functions
  ****************************************************************************/
 
+/*
+ * Architectures that can hand a whole buffer to their transport in one call
+ * provide gdb_sys_write() and set GDB_HAVE_SYS_WRITE. Everything else falls
+ * back to one gdb_sys_putchar() per byte.
+ */
+#ifndef GDB_HAVE_SYS_WRITE
+#if defined(GDBSTUB_ARCH_MOCK) || defined(GDBSTUB_ARCH_X86)
+#define GDB_HAVE_SYS_WRITE 1
+#else
+#define GDB_HAVE_SYS_WRITE 0
+#endif
+#endif
+
+#if GDB_HAVE_SYS_WRITE
+int gdb_sys_write(struct gdb_state *state, const char *buf, unsigned int len);
+#endif
+
 /**
  * @brief Write a sequence of bytes to a specified output.
  *
@@ -13,6 +30,13 @@
  */
 static int gdb_write(struct gdb_state *state, const char *buf, unsigned int len)
 {
+#if GDB_HAVE_SYS_WRITE
+    if (len == 0) {
+        return 0;
+    }
+
+    return gdb_sys_write(state, buf, len) == GDB_EOF ? GDB_EOF : 0;
+#else
     while (len--) {
         if (gdb_sys_putchar(state, *buf++) == GDB_EOF) {
             return GDB_EOF;
@@ -20,6 +44,129 @@ static int gdb_write(struct gdb_state *state, const char *buf, unsigned int len)
     }
 
     return 0;
+#endif
+}
+
+/*
+ * Likewise, architectures that can drain several received bytes at once
+ * provide gdb_sys_read() and set GDB_HAVE_SYS_READ.
+ */
+#ifndef GDB_HAVE_SYS_READ
+#if defined(GDBSTUB_ARCH_MOCK) || defined(GDBSTUB_ARCH_X86)
+#define GDB_HAVE_SYS_READ 1
+#else
+#define GDB_HAVE_SYS_READ 0
+#endif
+#endif
+
+#if GDB_HAVE_SYS_READ
+int gdb_sys_read(struct gdb_state *state, char *buf, unsigned int len);
+#endif
+
+/// Size of the receive buffer; bounds the largest packet that can be received
+#ifndef GDB_RX_BUF_SIZE
+#define GDB_RX_BUF_SIZE 4096
+#endif
+
+/// Largest packet advertised to gdb; the receive buffer less "$" and "#xx"
+#define GDB_PACKET_SIZE (GDB_RX_BUF_SIZE-4)
+
+/**
+ * @brief Receive buffer shared by all input paths.
+ *
+ * Bytes are consumed from head and appended at tail. A frame is left where
+ * it starts; pending bytes are only moved to the front when a frame runs into
+ * the end of the buffer, so a frame is always contiguous and can be handed to
+ * the command parser in place without copying every short packet around.
+ */
+struct gdb_rx_buf {
+    char         buf[GDB_RX_BUF_SIZE];
+    unsigned int head;   ///< Offset of the next byte to consume
+    unsigned int tail;   ///< Offset of the next free byte
+    int          pinned; ///< Nonzero while a received packet still lives in buf
+};
+
+static struct gdb_rx_buf gdb_rx;
+
+/**
+ * @brief Move pending bytes of the receive buffer to its front.
+ */
+static void gdb_rx_compact(void)
+{
+    unsigned int pos;
+
+    if (gdb_rx.head == 0) {
+        return;
+    }
+
+    /* Forward copy is safe, destination is always below source */
+    for (pos = 0; gdb_rx.head+pos < gdb_rx.tail; pos++) {
+        gdb_rx.buf[pos] = gdb_rx.buf[gdb_rx.head+pos];
+    }
+    gdb_rx.tail -= gdb_rx.head;
+    gdb_rx.head  = 0;
+}
+
+/**
+ * @brief Append newly received bytes to the receive buffer.
+ *
+ * Blocks until at least one byte has been received.
+ *
+ * @param state Pointer to the GDB state object.
+ *
+ * @return Number of bytes appended, or GDB_EOF on error or if the buffer is full.
+ */
+static int gdb_rx_fill(struct gdb_state *state)
+{
+    int status;
+
+    if (gdb_rx.tail >= sizeof(gdb_rx.buf)) {
+        return GDB_EOF;
+    }
+
+#if GDB_HAVE_SYS_READ
+    status = gdb_sys_read(state, gdb_rx.buf+gdb_rx.tail,
+                          sizeof(gdb_rx.buf)-gdb_rx.tail);
+    if (status == GDB_EOF || status == 0) {
+        return GDB_EOF;
+    }
+#else
+    status = gdb_sys_getc(state);
+    if (status == GDB_EOF) {
+        return GDB_EOF;
+    }
+    gdb_rx.buf[gdb_rx.tail] = (char) status;
+    status = 1;
+#endif
+
+    gdb_rx.tail += status;
+    return status;
+}
+
+/**
+ * @brief Read one character through the receive buffer.
+ *
+ * @param state Pointer to the GDB state object.
+ *
+ * @return The character read, or GDB_EOF if an error occurred.
+ */
+static int gdb_rx_getc(struct gdb_state *state)
+{
+    if (gdb_rx.head == gdb_rx.tail) {
+        if (!gdb_rx.pinned) {
+            /* Nothing to keep, start over at the front */
+            gdb_rx.head = gdb_rx.tail = 0;
+        } else if (gdb_rx.tail >= sizeof(gdb_rx.buf)) {
+            /* Don't disturb the pinned packet, bypass the buffer */
+            return gdb_sys_getc(state);
+        }
+
+        if (gdb_rx_fill(state) == GDB_EOF) {
+            return GDB_EOF;
+        }
+    }
+
+    return gdb_rx.buf[gdb_rx.head++] & 0xff;
 }
 
 /**
@@ -35,18 +182,33 @@ static int gdb_write(struct gdb_state *state, const char *buf, unsigned int len)
 static int gdb_read(struct gdb_state *state, char *buf, unsigned int buf_len,
                     unsigned int len)
 {
-    char c;
+    unsigned int avail;
+    int c;
 
     if (buf_len < len) {
         /* Buffer too small */
         return GDB_EOF;
     }
 
-    while (len--) {
-        if ((c = gdb_sys_getc(state)) == GDB_EOF) {
-            return GDB_EOF;
+    while (len) {
+        avail = gdb_rx.tail-gdb_rx.head;
+        if (avail == 0) {
+            /* Refill one character at a time through gdb_rx_getc */
+            if ((c = gdb_rx_getc(state)) == GDB_EOF) {
+                return GDB_EOF;
+            }
+            *buf++ = (char) c;
+            len--;
+            continue;
+        }
+
+        if (avail > len) {
+            avail = len;
         }
-        *buf++ = c;
+        gdb_memcpy(buf, gdb_rx.buf+gdb_rx.head, avail);
+        gdb_rx.head += avail;
+        buf         += avail;
+        len         -= avail;
     }
 
     return 0;
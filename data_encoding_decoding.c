@@ -1,78 +1,738 @@
+/*****************************************************************************
+ * Data Encoding/Decoding Const Data
+ ****************************************************************************/
+
+/*
+ * Value of each ASCII hex digit, 0xff for anything that isn't one. Decoders
+ * OR all looked-up values together and check the high nibble once at the end.
+ */
+static const unsigned char gdb_hex_vals[256] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 0x00 */
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 0x10 */
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 0x20 */
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, /* 0x30 */
+    0x08, 0x09, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff, /* 0x40 */
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 0x50 */
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff, /* 0x60 */
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 0x70 */
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 0x80 */
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 0x90 */
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 0xa0 */
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 0xb0 */
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 0xc0 */
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 0xd0 */
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 0xe0 */
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 0xf0 */
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+/*****************************************************************************
+ * Data Encoding/Decoding Vector Kernels
+ ****************************************************************************/
+
+/*
+ * Vector kernels clobber XMM/YMM registers, so they are only enabled by
+ * default on the mock arch. A target stub that preserves the vector state of
+ * the interrupted program may opt in with GDB_USE_SIMD=1.
+ */
+#ifndef GDB_USE_SIMD
+#ifdef GDBSTUB_ARCH_MOCK
+#define GDB_USE_SIMD 1
+#else
+#define GDB_USE_SIMD 0
+#endif
+#endif
+
+#if GDB_USE_SIMD && defined(__SSE2__)
+#define GDB_SIMD_SSE2 1
+#include <emmintrin.h>
+#else
+#define GDB_SIMD_SSE2 0
+#endif
+
+#if GDB_USE_SIMD && defined(__AVX2__)
+#define GDB_SIMD_AVX2 1
+#include <immintrin.h>
+#else
+#define GDB_SIMD_AVX2 0
+#endif
+
+#if GDB_USE_SIMD && defined(__ARM_NEON)
+#define GDB_SIMD_NEON 1
+#include <arm_neon.h>
+#else
+#define GDB_SIMD_NEON 0
+#endif
+
+#if GDB_SIMD_SSE2
+
+/*
+ * Fold a vector of per-lane byte sums into the 8-bit checksum. Lanes are
+ * summed with wrap-around, which is exact modulo 256.
+ */
+static unsigned char gdb_sum_fold_sse2(__m128i acc)
+{
+    acc = _mm_sad_epu8(acc, _mm_setzero_si128());
+    return _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+}
+
+/*
+ * Convert 16 nibbles (0-15) to lower case ASCII hex digits.
+ */
+static __m128i gdb_hex_digits_sse2(__m128i nib)
+{
+    __m128i alpha;
+
+    alpha = _mm_and_si128(_mm_cmpgt_epi8(nib, _mm_set1_epi8(9)),
+                          _mm_set1_epi8('a'-'0'-10));
+    return _mm_add_epi8(_mm_add_epi8(nib, _mm_set1_epi8('0')), alpha);
+}
+
+/*
+ * Encode 16 bytes from data into 32 hex digits at buf, adding the digits to
+ * the checksum lanes in *sum.
+ */
+static void gdb_enc_hex_sse2(char *buf, const char *data, __m128i *sum)
+{
+    __m128i in, hi, lo;
+
+    in = _mm_loadu_si128((const __m128i *)data);
+    hi = gdb_hex_digits_sse2(_mm_and_si128(_mm_srli_epi16(in, 4),
+                                           _mm_set1_epi8(0x0f)));
+    lo = gdb_hex_digits_sse2(_mm_and_si128(in, _mm_set1_epi8(0x0f)));
+    *sum = _mm_add_epi8(*sum, _mm_add_epi8(hi, lo));
+
+    _mm_storeu_si128((__m128i *)(buf),    _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i *)(buf+16), _mm_unpackhi_epi8(hi, lo));
+}
+
+/*
+ * Convert 16 ASCII hex digits to nibbles. Lanes that are not hex digits are
+ * flagged in *bad.
+ */
+static __m128i gdb_hex_nibbles_sse2(__m128i in, __m128i *bad)
+{
+    __m128i dig, alp, is_dig, is_alp;
+
+    dig = _mm_sub_epi8(in, _mm_set1_epi8('0'));
+    alp = _mm_sub_epi8(_mm_or_si128(in, _mm_set1_epi8(0x20)),
+                       _mm_set1_epi8('a'));
+
+    is_dig = _mm_and_si128(_mm_cmpgt_epi8(dig, _mm_set1_epi8(-1)),
+                           _mm_cmplt_epi8(dig, _mm_set1_epi8(10)));
+    is_alp = _mm_and_si128(_mm_cmpgt_epi8(alp, _mm_set1_epi8(-1)),
+                           _mm_cmplt_epi8(alp, _mm_set1_epi8(6)));
+
+    *bad = _mm_or_si128(*bad, _mm_andnot_si128(_mm_or_si128(is_dig, is_alp),
+                                               _mm_set1_epi8(-1)));
+
+    return _mm_or_si128(
+        _mm_and_si128(is_dig, dig),
+        _mm_and_si128(is_alp, _mm_add_epi8(alp, _mm_set1_epi8(10))));
+}
+
+/*
+ * Combine pairs of nibbles into bytes, high nibble first.
+ */
+static __m128i gdb_hex_pairs_sse2(__m128i nib)
+{
+    return _mm_or_si128(
+        _mm_slli_epi16(_mm_and_si128(nib, _mm_set1_epi16(0x00ff)), 4),
+        _mm_srli_epi16(nib, 8));
+}
+
+/*
+ * Decode 32 hex digits from buf into 16 bytes at data. Invalid digits are
+ * flagged in *bad.
+ */
+static void gdb_dec_hex_sse2(const char *buf, char *data, __m128i *bad)
+{
+    __m128i a, b;
+
+    a = gdb_hex_nibbles_sse2(_mm_loadu_si128((const __m128i *)(buf)),    bad);
+    b = gdb_hex_nibbles_sse2(_mm_loadu_si128((const __m128i *)(buf+16)), bad);
+
+    _mm_storeu_si128((__m128i *)data,
+                     _mm_packus_epi16(gdb_hex_pairs_sse2(a),
+                                      gdb_hex_pairs_sse2(b)));
+}
+
+#endif /* GDB_SIMD_SSE2 */
+
+#if GDB_SIMD_AVX2
+
+/*
+ * Fold a vector of per-lane byte sums into the 8-bit checksum.
+ */
+static unsigned char gdb_sum_fold_avx2(__m256i acc)
+{
+    return gdb_sum_fold_sse2(_mm_add_epi8(_mm256_castsi256_si128(acc),
+                                          _mm256_extracti128_si256(acc, 1)));
+}
+
+/*
+ * Convert 32 nibbles (0-15) to lower case ASCII hex digits.
+ */
+static __m256i gdb_hex_digits_avx2(__m256i nib)
+{
+    __m256i alpha;
+
+    alpha = _mm256_and_si256(_mm256_cmpgt_epi8(nib, _mm256_set1_epi8(9)),
+                             _mm256_set1_epi8('a'-'0'-10));
+    return _mm256_add_epi8(_mm256_add_epi8(nib, _mm256_set1_epi8('0')), alpha);
+}
+
+/*
+ * Encode 32 bytes from data into 64 hex digits at buf, adding the digits to
+ * the checksum lanes in *sum.
+ */
+static void gdb_enc_hex_avx2(char *buf, const char *data, __m256i *sum)
+{
+    __m256i in, hi, lo, first, second;
+
+    in = _mm256_loadu_si256((const __m256i *)data);
+    hi = gdb_hex_digits_avx2(_mm256_and_si256(_mm256_srli_epi16(in, 4),
+                                              _mm256_set1_epi8(0x0f)));
+    lo = gdb_hex_digits_avx2(_mm256_and_si256(in, _mm256_set1_epi8(0x0f)));
+    *sum = _mm256_add_epi8(*sum, _mm256_add_epi8(hi, lo));
+
+    /* Unpacking works per 128-bit lane, put the halves back in order */
+    first  = _mm256_unpacklo_epi8(hi, lo);
+    second = _mm256_unpackhi_epi8(hi, lo);
+    _mm256_storeu_si256((__m256i *)(buf),
+                        _mm256_permute2x128_si256(first, second, 0x20));
+    _mm256_storeu_si256((__m256i *)(buf+32),
+                        _mm256_permute2x128_si256(first, second, 0x31));
+}
+
+/*
+ * Convert 32 ASCII hex digits to nibbles. Lanes that are not hex digits are
+ * flagged in *bad.
+ */
+static __m256i gdb_hex_nibbles_avx2(__m256i in, __m256i *bad)
+{
+    __m256i dig, alp, is_dig, is_alp;
+
+    dig = _mm256_sub_epi8(in, _mm256_set1_epi8('0'));
+    alp = _mm256_sub_epi8(_mm256_or_si256(in, _mm256_set1_epi8(0x20)),
+                          _mm256_set1_epi8('a'));
+
+    is_dig = _mm256_andnot_si256(
+        _mm256_cmpgt_epi8(_mm256_setzero_si256(), dig),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8(10), dig));
+    is_alp = _mm256_andnot_si256(
+        _mm256_cmpgt_epi8(_mm256_setzero_si256(), alp),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8(6), alp));
+
+    *bad = _mm256_or_si256(*bad,
+        _mm256_andnot_si256(_mm256_or_si256(is_dig, is_alp),
+                            _mm256_set1_epi8(-1)));
+
+    return _mm256_or_si256(
+        _mm256_and_si256(is_dig, dig),
+        _mm256_and_si256(is_alp, _mm256_add_epi8(alp, _mm256_set1_epi8(10))));
+}
+
+/*
+ * Combine pairs of nibbles into bytes, high nibble first.
+ */
+static __m256i gdb_hex_pairs_avx2(__m256i nib)
+{
+    return _mm256_or_si256(
+        _mm256_slli_epi16(_mm256_and_si256(nib, _mm256_set1_epi16(0x00ff)), 4),
+        _mm256_srli_epi16(nib, 8));
+}
+
+/*
+ * Decode 64 hex digits from buf into 32 bytes at data. Invalid digits are
+ * flagged in *bad.
+ */
+static void gdb_dec_hex_avx2(const char *buf, char *data, __m256i *bad)
+{
+    __m256i a, b, out;
+
+    a = gdb_hex_nibbles_avx2(_mm256_loadu_si256((const __m256i *)(buf)), bad);
+    b = gdb_hex_nibbles_avx2(_mm256_loadu_si256((const __m256i *)(buf+32)), bad);
+
+    /* Packing works per 128-bit lane, put the quarters back in order */
+    out = _mm256_packus_epi16(gdb_hex_pairs_avx2(a), gdb_hex_pairs_avx2(b));
+    _mm256_storeu_si256((__m256i *)data, _mm256_permute4x64_epi64(out, 0xd8));
+}
+
+#endif /* GDB_SIMD_AVX2 */
+
+/*
+ * Block kernels, GDB_SIMD_BLOCK bytes at a time, for binary escape scanning
+ * and checksums. The scanners return a mask with GDB_SIMD_MASK_BITS bits set
+ * per matching byte, lowest address in the least significant bits. Checksums
+ * accumulate per-lane byte sums in a gdb_simd_sum.
+ */
+#if GDB_SIMD_AVX2
+
+#define GDB_SIMD_BLOCK     32
+#define GDB_SIMD_MASK_BITS 1
+typedef unsigned int gdb_simd_mask;
+
+static gdb_simd_mask gdb_bin_specials(const char *data)
+{
+    __m256i in, hit;
+
+    in  = _mm256_loadu_si256((const __m256i *)data);
+    hit = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(in, _mm256_set1_epi8('$')),
+                        _mm256_cmpeq_epi8(in, _mm256_set1_epi8('#'))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(in, _mm256_set1_epi8('}')),
+                        _mm256_cmpeq_epi8(in, _mm256_set1_epi8('*'))));
+    return (unsigned int) _mm256_movemask_epi8(hit);
+}
+
+static gdb_simd_mask gdb_bin_escapes(const char *buf)
+{
+    __m256i in;
+
+    in = _mm256_loadu_si256((const __m256i *)buf);
+    return (unsigned int) _mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(in, _mm256_set1_epi8('}')));
+}
+
+static void gdb_block_copy(char *dst, const char *src)
+{
+    _mm256_storeu_si256((__m256i *)dst,
+                        _mm256_loadu_si256((const __m256i *)src));
+}
+
+typedef __m256i gdb_simd_sum;
+
+static gdb_simd_sum gdb_block_sum_zero(void)
+{
+    return _mm256_setzero_si256();
+}
+
+static gdb_simd_sum gdb_block_sum(gdb_simd_sum acc, const char *buf)
+{
+    return _mm256_add_epi8(acc, _mm256_loadu_si256((const __m256i *)buf));
+}
+
+static unsigned char gdb_block_sum_fold(gdb_simd_sum acc)
+{
+    return gdb_sum_fold_avx2(acc);
+}
+
+#elif GDB_SIMD_SSE2
+
+#define GDB_SIMD_BLOCK     16
+#define GDB_SIMD_MASK_BITS 1
+typedef unsigned int gdb_simd_mask;
+
+static gdb_simd_mask gdb_bin_specials(const char *data)
+{
+    __m128i in, hit;
+
+    in  = _mm_loadu_si128((const __m128i *)data);
+    hit = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(in, _mm_set1_epi8('$')),
+                     _mm_cmpeq_epi8(in, _mm_set1_epi8('#'))),
+        _mm_or_si128(_mm_cmpeq_epi8(in, _mm_set1_epi8('}')),
+                     _mm_cmpeq_epi8(in, _mm_set1_epi8('*'))));
+    return (unsigned int) _mm_movemask_epi8(hit);
+}
+
+static gdb_simd_mask gdb_bin_escapes(const char *buf)
+{
+    __m128i in;
+
+    in = _mm_loadu_si128((const __m128i *)buf);
+    return (unsigned int) _mm_movemask_epi8(
+        _mm_cmpeq_epi8(in, _mm_set1_epi8('}')));
+}
+
+static void gdb_block_copy(char *dst, const char *src)
+{
+    _mm_storeu_si128((__m128i *)dst, _mm_loadu_si128((const __m128i *)src));
+}
+
+typedef __m128i gdb_simd_sum;
+
+static gdb_simd_sum gdb_block_sum_zero(void)
+{
+    return _mm_setzero_si128();
+}
+
+static gdb_simd_sum gdb_block_sum(gdb_simd_sum acc, const char *buf)
+{
+    return _mm_add_epi8(acc, _mm_loadu_si128((const __m128i *)buf));
+}
+
+static unsigned char gdb_block_sum_fold(gdb_simd_sum acc)
+{
+    return gdb_sum_fold_sse2(acc);
+}
+
+#elif GDB_SIMD_NEON
+
+#define GDB_SIMD_BLOCK     16
+#define GDB_SIMD_MASK_BITS 4
+typedef unsigned long long gdb_simd_mask;
+
+/*
+ * NEON has no movemask; narrowing each 16-bit lane by 4 leaves one nibble
+ * per byte.
+ */
+static gdb_simd_mask gdb_neon_mask(uint8x16_t hit)
+{
+    uint8x8_t nib;
+
+    nib = vshrn_n_u16(vreinterpretq_u16_u8(hit), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(nib), 0);
+}
+
+static gdb_simd_mask gdb_bin_specials(const char *data)
+{
+    uint8x16_t in, hit;
+
+    in  = vld1q_u8((const uint8_t *)data);
+    hit = vorrq_u8(vorrq_u8(vceqq_u8(in, vdupq_n_u8('$')),
+                            vceqq_u8(in, vdupq_n_u8('#'))),
+                   vorrq_u8(vceqq_u8(in, vdupq_n_u8('}')),
+                            vceqq_u8(in, vdupq_n_u8('*'))));
+    return gdb_neon_mask(hit);
+}
+
+static gdb_simd_mask gdb_bin_escapes(const char *buf)
+{
+    uint8x16_t in;
+
+    in = vld1q_u8((const uint8_t *)buf);
+    return gdb_neon_mask(vceqq_u8(in, vdupq_n_u8('}')));
+}
+
+static void gdb_block_copy(char *dst, const char *src)
+{
+    vst1q_u8((uint8_t *)dst, vld1q_u8((const uint8_t *)src));
+}
+
+typedef uint8x16_t gdb_simd_sum;
+
+static gdb_simd_sum gdb_block_sum_zero(void)
+{
+    return vdupq_n_u8(0);
+}
+
+static gdb_simd_sum gdb_block_sum(gdb_simd_sum acc, const char *buf)
+{
+    return vaddq_u8(acc, vld1q_u8((const uint8_t *)buf));
+}
+
+static unsigned char gdb_block_sum_fold(gdb_simd_sum acc)
+{
+    uint64x2_t wide;
+
+    wide = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(acc)));
+    return vgetq_lane_u64(wide, 0) + vgetq_lane_u64(wide, 1);
+}
+
+#endif
+
+#ifdef GDB_SIMD_BLOCK
+
+/*
+ * Offset of the first matching byte in a nonzero block mask.
+ */
+static unsigned int gdb_mask_first(gdb_simd_mask mask)
+{
+    return __builtin_ctzll(mask) / GDB_SIMD_MASK_BITS;
+}
+
+/*
+ * Number of matching bytes in a block mask.
+ */
+static unsigned int gdb_mask_count(gdb_simd_mask mask)
+{
+    return __builtin_popcountll(mask) / GDB_SIMD_MASK_BITS;
+}
+
+#endif /* GDB_SIMD_BLOCK */
+
 /*****************************************************************************
  * Data Encoding/Decoding Functions
  ****************************************************************************/
 
 /**
- * @brief Encode data into its hexadecimal representation and store in a buffer.
+ * @brief Encoder that also adds the bytes it writes to a packet checksum.
+ *
+ * Used to build outgoing packets in a single pass over the data.
+ */
+typedef int (*gdb_enc_csum_func)(char *buf, unsigned int buf_len,
+                                 const char *data, unsigned int data_len,
+                                 unsigned char *csum);
+
+/**
+ * @brief Encode data into its hexadecimal representation, updating a checksum.
  * 
  * @param buf Output buffer where the hexadecimal representation will be stored.
  * @param buf_len Size of the output buffer.
  * @param data Input data buffer to encode.
  * @param data_len Length of the input data.
+ * @param csum Checksum the written digits are added to.
  * 
  * @return The number of bytes written to buf or GDB_EOF if the buffer is too small.
  */
-static int gdb_enc_hex(char *buf, unsigned int buf_len, const char *data,
-                       unsigned int data_len)
+static int gdb_enc_hex_csum(char *buf, unsigned int buf_len, const char *data,
+                            unsigned int data_len, unsigned char *csum)
 {
     unsigned int pos;
+    char hi, lo;
 
     if (buf_len < data_len*2) {
         /* Buffer too small */
         return GDB_EOF;
     }
 
-    for (pos = 0; pos < data_len; pos++) {
-        *buf++ = gdb_get_digit((data[pos] >> 4) & 0xf);
-        *buf++ = gdb_get_digit((data[pos]     ) & 0xf);
+    pos = 0;
+
+#if GDB_SIMD_AVX2
+    if (pos+32 <= data_len) {
+        __m256i sum = _mm256_setzero_si256();
+        for (; pos+32 <= data_len; pos += 32) {
+            gdb_enc_hex_avx2(buf+pos*2, data+pos, &sum);
+        }
+        *csum += gdb_sum_fold_avx2(sum);
+    }
+#endif
+#if GDB_SIMD_SSE2
+    if (pos+16 <= data_len) {
+        __m128i sum = _mm_setzero_si128();
+        for (; pos+16 <= data_len; pos += 16) {
+            gdb_enc_hex_sse2(buf+pos*2, data+pos, &sum);
+        }
+        *csum += gdb_sum_fold_sse2(sum);
+    }
+#endif
+
+    for (; pos < data_len; pos++) {
+        hi = digits[(data[pos] >> 4) & 0xf];
+        lo = digits[(data[pos]     ) & 0xf];
+        buf[pos*2]   = hi;
+        buf[pos*2+1] = lo;
+        *csum += hi + lo;
     }
 
     return data_len*2;
 }
 
+/**
+ * @brief Encode data into its hexadecimal representation and store in a buffer.
+ * 
+ * @param buf Output buffer where the hexadecimal representation will be stored.
+ * @param buf_len Size of the output buffer.
+ * @param data Input data buffer to encode.
+ * @param data_len Length of the input data.
+ * 
+ * @return The number of bytes written to buf or GDB_EOF if the buffer is too small.
+ */
+static int gdb_enc_hex(char *buf, unsigned int buf_len, const char *data,
+                       unsigned int data_len)
+{
+    unsigned char csum = 0;
+
+    return gdb_enc_hex_csum(buf, buf_len, data, data_len, &csum);
+}
+
 /**
  * @brief Decode data from its hexadecimal representation and store in a buffer.
  * 
+ * Invalid digits are collected while decoding and reported once at the end,
+ * in which case the contents of data are undefined.
+ *
  * @param buf Input buffer containing the hexadecimal data.
  * @param buf_len Length of the input buffer.
  * @param data Output buffer where the decoded data will be stored.
  * @param data_len Expected length of the decoded data.
  * 
- * @return 0 if decoding was successful, or GDB_EOF if the buffer is too small or contains invalid data.
+ * @return The number of bytes decoded (data_len) or GDB_EOF if the buffer is too small or contains invalid data.
  */
 static int gdb_dec_hex(const char *buf, unsigned int buf_len, char *data,
                        unsigned int data_len)
 {
+    const unsigned char *src;
     unsigned int pos;
-    int tmp;
+    unsigned char hi, lo, bad;
 
     if (buf_len != data_len*2) {
         /* Buffer too small */
         return GDB_EOF;
     }
 
-    for (pos = 0; pos < data_len; pos++) {
-        /* Decode high nibble */
-        tmp = gdb_get_val(*buf++, 16);
-        if (tmp == GDB_EOF) {
-            /* Buffer contained junk */
-            GDB_ASSERT(0);
-            return GDB_EOF;
+    src = (const unsigned char *)buf;
+    pos = 0;
+    bad = 0;
+
+#if GDB_SIMD_AVX2
+    {
+        __m256i bad_vec = _mm256_setzero_si256();
+        for (; pos+32 <= data_len; pos += 32) {
+            gdb_dec_hex_avx2(buf+pos*2, data+pos, &bad_vec);
+        }
+        bad |= _mm256_movemask_epi8(bad_vec) ? 0xff : 0;
+    }
+#endif
+#if GDB_SIMD_SSE2
+    {
+        __m128i bad_vec = _mm_setzero_si128();
+        for (; pos+16 <= data_len; pos += 16) {
+            gdb_dec_hex_sse2(buf+pos*2, data+pos, &bad_vec);
         }
+        bad |= _mm_movemask_epi8(bad_vec) ? 0xff : 0;
+    }
+#endif
 
-        data[pos] = tmp << 4;
+    for (; pos < data_len; pos++) {
+        hi = gdb_hex_vals[src[pos*2]];
+        lo = gdb_hex_vals[src[pos*2+1]];
+        bad |= hi | lo;
+        data[pos] = (hi << 4) | lo;
+    }
 
-        /* Decode low nibble */
-        tmp = gdb_get_val(*buf++, 16);
-        if (tmp == GDB_EOF) {
-            /* Buffer contained junk */
-            GDB_ASSERT(0);
-            return GDB_EOF;
+    if (bad & 0xf0) {
+        /* Buffer contained junk */
+        GDB_ASSERT(0);
+        return GDB_EOF;
+    }
+
+    return data_len;
+}
+
+/**
+ * @brief Check whether a byte must be escaped in binary data.
+ *
+ * @param ch Byte to check.
+ *
+ * @return 1 if the byte must be escaped, 0 otherwise.
+ */
+static int gdb_bin_is_special(char ch)
+{
+    return (ch == '$' || ch == '#' || ch == '}' || ch == '*');
+}
+
+/**
+ * @brief Calculate the exact size of the binary representation of data.
+ *
+ * @param data Input data buffer.
+ * @param data_len Length of the input data.
+ *
+ * @return The number of bytes gdb_enc_bin() will produce.
+ */
+static unsigned int gdb_enc_bin_len(const char *data, unsigned int data_len)
+{
+    unsigned int pos, size;
+
+    pos  = 0;
+    size = data_len;
+
+#ifdef GDB_SIMD_BLOCK
+    for (; pos+GDB_SIMD_BLOCK <= data_len; pos += GDB_SIMD_BLOCK) {
+        size += gdb_mask_count(gdb_bin_specials(data+pos));
+    }
+#endif
+
+    for (; pos < data_len; pos++) {
+        size += gdb_bin_is_special(data[pos]);
+    }
+
+    return size;
+}
+
+/**
+ * @brief Encode data into its binary representation, updating a checksum.
+ * 
+ * The output size is computed up front, so runs of bytes that need no escape
+ * are copied a block at a time without per-byte checks. data may overlap the
+ * end of buf as long as the output can't overtake the input, which is how
+ * gdb_mem_stage() encodes in place.
+ *
+ * @param buf Output buffer where the binary representation will be stored.
+ * @param buf_len Size of the output buffer.
+ * @param data Input data buffer to encode.
+ * @param data_len Length of the input data.
+ * @param csum Checksum the written bytes are added to.
+ * 
+ * @return The number of bytes written to buf or GDB_EOF if the buffer is too small.
+ */
+static int gdb_enc_bin_csum(char *buf, unsigned int buf_len, const char *data,
+                            unsigned int data_len, unsigned char *csum)
+{
+    unsigned int buf_pos, data_pos;
+    unsigned char sum;
+    char ch;
+#ifdef GDB_SIMD_BLOCK
+    gdb_simd_mask mask;
+    gdb_simd_sum block_sum;
+    unsigned int run;
+#endif
+
+    if (gdb_enc_bin_len(data, data_len) > buf_len) {
+        /* Buffer too small */
+        GDB_ASSERT(0);
+        return GDB_EOF;
+    }
+
+    buf_pos  = 0;
+    data_pos = 0;
+    sum      = 0;
+
+#ifdef GDB_SIMD_BLOCK
+    block_sum = gdb_block_sum_zero();
+    while (data_pos+GDB_SIMD_BLOCK <= data_len) {
+        mask = gdb_bin_specials(data+data_pos);
+        if (!mask) {
+            block_sum = gdb_block_sum(block_sum, data+data_pos);
+            gdb_block_copy(buf+buf_pos, data+data_pos);
+            buf_pos  += GDB_SIMD_BLOCK;
+            data_pos += GDB_SIMD_BLOCK;
+            continue;
+        }
+
+        /* Copy the clean run, then escape the byte ending it */
+        for (run = gdb_mask_first(mask); run; run--) {
+            sum += data[data_pos];
+            buf[buf_pos++] = data[data_pos++];
+        }
+        ch = data[data_pos++] ^ 0x20;
+        buf[buf_pos++] = '}';
+        buf[buf_pos++] = ch;
+        sum += '}' + ch;
+    }
+    sum += gdb_block_sum_fold(block_sum);
+#endif
+
+    for (; data_pos < data_len; data_pos++) {
+        ch = data[data_pos];
+        if (gdb_bin_is_special(ch)) {
+            ch ^= 0x20;
+            buf[buf_pos++] = '}';
+            sum += '}';
         }
-        data[pos] |= tmp;
+        buf[buf_pos++] = ch;
+        sum += ch;
     }
 
-    return 0;
+    *csum += sum;
+    return buf_pos;
 }
 
 /**
@@ -88,34 +748,78 @@ static int gdb_dec_hex(const char *buf, unsigned int buf_len, char *data,
 static int gdb_enc_bin(char *buf, unsigned int buf_len, const char *data,
                        unsigned int data_len)
 {
-    unsigned int buf_pos, data_pos;
+    unsigned char csum = 0;
 
-    for (buf_pos = 0, data_pos = 0; data_pos < data_len; data_pos++) {
-        if (data[data_pos] == '$' ||
-            data[data_pos] == '#' ||
-            data[data_pos] == '}' ||
-            data[data_pos] == '*') {
-            if (buf_pos+1 >= buf_len) {
-                GDB_ASSERT(0);
-                return GDB_EOF;
+    return gdb_enc_bin_csum(buf, buf_len, data, data_len, &csum);
+}
+
+/// Fewest repeats worth replacing with a '*' count
+#define GDB_RLE_MIN_REPEAT 3
+/// Most repeats a single printable count character can express
+#define GDB_RLE_MAX_REPEAT ('~'-29)
+
+/**
+ * @brief Run-length encode packet data in place, updating a checksum.
+ *
+ * A run is sent as the character followed by '*' and a count character of
+ * value n+29 for n additional repeats. Counts that would make the count
+ * character '#' or '$' are shortened, and the rest of the run is sent
+ * separately.
+ *
+ * @param buf Packet data, overwritten with the encoded data.
+ * @param buf_len Length of the packet data.
+ * @param csum Checksum the encoded bytes are added to.
+ *
+ * @return The length of the encoded data, never more than buf_len.
+ */
+static unsigned int gdb_enc_rle_csum(char *buf, unsigned int buf_len,
+                                     unsigned char *csum)
+{
+    unsigned int in, out, run, rest, count;
+    unsigned char sum;
+    char ch;
+
+    sum = 0;
+    for (in = 0, out = 0; in < buf_len; in += run) {
+        ch = buf[in];
+        for (run = 1; in+run < buf_len && buf[in+run] == ch; run++) {
+        }
+
+        for (rest = run; rest; rest -= count) {
+            buf[out++] = ch;
+            sum += ch;
+            rest -= 1;
+
+            if (rest < GDB_RLE_MIN_REPEAT) {
+                count = 0;
+                continue;
             }
-            buf[buf_pos++] = '}';
-            buf[buf_pos++] = data[data_pos] ^ 0x20;
-        } else {
-            if (buf_pos >= buf_len) {
-                GDB_ASSERT(0);
-                return GDB_EOF;
+
+            /* Encode the repeats following the literal */
+            count = rest;
+            if (count > GDB_RLE_MAX_REPEAT) {
+                count = GDB_RLE_MAX_REPEAT;
             }
-            buf[buf_pos++] = data[data_pos];
+            if (count+29 == '#' || count+29 == '$') {
+                count = '#'-29-1;
+            }
+            buf[out++] = '*';
+            buf[out++] = count+29;
+            sum += '*' + count+29;
         }
     }
 
-    return buf_pos;
+    *csum += sum;
+    return out;
 }
 
 /**
  * @brief Decode data from its binary representation and store in a buffer.
  * 
+ * Blocks without an escape character are copied whole while both buffers
+ * have a block left. data may overlap buf as long as it doesn't start after
+ * buf.
+ *
  * @param buf Input buffer containing the binary data.
  * @param buf_len Length of the input buffer.
  * @param data Output buffer where the decoded data will be stored.
@@ -127,8 +831,43 @@ static int gdb_dec_bin(const char *buf, unsigned int buf_len, char *data,
                        unsigned int data_len)
 {
     unsigned int buf_pos, data_pos;
+#ifdef GDB_SIMD_BLOCK
+    gdb_simd_mask mask;
+    unsigned int run;
+#endif
+
+    buf_pos  = 0;
+    data_pos = 0;
+
+#ifdef GDB_SIMD_BLOCK
+    while ((buf_pos+GDB_SIMD_BLOCK <= buf_len) &&
+           (data_pos+GDB_SIMD_BLOCK <= data_len)) {
+        mask = gdb_bin_escapes(buf+buf_pos);
+        if (!mask) {
+            gdb_block_copy(data+data_pos, buf+buf_pos);
+            buf_pos  += GDB_SIMD_BLOCK;
+            data_pos += GDB_SIMD_BLOCK;
+            continue;
+        }
+
+        /* Copy the clean run */
+        run = gdb_mask_first(mask);
+        gdb_memcpy(data+data_pos, buf+buf_pos, run);
+        buf_pos  += run;
+        data_pos += run;
+
+        if (buf_pos+1 >= buf_len) {
+            /* Let the checked loop below report the dangling escape */
+            break;
+        }
+
+        /* The next byte is escaped */
+        data[data_pos++] = buf[buf_pos+1] ^ 0x20;
+        buf_pos += 2;
+    }
+#endif
 
-    for (buf_pos = 0, data_pos = 0; buf_pos < buf_len; buf_pos++) {
+    for (; buf_pos < buf_len; buf_pos++) {
         if (data_pos >= data_len) {
             /* Output buffer overflow */
             GDB_ASSERT(0);
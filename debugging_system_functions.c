@@ -14,6 +14,201 @@
 
 #ifdef GDBSTUB_ARCH_MOCK
 
+#include <time.h>
+
+/**
+ * @brief Transport call counters, used to compare transmit/receive paths.
+ */
+struct gdb_mock_stats {
+    unsigned long tx_calls; ///< Number of calls into the transmit hooks
+    unsigned long tx_bytes; ///< Number of bytes transmitted
+    unsigned long rx_calls; ///< Number of calls into the receive hooks
+    unsigned long rx_bytes; ///< Number of bytes received
+};
+
+struct gdb_mock_stats gdb_mock_stats;
+
+/*****************************************************************************
+ * Mock Transport Ring Buffers
+ ****************************************************************************/
+
+/// Ring buffer capacity in bytes; must be a power of two
+#ifndef GDB_BUF_SIZE
+#define GDB_BUF_SIZE 4096
+#endif
+
+/// Cache line size used to keep producer and consumer indices apart
+#ifndef GDB_CACHE_LINE
+#define GDB_CACHE_LINE 64
+#endif
+
+#define GDB_BUF_MASK (GDB_BUF_SIZE-1)
+
+/* Fails to compile if GDB_BUF_SIZE is not a power of two */
+typedef char gdb_buf_size_check[(GDB_BUF_SIZE & GDB_BUF_MASK) ? -1 : 1];
+
+/**
+ * @brief Lock-free single-producer/single-consumer byte ring.
+ *
+ * One side (host test harness or stub) writes, the other reads, from any two
+ * threads. head and tail run freely and are masked on access, so full and
+ * empty are told apart without a spare slot. Each side keeps a cached copy of
+ * the other side's index on its own cache line and only reloads it when the
+ * cached value says the ring is full (or empty), so the lines don't bounce
+ * between cores on every byte.
+ */
+struct gdb_buffer {
+    /* Consumer line */
+    unsigned int head __attribute__((aligned(GDB_CACHE_LINE))); ///< Read index, written by the consumer
+    unsigned int tail_cache; ///< Consumer's last seen tail
+    /* Producer line */
+    unsigned int tail __attribute__((aligned(GDB_CACHE_LINE))); ///< Write index, written by the producer
+    unsigned int head_cache; ///< Producer's last seen head
+    int closed; ///< Set by the producer once no more data will be written
+    char buf[GDB_BUF_SIZE] __attribute__((aligned(GDB_CACHE_LINE)));
+};
+
+struct gdb_buffer gdb_input, gdb_output;
+
+/**
+ * @brief Write up to len bytes to a ring buffer without blocking.
+ *
+ * Producer side only.
+ *
+ * @param buf The buffer to write to.
+ * @param data Bytes to write.
+ * @param len Number of bytes to write.
+ * @return Number of bytes written, less than len if the ring filled up.
+ */
+unsigned int gdb_buf_write_bulk(struct gdb_buffer *buf, const char *data,
+                                unsigned int len)
+{
+    unsigned int tail, space, pos, first;
+
+    tail = buf->tail;
+    space = GDB_BUF_SIZE - (tail - buf->head_cache);
+    if (space < len) {
+        buf->head_cache = __atomic_load_n(&buf->head, __ATOMIC_ACQUIRE);
+        space = GDB_BUF_SIZE - (tail - buf->head_cache);
+        if (len > space) {
+            len = space;
+        }
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    /* Copy in at most two runs, split where the ring wraps */
+    pos = tail & GDB_BUF_MASK;
+    first = GDB_BUF_SIZE - pos;
+    if (first > len) {
+        first = len;
+    }
+    __builtin_memcpy(buf->buf + pos, data, first);
+    __builtin_memcpy(buf->buf, data + first, len - first);
+
+    __atomic_store_n(&buf->tail, tail + len, __ATOMIC_RELEASE);
+    return len;
+}
+
+/**
+ * @brief Read up to len bytes from a ring buffer without blocking.
+ *
+ * Consumer side only.
+ *
+ * @param buf The buffer to read from.
+ * @param data Destination for the bytes read.
+ * @param len Size of data.
+ * @return Number of bytes read, 0 if the ring is empty.
+ */
+unsigned int gdb_buf_read_bulk(struct gdb_buffer *buf, char *data,
+                               unsigned int len)
+{
+    unsigned int head, avail, pos, first;
+
+    head = buf->head;
+    avail = buf->tail_cache - head;
+    if (avail < len) {
+        buf->tail_cache = __atomic_load_n(&buf->tail, __ATOMIC_ACQUIRE);
+        avail = buf->tail_cache - head;
+        if (len > avail) {
+            len = avail;
+        }
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    pos = head & GDB_BUF_MASK;
+    first = GDB_BUF_SIZE - pos;
+    if (first > len) {
+        first = len;
+    }
+    __builtin_memcpy(data, buf->buf + pos, first);
+    __builtin_memcpy(data + first, buf->buf, len - first);
+
+    __atomic_store_n(&buf->head, head + len, __ATOMIC_RELEASE);
+    return len;
+}
+
+/**
+ * @brief Mark a ring buffer as closed.
+ *
+ * Producer side only. Readers drain what is left, then get EOF.
+ *
+ * @param buf The buffer to close.
+ */
+void gdb_buf_close(struct gdb_buffer *buf)
+{
+    __atomic_store_n(&buf->closed, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Buffer write function for gdb_buf_write.
+ *
+ * Spins while the ring is full, so a slow reader throttles the writer.
+ *
+ * @param buf The buffer to write to.
+ * @param ch The character to write.
+ */
+void gdb_buf_write(struct gdb_buffer *buf, int ch)
+{
+    char c = (char) ch;
+
+    while (gdb_buf_write_bulk(buf, &c, 1) == 0) {
+        /* Wait for the reader */
+    }
+}
+
+/**
+ * @brief Buffer read function for gdb_buf_read.
+ *
+ * Spins while the ring is empty and still open.
+ *
+ * @param buf The buffer to read from.
+ * @return The read character or EOF.
+ */
+int gdb_buf_read(struct gdb_buffer *buf)
+{
+    char c;
+
+    while (gdb_buf_read_bulk(buf, &c, 1) == 0) {
+        /* Check closed before retrying so bytes written just before the
+         * close are not lost */
+        if (__atomic_load_n(&buf->closed, __ATOMIC_ACQUIRE)) {
+            if (gdb_buf_read_bulk(buf, &c, 1) == 0) {
+                return GDB_EOF;
+            }
+            break;
+        }
+    }
+    return (unsigned char) c;
+}
+
+/*****************************************************************************
+ * Mock Debugging Stream
+ ****************************************************************************/
+
 /**
  * @brief Write one character to the debugging stream.
  * 
@@ -23,6 +218,8 @@
  */
 int gdb_sys_putchar(struct gdb_state *state, int ch)
 {
+    gdb_mock_stats.tx_calls += 1;
+    gdb_mock_stats.tx_bytes += 1;
 #ifdef USE_STDIO
     putchar(ch);
 #else
@@ -31,6 +228,36 @@ int gdb_sys_putchar(struct gdb_state *state, int ch)
     return 0;
 }
 
+/**
+ * @brief Write a buffer to the debugging stream in one call.
+ *
+ * Build with GDB_HAVE_SYS_WRITE=0 to measure the per-byte putchar path instead.
+ *
+ * @param state Pointer to the gdb_state struct
+ * @param buf Buffer to write
+ * @param len Number of bytes to write
+ * @return 0 on success, or GDB_EOF on failure
+ */
+int gdb_sys_write(struct gdb_state *state, const char *buf, unsigned int len)
+{
+    gdb_mock_stats.tx_calls += 1;
+    gdb_mock_stats.tx_bytes += len;
+#ifdef USE_STDIO
+    if (fwrite(buf, 1, len, stdout) != len) {
+        return GDB_EOF;
+    }
+#else
+    unsigned int n;
+
+    while (len) {
+        n = gdb_buf_write_bulk(&gdb_output, buf, len);
+        buf += n;
+        len -= n;
+    }
+#endif
+    return 0;
+}
+
 /**
  * @brief Read one character from the debugging stream.
  * 
@@ -39,36 +266,249 @@ int gdb_sys_putchar(struct gdb_state *state, int ch)
  */
 int gdb_sys_getc(struct gdb_state *state)
 {
+    int ch;
+
+    gdb_mock_stats.rx_calls += 1;
+#ifdef USE_STDIO
+    ch = getchar();
+    ch = (ch == EOF) ? GDB_EOF : ch;
+#else
+    ch = gdb_buf_read(&gdb_input);
+#endif
+    if (ch != GDB_EOF) {
+        gdb_mock_stats.rx_bytes += 1;
+    }
+    return ch;
+}
+
+/**
+ * @brief Read whatever is available from the debugging stream, up to len bytes.
+ *
+ * Blocks until at least one byte has been read.
+ *
+ * @param state Pointer to the gdb_state struct
+ * @param buf Buffer to read into
+ * @param len Size of buf
+ * @return Number of bytes read, or GDB_EOF
+ */
+int gdb_sys_read(struct gdb_state *state, char *buf, unsigned int len)
+{
+    unsigned int pos;
+    int ch;
+
+    gdb_mock_stats.rx_calls += 1;
 #ifdef USE_STDIO
-    int ch = getchar();
-    return ch == EOF ? GDB_EOF : ch;
+    /* stdio can't tell how much is pending without blocking */
+    ch = getchar();
+    if (ch == EOF) {
+        return GDB_EOF;
+    }
+    buf[0] = (char) ch;
+    pos = 1;
 #else
-    return gdb_buf_read(&gdb_input);
+    /* Block for the first byte, then take whatever else is ready */
+    if ((ch = gdb_buf_read(&gdb_input)) == GDB_EOF) {
+        return GDB_EOF;
+    }
+    buf[0] = (char) ch;
+    pos = 1 + gdb_buf_read_bulk(&gdb_input, buf + 1, len - 1);
 #endif
+    gdb_mock_stats.rx_bytes += pos;
+    return pos;
+}
+
+/**
+ * @brief Read a monotonic clock for latency profiling (GDB_PROFILE).
+ *
+ * @param state Pointer to the gdb_state struct
+ * @return Current time in nanoseconds
+ */
+unsigned long gdb_sys_clock(struct gdb_state *state)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long) ts.tv_sec*1000000000UL + ts.tv_nsec;
 }
 
-// Other functions with Doxygen comments here...
+/*****************************************************************************
+ * Mock Memory Access
+ ****************************************************************************/
+
+/// Native word size used for block copies when no access width is requested
+#define GDB_MEM_WORD sizeof(unsigned long)
+
+/// Size of the memory of the mock target
+#ifndef GDB_MOCK_MEM_SIZE
+#define GDB_MOCK_MEM_SIZE 0x10000
+#endif
 
 /**
- * @brief Buffer write function for gdb_buf_write.
+ * @brief Memory of the mock target.
  *
- * @param buf The buffer to write to.
- * @param ch The character to write.
+ * Addresses from the debugger are offsets into it, so any address gdb sends
+ * is safe to access. Accesses past the end fault.
  */
-void gdb_buf_write(struct gdb_buffer *buf, int ch)
+char gdb_mock_mem[GDB_MOCK_MEM_SIZE] __attribute__((aligned(GDB_CACHE_LINE)));
+
+/**
+ * @brief Bound a transfer to the mock memory.
+ *
+ * @param addr Address of the transfer
+ * @param len Set to the number of bytes that can be transferred
+ * @return Host address of the first byte
+ */
+static uintptr_t gdb_mock_mem_bound(address addr, unsigned int *len)
 {
-    // function implementation
+    if (addr >= GDB_MOCK_MEM_SIZE) {
+        *len = 0;
+        return (uintptr_t) gdb_mock_mem;
+    }
+    if (*len > GDB_MOCK_MEM_SIZE-addr) {
+        *len = GDB_MOCK_MEM_SIZE-addr;
+    }
+    return (uintptr_t) (gdb_mock_mem+addr);
 }
 
 /**
- * @brief Buffer read function for gdb_buf_read.
+ * @brief Read mock memory into buf.
  *
- * @param buf The buffer to read from.
- * @return The read character or EOF.
+ * With width 0, leading bytes up to a word boundary are read singly and the
+ * rest a native word at a time; otherwise accesses are exactly width bytes.
+ * Hosts without 64-bit loads read width 8 as two 4 byte accesses.
+ *
+ * @param state Pointer to the gdb_state struct
+ * @param addr Address to read from
+ * @param buf Buffer to read into
+ * @param len Number of bytes to read
+ * @param width Access width hint: 0, 1, 2, 4 or 8
+ * @return Number of bytes read, short if the transfer runs off the end
  */
-int gdb_buf_read(struct gdb_buffer *buf)
+int gdb_sys_mem_read(struct gdb_state *state, address addr, char *buf,
+                     unsigned int len, unsigned int width)
 {
-    // function implementation
+    uintptr_t p;
+    unsigned int left;
+    unsigned long word;
+    uint16_t v16;
+    uint32_t v32;
+#if UINTPTR_MAX > 0xffffffffu
+    uint64_t v64;
+#endif
+
+    p = gdb_mock_mem_bound(addr, &len);
+    left = len;
+
+    switch (width) {
+    case 2:
+        for (; left >= 2; left -= 2, p += 2, buf += 2) {
+            v16 = *(volatile uint16_t *) p;
+            __builtin_memcpy(buf, &v16, 2);
+        }
+        break;
+    case 8:
+#if UINTPTR_MAX > 0xffffffffu
+        for (; left >= 8; left -= 8, p += 8, buf += 8) {
+            v64 = *(volatile uint64_t *) p;
+            __builtin_memcpy(buf, &v64, 8);
+        }
+        break;
+#endif
+        /* fall through */
+    case 4:
+        for (; left >= 4; left -= 4, p += 4, buf += 4) {
+            v32 = *(volatile uint32_t *) p;
+            __builtin_memcpy(buf, &v32, 4);
+        }
+        break;
+    case 0:
+        for (; left && (p & (GDB_MEM_WORD-1)); left--) {
+            *buf++ = *(volatile char *) p++;
+        }
+        for (; left >= GDB_MEM_WORD; left -= GDB_MEM_WORD) {
+            word = *(volatile unsigned long *) p;
+            __builtin_memcpy(buf, &word, GDB_MEM_WORD);
+            p += GDB_MEM_WORD;
+            buf += GDB_MEM_WORD;
+        }
+        break;
+    }
+
+    /* Remaining bytes, or all of them for width 1 */
+    for (; left; left--) {
+        *buf++ = *(volatile char *) p++;
+    }
+
+    return len;
+}
+
+/**
+ * @brief Write buf to mock memory.
+ *
+ * Accesses are sized as for gdb_sys_mem_read().
+ *
+ * @param state Pointer to the gdb_state struct
+ * @param addr Address to write to
+ * @param buf Buffer to write from
+ * @param len Number of bytes to write
+ * @param width Access width hint: 0, 1, 2, 4 or 8
+ * @return Number of bytes written, short if the transfer runs off the end
+ */
+int gdb_sys_mem_write(struct gdb_state *state, address addr, const char *buf,
+                      unsigned int len, unsigned int width)
+{
+    uintptr_t p;
+    unsigned int left;
+    unsigned long word;
+    uint16_t v16;
+    uint32_t v32;
+#if UINTPTR_MAX > 0xffffffffu
+    uint64_t v64;
+#endif
+
+    p = gdb_mock_mem_bound(addr, &len);
+    left = len;
+
+    switch (width) {
+    case 2:
+        for (; left >= 2; left -= 2, p += 2, buf += 2) {
+            __builtin_memcpy(&v16, buf, 2);
+            *(volatile uint16_t *) p = v16;
+        }
+        break;
+    case 8:
+#if UINTPTR_MAX > 0xffffffffu
+        for (; left >= 8; left -= 8, p += 8, buf += 8) {
+            __builtin_memcpy(&v64, buf, 8);
+            *(volatile uint64_t *) p = v64;
+        }
+        break;
+#endif
+        /* fall through */
+    case 4:
+        for (; left >= 4; left -= 4, p += 4, buf += 4) {
+            __builtin_memcpy(&v32, buf, 4);
+            *(volatile uint32_t *) p = v32;
+        }
+        break;
+    case 0:
+        for (; left && (p & (GDB_MEM_WORD-1)); left--) {
+            *(volatile char *) p++ = *buf++;
+        }
+        for (; left >= GDB_MEM_WORD; left -= GDB_MEM_WORD) {
+            __builtin_memcpy(&word, buf, GDB_MEM_WORD);
+            *(volatile unsigned long *) p = word;
+            p += GDB_MEM_WORD;
+            buf += GDB_MEM_WORD;
+        }
+        break;
+    }
+
+    for (; left; left--) {
+        *(volatile char *) p++ = *buf++;
+    }
+
+    return len;
 }
 
 #endif /* GDBSTUB_ARCH_MOCK */
@@ -82,7 +522,1474 @@ int gdb_buf_read(struct gdb_buffer *buf)
 
 #ifdef GDBSTUB_ARCH_X86
 
-// Doxygen comments for x86-specific functions...
+/*****************************************************************************
+ * x86 Serial Port
+ ****************************************************************************/
+
+/// I/O base of the 16550 UART the debugger talks through (COM1)
+#ifndef GDB_X86_UART_PORT
+#define GDB_X86_UART_PORT 0x3f8
+#endif
+
+/// Line speed
+#ifndef GDB_X86_UART_BAUD
+#define GDB_X86_UART_BAUD 115200
+#endif
+
+/// UART input clock; 921600 baud needs a faster one than the PC's 1.8432 MHz
+#ifndef GDB_X86_UART_CLOCK
+#define GDB_X86_UART_CLOCK 1843200
+#endif
+
+/// Size of the receive ring, a power of two
+#ifndef GDB_X86_UART_RX_SIZE
+#define GDB_X86_UART_RX_SIZE 1024
+#endif
+
+#define GDB_X86_UART_DIVISOR (GDB_X86_UART_CLOCK/16/GDB_X86_UART_BAUD)
+
+typedef char gdb_x86_uart_divisor_check[
+    (GDB_X86_UART_DIVISOR >= 1 && GDB_X86_UART_DIVISOR <= 0xffff) ? 1 : -1];
+typedef char gdb_x86_uart_rx_size_check[
+    (GDB_X86_UART_RX_SIZE & (GDB_X86_UART_RX_SIZE-1)) ? -1 : 1];
+
+#define GDB_X86_UART_RBR 0 ///< Receive buffer (read)
+#define GDB_X86_UART_THR 0 ///< Transmit holding (write)
+#define GDB_X86_UART_DLL 0 ///< Divisor low byte (DLAB set)
+#define GDB_X86_UART_IER 1 ///< Interrupt enable
+#define GDB_X86_UART_DLM 1 ///< Divisor high byte (DLAB set)
+#define GDB_X86_UART_IIR 2 ///< Interrupt identification (read)
+#define GDB_X86_UART_FCR 2 ///< FIFO control (write)
+#define GDB_X86_UART_LCR 3 ///< Line control
+#define GDB_X86_UART_MCR 4 ///< Modem control
+#define GDB_X86_UART_LSR 5 ///< Line status
+
+#define GDB_X86_UART_IER_RDA   0x01 ///< Interrupt on received data
+#define GDB_X86_UART_FCR_FIFO  0x07 ///< FIFOs on and cleared, RX trigger at 1 byte
+#define GDB_X86_UART_IIR_FIFO  0xc0 ///< FIFOs are working (16550A)
+#define GDB_X86_UART_LCR_8N1   0x03
+#define GDB_X86_UART_LCR_DLAB  0x80
+#define GDB_X86_UART_MCR_OUT   0x0b ///< DTR, RTS, and OUT2 to pass the IRQ on
+#define GDB_X86_UART_LSR_DR    0x01 ///< Received data ready
+#define GDB_X86_UART_LSR_THRE  0x20 ///< Transmit FIFO empty
+
+/// Bytes of the 16550A transmit FIFO
+#define GDB_X86_UART_FIFO 16
+
+/// Byte gdb sends to interrupt the running target
+#define GDB_X86_UART_BREAK 0x03
+
+/// Receive framing states; a break is only recognized between packets
+#define GDB_X86_UART_IDLE   0 ///< Between packets
+#define GDB_X86_UART_CSUM   2 ///< Checksum digits, counting down
+#define GDB_X86_UART_PACKET 3 ///< Packet data
+
+/**
+ * @brief Serial port state.
+ *
+ * Received bytes go into a ring, filled by the receive interrupt while the
+ * target runs and by polling while the stub runs with interrupts off. The
+ * two never run at once, so head belongs to readers and tail to the drain.
+ */
+struct gdb_x86_uart {
+    char         rx[GDB_X86_UART_RX_SIZE];
+    unsigned int head;     ///< Next byte to hand to the stub
+    unsigned int tail;     ///< Next free byte
+    unsigned int fifo;     ///< Bytes to write per empty transmitter
+    unsigned int overruns; ///< Bytes dropped with the ring full
+    unsigned int frame;    ///< Receive framing state
+};
+
+static struct gdb_x86_uart gdb_x86_uart;
+
+static void gdb_x86_io_write_8(uint16_t port, uint8_t val);
+static uint8_t gdb_x86_io_read_8(uint16_t port);
+int gdb_x86_smp_idle(int between);
+
+/**
+ * @brief Initialize the UART: line speed, 8N1, FIFOs and receive interrupt.
+ *
+ * The receive interrupt must already be routed to the stub.
+ */
+void gdb_x86_uart_init(void)
+{
+    gdb_x86_io_write_8(GDB_X86_UART_PORT+GDB_X86_UART_IER, 0);
+    gdb_x86_io_write_8(GDB_X86_UART_PORT+GDB_X86_UART_LCR,
+                       GDB_X86_UART_LCR_DLAB);
+    gdb_x86_io_write_8(GDB_X86_UART_PORT+GDB_X86_UART_DLL,
+                       GDB_X86_UART_DIVISOR & 0xff);
+    gdb_x86_io_write_8(GDB_X86_UART_PORT+GDB_X86_UART_DLM,
+                       GDB_X86_UART_DIVISOR >> 8);
+    gdb_x86_io_write_8(GDB_X86_UART_PORT+GDB_X86_UART_LCR,
+                       GDB_X86_UART_LCR_8N1);
+    gdb_x86_io_write_8(GDB_X86_UART_PORT+GDB_X86_UART_FCR,
+                       GDB_X86_UART_FCR_FIFO);
+
+    /* A plain 8250/16450 has no FIFO and takes one byte at a time */
+    gdb_x86_uart.fifo =
+        ((gdb_x86_io_read_8(GDB_X86_UART_PORT+GDB_X86_UART_IIR) &
+          GDB_X86_UART_IIR_FIFO) == GDB_X86_UART_IIR_FIFO) ?
+        GDB_X86_UART_FIFO : 1;
+
+    gdb_x86_io_write_8(GDB_X86_UART_PORT+GDB_X86_UART_MCR,
+                       GDB_X86_UART_MCR_OUT);
+    gdb_x86_uart.head = 0;
+    gdb_x86_uart.tail = 0;
+    gdb_x86_uart.frame = GDB_X86_UART_IDLE;
+    gdb_x86_io_write_8(GDB_X86_UART_PORT+GDB_X86_UART_IER,
+                       GDB_X86_UART_IER_RDA);
+}
+
+/**
+ * @brief Move everything in the receive FIFO into the ring.
+ *
+ * Packet framing is followed so that a break byte inside binary packet data
+ * is not mistaken for a break request.
+ *
+ * @param brk Nonzero to take break requests out of the stream
+ * @return 1 if a break request was taken out, 0 otherwise
+ */
+static int gdb_x86_uart_drain(int brk)
+{
+    unsigned int tail;
+    int seen;
+    char ch;
+
+    seen = 0;
+    tail = gdb_x86_uart.tail;
+    while (gdb_x86_io_read_8(GDB_X86_UART_PORT+GDB_X86_UART_LSR) &
+           GDB_X86_UART_LSR_DR) {
+        ch = gdb_x86_io_read_8(GDB_X86_UART_PORT+GDB_X86_UART_RBR);
+        switch (gdb_x86_uart.frame) {
+        case GDB_X86_UART_IDLE:
+            if (ch == '$') {
+                gdb_x86_uart.frame = GDB_X86_UART_PACKET;
+            } else if (brk && ch == GDB_X86_UART_BREAK) {
+                seen = 1;
+                continue;
+            }
+            break;
+        case GDB_X86_UART_PACKET:
+            if (ch == '#') {
+                gdb_x86_uart.frame = GDB_X86_UART_CSUM;
+            }
+            break;
+        default:
+            gdb_x86_uart.frame -= 1;
+        }
+        if (tail-gdb_x86_uart.head == GDB_X86_UART_RX_SIZE) {
+            gdb_x86_uart.overruns += 1;
+            continue;
+        }
+        gdb_x86_uart.rx[tail & (GDB_X86_UART_RX_SIZE-1)] = ch;
+        tail += 1;
+    }
+    __atomic_store_n(&gdb_x86_uart.tail, tail, __ATOMIC_RELEASE);
+    return seen;
+}
+
+/**
+ * @brief Service the UART receive interrupt.
+ *
+ * Called from the stub's interrupt handler while the target runs. Reading
+ * the FIFO empty clears the interrupt at the UART; the caller acknowledges
+ * the interrupt controller. Other bytes stay queued for the next packet.
+ *
+ * @return 1 if gdb asked to interrupt the target, 0 otherwise
+ */
+int gdb_x86_uart_irq(void)
+{
+    return gdb_x86_uart_drain(1);
+}
+
+/**
+ * @brief Check for received bytes the stub hasn't read yet.
+ *
+ * @return 1 if there are any, 0 otherwise
+ */
+int gdb_x86_uart_pending(void)
+{
+    return __atomic_load_n(&gdb_x86_uart.tail, __ATOMIC_ACQUIRE) !=
+           gdb_x86_uart.head;
+}
+
+/**
+ * @brief Write a buffer to the serial port.
+ *
+ * Each time the transmitter runs empty it is refilled with a whole FIFO's
+ * worth of bytes, rather than polling the status once per byte.
+ *
+ * @param state Pointer to the gdb_state struct
+ * @param buf Buffer to write
+ * @param len Number of bytes to write
+ * @return Always returns 0
+ */
+int gdb_sys_write(struct gdb_state *state, const char *buf, unsigned int len)
+{
+    unsigned int n;
+
+    while (len) {
+        while (!(gdb_x86_io_read_8(GDB_X86_UART_PORT+GDB_X86_UART_LSR) &
+                 GDB_X86_UART_LSR_THRE)) {
+            __builtin_ia32_pause();
+        }
+
+        n = (len < gdb_x86_uart.fifo) ? len : gdb_x86_uart.fifo;
+        len -= n;
+        while (n--) {
+            gdb_x86_io_write_8(GDB_X86_UART_PORT+GDB_X86_UART_THR, *buf++);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Write one character to the serial port.
+ *
+ * @param state Pointer to the gdb_state struct
+ * @param ch Character to write
+ * @return Always returns 0
+ */
+int gdb_sys_putchar(struct gdb_state *state, int ch)
+{
+    char c;
+
+    c = (char) ch;
+    return gdb_sys_write(state, &c, 1);
+}
+
+/**
+ * @brief Read whatever has been received, up to len bytes.
+ *
+ * Blocks until at least one byte is there, unless the stub has no reason to
+ * wait, see gdb_x86_smp_idle().
+ *
+ * @param state Pointer to the gdb_state struct
+ * @param buf Buffer to read into
+ * @param len Size of buf
+ * @return Number of bytes read, or GDB_EOF if there is nothing to wait for
+ */
+int gdb_sys_read(struct gdb_state *state, char *buf, unsigned int len)
+{
+    unsigned int head, avail, pos;
+
+    head = gdb_x86_uart.head;
+    for (;;) {
+        gdb_x86_uart_drain(0);
+        avail = __atomic_load_n(&gdb_x86_uart.tail, __ATOMIC_ACQUIRE)-head;
+        if (avail) {
+            break;
+        }
+        if (!gdb_x86_smp_idle(gdb_x86_uart.frame == GDB_X86_UART_IDLE)) {
+            return GDB_EOF;
+        }
+    }
+
+    if (len > avail) {
+        len = avail;
+    }
+    for (pos = 0; pos < len; pos++) {
+        buf[pos] = gdb_x86_uart.rx[(head+pos) & (GDB_X86_UART_RX_SIZE-1)];
+    }
+    __atomic_store_n(&gdb_x86_uart.head, head+len, __ATOMIC_RELEASE);
+    return len;
+}
+
+/**
+ * @brief Read one character from the serial port.
+ *
+ * @param state Pointer to the gdb_state struct
+ * @return The read character, or GDB_EOF
+ */
+int gdb_sys_getc(struct gdb_state *state)
+{
+    char c;
+
+    if (gdb_sys_read(state, &c, 1) == GDB_EOF) {
+        return GDB_EOF;
+    }
+    return (unsigned char) c;
+}
+
+#if GDB_PROFILE
+
+/*****************************************************************************
+ * x86 Clock
+ ****************************************************************************/
+
+#define GDB_X86_PIT_HZ   1193182 ///< PIT input clock
+#define GDB_X86_PIT_CH2  0x42    ///< Channel 2 counter
+#define GDB_X86_PIT_MODE 0x43    ///< Mode/command register
+#define GDB_X86_PIT_GATE 0x61    ///< Channel 2 gate (bit 0) and output (bit 5)
+
+#define GDB_X86_PIT_CH2_ONESHOT 0xb0 ///< Channel 2, low then high byte, mode 0
+#define GDB_X86_PIT_GATE_ON     0x01
+#define GDB_X86_PIT_SPEAKER     0x02
+#define GDB_X86_PIT_OUT         0x20
+
+/// Time the TSC is counted against the PIT for, in milliseconds
+#define GDB_X86_TSC_CAL_MS 10
+
+/**
+ * @brief TSC to nanoseconds scale, in 1/1024 ns per tick.
+ *
+ * Truncation makes the clock read up to half a percent slow at 5 GHz. Zero
+ * until gdb_x86_clock_init() has run, so gdb_sys_clock() reads 0.
+ */
+static uint32_t gdb_x86_tsc_scale;
+
+static uint64_t gdb_x86_rdtsc(void)
+{
+    uint64_t tsc;
+
+    asm volatile ("rdtsc" : "=A" (tsc));
+    return tsc;
+}
+
+/**
+ * @brief Calibrate the TSC against PIT channel 2.
+ *
+ * Channel 2 is counted down once over GDB_X86_TSC_CAL_MS with the speaker
+ * off, and its gate put back as it was. Assumes an invariant TSC.
+ */
+void gdb_x86_clock_init(void)
+{
+    uint32_t per_ms;
+    uint64_t start;
+    uint8_t gate;
+
+    gate = gdb_x86_io_read_8(GDB_X86_PIT_GATE);
+    gdb_x86_io_write_8(GDB_X86_PIT_GATE,
+                       (gate & ~GDB_X86_PIT_SPEAKER) | GDB_X86_PIT_GATE_ON);
+    gdb_x86_io_write_8(GDB_X86_PIT_MODE, GDB_X86_PIT_CH2_ONESHOT);
+    gdb_x86_io_write_8(GDB_X86_PIT_CH2,
+                       (GDB_X86_PIT_HZ/1000*GDB_X86_TSC_CAL_MS) & 0xff);
+    gdb_x86_io_write_8(GDB_X86_PIT_CH2,
+                       (GDB_X86_PIT_HZ/1000*GDB_X86_TSC_CAL_MS) >> 8);
+
+    start = gdb_x86_rdtsc();
+    while (!(gdb_x86_io_read_8(GDB_X86_PIT_GATE) & GDB_X86_PIT_OUT)) {
+        __builtin_ia32_pause();
+    }
+    per_ms = (uint32_t)(gdb_x86_rdtsc()-start)/GDB_X86_TSC_CAL_MS;
+    gdb_x86_io_write_8(GDB_X86_PIT_GATE, gate);
+
+    gdb_x86_tsc_scale = per_ms ? 1024000000u/per_ms : 0;
+}
+
+/**
+ * @brief Read the TSC in nanoseconds for latency profiling (GDB_PROFILE).
+ *
+ * The full product of the TSC and the scale needs up to 96 bits, so the two
+ * halves of the TSC are scaled separately and only the low 32 bits of the
+ * result are kept. The clock therefore wraps every 2^32 ns, about 4.3 s, and
+ * only differences across shorter intervals are meaningful.
+ *
+ * @param state Pointer to the gdb_state struct
+ * @return Current time in nanoseconds, modulo 2^32
+ */
+unsigned long gdb_sys_clock(struct gdb_state *state)
+{
+    uint64_t tsc;
+    uint32_t hi, lo;
+
+    tsc = gdb_x86_rdtsc();
+    hi  = (uint32_t)(tsc >> 32);
+    lo  = (uint32_t)tsc;
+
+    /* (hi*2^32 + lo)*scale/2^10, modulo 2^32 */
+    return (uint32_t)(hi*gdb_x86_tsc_scale << 22) +
+           (uint32_t)(((uint64_t)lo*gdb_x86_tsc_scale) >> 10);
+}
+
+#endif /* GDB_PROFILE */
+
+/*****************************************************************************
+ * x86 Guarded Memory Access
+ ****************************************************************************/
+
+/*
+ * unsigned int gdb_x86_guarded_copy(void *dst, const void *src,
+ *                                   unsigned int count, unsigned int size);
+ *
+ * Copy count units of size (1, 2 or 4) bytes with a single rep movs and
+ * return the number of units left uncopied. A page fault raised between
+ * gdb_x86_guard_begin and gdb_x86_guard_end is caught by gdb_x86_mem_fault(),
+ * which resumes at gdb_x86_guard_fixup. rep movs is restartable, so ecx then
+ * holds exactly the number of units not copied.
+ */
+asm (
+    ".text\n"
+    ".globl gdb_x86_guarded_copy\n"
+    "gdb_x86_guarded_copy:\n"
+    "    pushl   %esi\n"
+    "    pushl   %edi\n"
+    "    movl    12(%esp), %edi\n"
+    "    movl    16(%esp), %esi\n"
+    "    movl    20(%esp), %ecx\n"
+    "    movl    24(%esp), %edx\n"
+    "    cld\n"
+    "    cmpl    $2, %edx\n"
+    "    je      2f\n"
+    "    cmpl    $4, %edx\n"
+    "    je      4f\n"
+    ".globl gdb_x86_guard_begin\n"
+    "gdb_x86_guard_begin:\n"
+    "    rep movsb\n"
+    "    jmp     gdb_x86_guard_fixup\n"
+    "2:  rep movsw\n"
+    "    jmp     gdb_x86_guard_fixup\n"
+    "4:  rep movsl\n"
+    ".globl gdb_x86_guard_end\n"
+    "gdb_x86_guard_end:\n"
+    ".globl gdb_x86_guard_fixup\n"
+    "gdb_x86_guard_fixup:\n"
+    "    movl    %ecx, %eax\n"
+    "    popl    %edi\n"
+    "    popl    %esi\n"
+    "    ret\n"
+    );
+
+unsigned int gdb_x86_guarded_copy(void *dst, const void *src,
+                                  unsigned int count, unsigned int size);
+extern const char gdb_x86_guard_begin[];
+extern const char gdb_x86_guard_end[];
+extern const char gdb_x86_guard_fixup[];
+
+#define GDB_X86_PAGE_SHIFT 12
+
+/// Number of entries in the faulting-page cache; must be a power of two
+#ifndef GDB_X86_PAGE_CACHE_SIZE
+#define GDB_X86_PAGE_CACHE_SIZE 64
+#endif
+
+#define GDB_X86_PAGE_NO_READ  1 ///< A read from the page faulted
+#define GDB_X86_PAGE_NO_WRITE 2 ///< A write to the page faulted
+
+/**
+ * @brief Direct-mapped cache of pages that faulted during a stub access.
+ *
+ * Pages that copied cleanly need no entry; the guarded copy runs straight
+ * through them. Remembering the bad ones lets repeated accesses, such as gdb
+ * walking a bad pointer, fail without taking the fault again. Entries only
+ * hold for one stop: the debuggee may change its mappings while running, so
+ * every debug trap bumps gen, which drops them all.
+ */
+struct gdb_x86_page_cache {
+    uint32_t gen; ///< Current generation
+    struct {
+        uint32_t page;  ///< Page number
+        uint32_t gen;   ///< Generation the entry belongs to
+        uint32_t flags; ///< GDB_X86_PAGE_NO_* bits
+    } entries[GDB_X86_PAGE_CACHE_SIZE];
+};
+
+static struct gdb_x86_page_cache gdb_x86_page_cache;
+
+/**
+ * @brief Forget all cached page faults.
+ */
+void gdb_x86_mem_invalidate(void)
+{
+    gdb_x86_page_cache.gen += 1;
+}
+
+/**
+ * @brief Look up the cached fault flags of a page.
+ *
+ * @param page Page number
+ * @return GDB_X86_PAGE_NO_* bits, 0 if the page is not known to fault
+ */
+static uint32_t gdb_x86_page_flags(uint32_t page)
+{
+    unsigned int i = page & (GDB_X86_PAGE_CACHE_SIZE-1);
+
+    if (gdb_x86_page_cache.entries[i].gen != gdb_x86_page_cache.gen ||
+        gdb_x86_page_cache.entries[i].page != page) {
+        return 0;
+    }
+    return gdb_x86_page_cache.entries[i].flags;
+}
+
+/**
+ * @brief Record a fault on a page.
+ *
+ * @param page Page number
+ * @param flags GDB_X86_PAGE_NO_* bits to add
+ */
+static void gdb_x86_page_mark(uint32_t page, uint32_t flags)
+{
+    unsigned int i = page & (GDB_X86_PAGE_CACHE_SIZE-1);
+
+    if (gdb_x86_page_cache.entries[i].gen != gdb_x86_page_cache.gen ||
+        gdb_x86_page_cache.entries[i].page != page) {
+        gdb_x86_page_cache.entries[i].gen   = gdb_x86_page_cache.gen;
+        gdb_x86_page_cache.entries[i].page  = page;
+        gdb_x86_page_cache.entries[i].flags = 0;
+    }
+    gdb_x86_page_cache.entries[i].flags |= flags;
+}
+
+/**
+ * @brief Read the faulting address of the last page fault.
+ *
+ * @return Contents of CR2
+ */
+static uint32_t gdb_x86_read_cr2(void)
+{
+    uint32_t val;
+
+    asm volatile (
+        "movl    %%cr2, %0"
+        /* Outputs  */ : "=r" (val)
+        /* Inputs   */ : /* None */
+        /* Clobbers */ : /* None */
+        );
+
+    return val;
+}
+
+/**
+ * @brief Recover from a page fault raised by a guarded stub memory access.
+ *
+ * Called for #PF from the stub's interrupt handler. This only sees faults
+ * if vector 14 is routed to the stub, either by gdb_x86_init_idt() or by
+ * hooking it with gdb_x86_hook_idt().
+ *
+ * @param eip Saved EIP of the fault, moved to the copy's fixup if handled
+ * @param error_code Page fault error code
+ * @return 1 if the fault was raised by a guarded copy and has been handled,
+ *         0 otherwise
+ */
+int gdb_x86_mem_fault(uint32_t *eip, uint32_t error_code)
+{
+    if (*eip < (uint32_t) gdb_x86_guard_begin ||
+        *eip >= (uint32_t) gdb_x86_guard_end) {
+        return 0;
+    }
+
+    /* Bit 1 of the error code is set for writes */
+    gdb_x86_page_mark(gdb_x86_read_cr2() >> GDB_X86_PAGE_SHIFT,
+                      (error_code & 2) ? GDB_X86_PAGE_NO_WRITE
+                                       : GDB_X86_PAGE_NO_READ);
+    *eip = (uint32_t) gdb_x86_guard_fixup;
+    return 1;
+}
+
+/**
+ * @brief Shorten an access so it stops at the first page known to fault.
+ *
+ * @param addr Address of the access
+ * @param len Length of the access
+ * @param flag GDB_X86_PAGE_NO_READ or GDB_X86_PAGE_NO_WRITE
+ * @return Number of bytes that may be attempted
+ */
+static unsigned int gdb_x86_page_clamp(address addr, unsigned int len,
+                                       uint32_t flag)
+{
+    uint32_t first, last, page;
+
+    if (len == 0) {
+        return 0;
+    }
+
+    first = addr >> GDB_X86_PAGE_SHIFT;
+    last  = (addr+len-1) >> GDB_X86_PAGE_SHIFT;
+    for (page = first; ; page++) {
+        if (gdb_x86_page_flags(page) & flag) {
+            return (page == first) ? 0 : (page << GDB_X86_PAGE_SHIFT)-addr;
+        }
+        if (page == last) {
+            return len;
+        }
+    }
+}
+
+/**
+ * @brief Copy between a stub buffer and system memory, stopping at a fault.
+ *
+ * i386 has no 8 byte string move, so 8 byte accesses are split in two.
+ *
+ * @param dst Destination
+ * @param src Source
+ * @param addr Address of the system memory side
+ * @param len Number of bytes to copy
+ * @param width Access width hint: 0, 1, 2, 4 or 8
+ * @param flag GDB_X86_PAGE_NO_READ or GDB_X86_PAGE_NO_WRITE
+ * @return Number of bytes copied
+ */
+static unsigned int gdb_x86_mem_copy(void *dst, const void *src, address addr,
+                                     unsigned int len, unsigned int width,
+                                     uint32_t flag)
+{
+    unsigned int size;
+
+    len = gdb_x86_page_clamp(addr, len, flag);
+
+    size = (width == 2 || width == 4) ? width : (width == 8) ? 4 : 1;
+    if (len % size) {
+        size = 1;
+    }
+
+    return len - gdb_x86_guarded_copy(dst, src, len/size, size)*size;
+}
+
+/**
+ * @brief Read system memory into buf, stopping at the first fault.
+ *
+ * @param state Pointer to the gdb_state struct
+ * @param addr Address to read from
+ * @param buf Buffer to read into
+ * @param len Number of bytes to read
+ * @param width Access width hint: 0, 1, 2, 4 or 8
+ * @return Number of bytes read
+ */
+int gdb_sys_mem_read(struct gdb_state *state, address addr, char *buf,
+                     unsigned int len, unsigned int width)
+{
+    return gdb_x86_mem_copy(buf, (const void *) addr, addr, len, width,
+                            GDB_X86_PAGE_NO_READ);
+}
+
+/**
+ * @brief Write buf to system memory, stopping at the first fault.
+ *
+ * @param state Pointer to the gdb_state struct
+ * @param addr Address to write to
+ * @param buf Buffer to write from
+ * @param len Number of bytes to write
+ * @param width Access width hint: 0, 1, 2, 4 or 8
+ * @return Number of bytes written
+ */
+int gdb_sys_mem_write(struct gdb_state *state, address addr, const char *buf,
+                      unsigned int len, unsigned int width)
+{
+    return gdb_x86_mem_copy((void *) addr, buf, addr, len, width,
+                            GDB_X86_PAGE_NO_WRITE);
+}
+
+/*****************************************************************************
+ * x86 Extended Registers
+ ****************************************************************************/
+
+/*
+ * gdb's i386 register numbers past the general purpose registers.
+ */
+#define GDB_X86_REG_ST0    16
+#define GDB_X86_REG_FCTRL  24
+#define GDB_X86_REG_FSTAT  25
+#define GDB_X86_REG_FTAG   26
+#define GDB_X86_REG_FISEG  27
+#define GDB_X86_REG_FIOFF  28
+#define GDB_X86_REG_FOSEG  29
+#define GDB_X86_REG_FOOFF  30
+#define GDB_X86_REG_FOP    31
+#define GDB_X86_REG_XMM0   32
+#define GDB_X86_REG_MXCSR  40
+#define GDB_X86_REG_YMM0H  41
+#define GDB_X86_REG_END    49
+
+#define GDB_X86_CR0_TS (1<<3)
+#define GDB_X86_CR0_EM (1<<2)
+
+#define GDB_X86_XSTATE_X87 1
+#define GDB_X86_XSTATE_SSE 2
+#define GDB_X86_XSTATE_AVX 4
+
+/*
+ * Offsets in the standard (non-compacted) XSAVE layout. The first 512 bytes
+ * are the FXSAVE layout.
+ */
+#define GDB_X86_XSAVE_FTW      4
+#define GDB_X86_XSAVE_MXCSR    24
+#define GDB_X86_XSAVE_ST0      32
+#define GDB_X86_XSAVE_XMM0     160
+#define GDB_X86_XSAVE_XSTATE   512
+#define GDB_X86_XSAVE_YMM0H    576
+#define GDB_X86_XSAVE_SIZE     832
+
+/**
+ * @brief Lazily captured x87/SSE/AVX state.
+ *
+ * Nothing is saved on trap entry. The first extended register access of a
+ * stop saves the state with XSAVE, or FXSAVE on CPUs without it, and only
+ * writes mark it for restore on resume. This relies on the stub itself not
+ * touching FPU or vector registers, which is why GDB_USE_SIMD is off for
+ * target builds.
+ */
+struct gdb_x86_fpu {
+    uint8_t  area[GDB_X86_XSAVE_SIZE] __attribute__((aligned(64)));
+    uint32_t mask;   ///< XSAVE components saved, 0 when using FXSAVE
+    int      probed; ///< CPU features have been checked
+    int      usable; ///< FXSAVE or XSAVE can be used
+    int      saved;  ///< area holds the state of the current stop
+    int      dirty;  ///< area was modified and must be restored
+};
+
+static struct gdb_x86_fpu gdb_x86_fpu;
+
+/**
+ * @brief Run CPUID.
+ *
+ * @param leaf Value of EAX
+ * @param subleaf Value of ECX
+ * @param regs Set to EAX, EBX, ECX and EDX
+ */
+static void gdb_x86_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
+{
+    asm volatile (
+        "cpuid"
+        /* Outputs  */ : "=a" (regs[0]), "=b" (regs[1]), "=c" (regs[2]),
+                         "=d" (regs[3])
+        /* Inputs   */ : "a" (leaf), "c" (subleaf)
+        /* Clobbers */ : /* None */
+        );
+}
+
+/**
+ * @brief Read CR0.
+ *
+ * @return Contents of CR0
+ */
+static uint32_t gdb_x86_read_cr0(void)
+{
+    uint32_t val;
+
+    asm volatile (
+        "movl    %%cr0, %0"
+        /* Outputs  */ : "=r" (val)
+        /* Inputs   */ : /* None */
+        /* Clobbers */ : /* None */
+        );
+
+    return val;
+}
+
+/**
+ * @brief Write CR0.
+ *
+ * @param val New contents of CR0
+ */
+static void gdb_x86_write_cr0(uint32_t val)
+{
+    asm volatile (
+        "movl    %0, %%cr0"
+        /* Outputs  */ : /* None */
+        /* Inputs   */ : "r" (val)
+        /* Clobbers */ : "memory"
+        );
+}
+
+/**
+ * @brief Check which of FXSAVE and XSAVE can be used.
+ */
+static void gdb_x86_fpu_probe(void)
+{
+    uint32_t regs[4], xcr0_lo, xcr0_hi;
+
+    gdb_x86_fpu.probed = 1;
+
+    gdb_x86_cpuid(1, 0, regs);
+    if (!(regs[3] & (1<<24)) || (gdb_x86_read_cr0() & GDB_X86_CR0_EM)) {
+        /* No FXSAVE, or x87 emulated */
+        return;
+    }
+    gdb_x86_fpu.usable = 1;
+
+    /* XSAVE, enabled by the OS */
+    if ((regs[2] & (1<<26)) && (regs[2] & (1<<27))) {
+        asm volatile (
+            "xgetbv"
+            /* Outputs  */ : "=a" (xcr0_lo), "=d" (xcr0_hi)
+            /* Inputs   */ : "c" (0)
+            /* Clobbers */ : /* None */
+            );
+        gdb_x86_fpu.mask = xcr0_lo & (GDB_X86_XSTATE_X87 |
+                                      GDB_X86_XSTATE_SSE |
+                                      GDB_X86_XSTATE_AVX);
+    }
+}
+
+/**
+ * @brief Save or restore the extended state with CR0.TS clear.
+ *
+ * A kernel doing lazy FPU switching leaves TS set, which would turn the save
+ * into a #NM. TS is put back afterwards.
+ *
+ * @param restore Nonzero to restore area into the CPU, zero to save it
+ */
+static void gdb_x86_fpu_xfer(int restore)
+{
+    uint32_t cr0;
+    uint8_t *area = gdb_x86_fpu.area;
+
+    cr0 = gdb_x86_read_cr0();
+    if (cr0 & GDB_X86_CR0_TS) {
+        asm volatile ("clts");
+    }
+
+    if (gdb_x86_fpu.mask && restore) {
+        asm volatile ("xrstor (%0)" : : "r" (area), "a" (gdb_x86_fpu.mask),
+                      "d" (0) : "memory");
+    } else if (gdb_x86_fpu.mask) {
+        asm volatile ("xsave (%0)" : : "r" (area), "a" (gdb_x86_fpu.mask),
+                      "d" (0) : "memory");
+    } else if (restore) {
+        asm volatile ("fxrstor (%0)" : : "r" (area) : "memory");
+    } else {
+        asm volatile ("fxsave (%0)" : : "r" (area) : "memory");
+    }
+
+    if (cr0 & GDB_X86_CR0_TS) {
+        gdb_x86_write_cr0(cr0);
+    }
+}
+
+int gdb_x86_smp_local(void);
+
+/**
+ * @brief Capture the extended state, if not done yet this stop.
+ *
+ * XSAVE skips components in their initial state. Those are filled in here
+ * and flagged present, so reads see real values and a later XRSTOR loads
+ * whatever gdb wrote. Only the CPU running the stub can save its own state,
+ * so the other stopped CPUs have none.
+ *
+ * @return 0 on success, or GDB_EOF if the CPU has no usable FXSAVE
+ */
+static int gdb_x86_fpu_get(void)
+{
+    uint8_t *area = gdb_x86_fpu.area;
+    uint32_t xstate, missing;
+    unsigned int i;
+
+    if (!gdb_x86_smp_local()) {
+        return GDB_EOF;
+    }
+    if (gdb_x86_fpu.saved) {
+        return 0;
+    }
+    if (!gdb_x86_fpu.probed) {
+        gdb_x86_fpu_probe();
+    }
+    if (!gdb_x86_fpu.usable) {
+        return GDB_EOF;
+    }
+
+    gdb_x86_fpu_xfer(0);
+    gdb_x86_fpu.saved = 1;
+
+    if (!gdb_x86_fpu.mask) {
+        return 0;
+    }
+
+    __builtin_memcpy(&xstate, area+GDB_X86_XSAVE_XSTATE, 4);
+    missing = gdb_x86_fpu.mask & ~xstate;
+    if (missing & GDB_X86_XSTATE_X87) {
+        /* FCW 0x37f, everything else zero */
+        for (i = 0; i < GDB_X86_XSAVE_MXCSR; i++) {
+            area[i] = 0;
+        }
+        area[0] = 0x7f;
+        area[1] = 0x03;
+        for (i = GDB_X86_XSAVE_ST0; i < GDB_X86_XSAVE_XMM0; i++) {
+            area[i] = 0;
+        }
+    }
+    if (missing & GDB_X86_XSTATE_SSE) {
+        for (i = GDB_X86_XSAVE_XMM0; i < GDB_X86_XSAVE_XMM0+8*16; i++) {
+            area[i] = 0;
+        }
+    }
+    if (missing & GDB_X86_XSTATE_AVX) {
+        for (i = GDB_X86_XSAVE_YMM0H; i < GDB_X86_XSAVE_YMM0H+8*16; i++) {
+            area[i] = 0;
+        }
+    }
+    xstate |= missing;
+    __builtin_memcpy(area+GDB_X86_XSAVE_XSTATE, &xstate, 4);
+
+    return 0;
+}
+
+/**
+ * @brief Restore the extended state if the debugger changed it, and forget
+ * it, ready for the next stop.
+ */
+void gdb_x86_fpu_resume(void)
+{
+    if (gdb_x86_fpu.saved && gdb_x86_fpu.dirty) {
+        gdb_x86_fpu_xfer(1);
+    }
+    gdb_x86_fpu.saved = 0;
+    gdb_x86_fpu.dirty = 0;
+}
+
+/**
+ * @brief Locate an extended register in the save area.
+ *
+ * @param regno Register number
+ * @param offset Set to the offset of the register in the save area
+ * @param size Set to the size of the register in the save area; registers
+ *             narrower than 4 bytes there are 4 bytes wide to gdb
+ * @return 0 on success, or GDB_EOF for an unknown or unsaved register
+ */
+static int gdb_x86_ext_reg_slot(unsigned int regno, unsigned int *offset,
+                                unsigned int *size)
+{
+    /* x87 control registers: offset and size in the FXSAVE layout */
+    static const uint8_t fpu_ctrl[][2] = {
+        [GDB_X86_REG_FCTRL-GDB_X86_REG_FCTRL] = {  0, 2 },
+        [GDB_X86_REG_FSTAT-GDB_X86_REG_FCTRL] = {  2, 2 },
+        [GDB_X86_REG_FTAG -GDB_X86_REG_FCTRL] = {  4, 1 },
+        [GDB_X86_REG_FISEG-GDB_X86_REG_FCTRL] = { 12, 2 },
+        [GDB_X86_REG_FIOFF-GDB_X86_REG_FCTRL] = {  8, 4 },
+        [GDB_X86_REG_FOSEG-GDB_X86_REG_FCTRL] = { 20, 2 },
+        [GDB_X86_REG_FOOFF-GDB_X86_REG_FCTRL] = { 16, 4 },
+        [GDB_X86_REG_FOP  -GDB_X86_REG_FCTRL] = {  6, 2 },
+    };
+
+    if (regno >= GDB_X86_REG_ST0 && regno < GDB_X86_REG_FCTRL) {
+        *offset = GDB_X86_XSAVE_ST0+(regno-GDB_X86_REG_ST0)*16;
+        *size = 10;
+    } else if (regno >= GDB_X86_REG_FCTRL && regno < GDB_X86_REG_XMM0) {
+        *offset = fpu_ctrl[regno-GDB_X86_REG_FCTRL][0];
+        *size = fpu_ctrl[regno-GDB_X86_REG_FCTRL][1];
+    } else if (regno >= GDB_X86_REG_XMM0 && regno < GDB_X86_REG_MXCSR) {
+        *offset = GDB_X86_XSAVE_XMM0+(regno-GDB_X86_REG_XMM0)*16;
+        *size = 16;
+    } else if (regno == GDB_X86_REG_MXCSR) {
+        *offset = GDB_X86_XSAVE_MXCSR;
+        *size = 4;
+    } else if (regno >= GDB_X86_REG_YMM0H && regno < GDB_X86_REG_END &&
+               (gdb_x86_fpu.mask & GDB_X86_XSTATE_AVX)) {
+        *offset = GDB_X86_XSAVE_YMM0H+(regno-GDB_X86_REG_YMM0H)*16;
+        *size = 16;
+    } else {
+        return GDB_EOF;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Read an x87, SSE or AVX register.
+ *
+ * FXSAVE keeps an abridged tag word with one valid bit per register; it is
+ * widened to the full tag word gdb expects, reporting valid registers as
+ * holding a number.
+ *
+ * @param state Pointer to the gdb_state struct
+ * @param regno Register number
+ * @param buf Buffer for the register value
+ * @param buf_len Size of buf
+ * @return Size of the register, or GDB_EOF
+ */
+int gdb_sys_ext_reg_read(struct gdb_state *state, unsigned int regno,
+                         char *buf, unsigned int buf_len)
+{
+    unsigned int offset, size, len, i;
+    uint32_t tag;
+
+    if (gdb_x86_fpu_get() == GDB_EOF ||
+        gdb_x86_ext_reg_slot(regno, &offset, &size) == GDB_EOF) {
+        return GDB_EOF;
+    }
+
+    len = (size < 4) ? 4 : size;
+    if (len > buf_len) {
+        return GDB_EOF;
+    }
+
+    if (regno == GDB_X86_REG_FTAG) {
+        tag = 0;
+        for (i = 0; i < 8; i++) {
+            if (!(gdb_x86_fpu.area[offset] & (1<<i))) {
+                tag |= 3 << (i*2);
+            }
+        }
+        __builtin_memcpy(buf, &tag, 4);
+        return len;
+    }
+
+    for (i = 0; i < len; i++) {
+        buf[i] = (i < size) ? gdb_x86_fpu.area[offset+i] : 0;
+    }
+    return len;
+}
+
+/**
+ * @brief Write an x87, SSE or AVX register.
+ *
+ * The new value reaches the CPU when the target resumes.
+ *
+ * @param state Pointer to the gdb_state struct
+ * @param regno Register number
+ * @param buf New register value
+ * @param len Size of the value, which must match the register
+ * @return 0 on success, or GDB_EOF
+ */
+int gdb_sys_ext_reg_write(struct gdb_state *state, unsigned int regno,
+                          const char *buf, unsigned int len)
+{
+    unsigned int offset, size, i;
+    uint32_t tag;
+
+    if (gdb_x86_fpu_get() == GDB_EOF ||
+        gdb_x86_ext_reg_slot(regno, &offset, &size) == GDB_EOF ||
+        len != ((size < 4) ? 4 : size)) {
+        return GDB_EOF;
+    }
+
+    if (regno == GDB_X86_REG_FTAG) {
+        __builtin_memcpy(&tag, buf, 4);
+        gdb_x86_fpu.area[offset] = 0;
+        for (i = 0; i < 8; i++) {
+            if (((tag >> (i*2)) & 3) != 3) {
+                gdb_x86_fpu.area[offset] |= 1<<i;
+            }
+        }
+    } else {
+        for (i = 0; i < size; i++) {
+            gdb_x86_fpu.area[offset+i] = buf[i];
+        }
+    }
+
+    gdb_x86_fpu.dirty = 1;
+    return 0;
+}
+
+/*****************************************************************************
+ * x86 Debug Registers
+ ****************************************************************************/
+
+/// Number of address debug registers, DR0-DR3
+#define GDB_X86_NUM_DR 4
+
+/// DR6 value with no debug conditions recorded
+#define GDB_X86_DR6_CLEAR 0xffff0ff0
+
+/// DR6 single-step condition
+#define GDB_X86_DR6_BS (1<<14)
+
+/// DR7 local exact breakpoint enable, recommended for data breakpoints
+#define GDB_X86_DR7_LE (1<<8)
+
+/// EFLAGS resume flag, suppressing instruction breakpoints for one instruction
+#define GDB_X86_EFLAGS_RF (1<<16)
+
+/**
+ * @brief Hardware breakpoint and watchpoint slots.
+ *
+ * Slots are assigned on 'Z1'/'Z2'/'Z4' and the debug registers loaded when
+ * the target resumes. A watched region is split into naturally aligned
+ * pieces of 1, 2 or 4 bytes, one slot each.
+ */
+struct gdb_x86_dr {
+    address  addr[GDB_X86_NUM_DR]; ///< Address of each slot
+    uint8_t  type[GDB_X86_NUM_DR]; ///< GDB_HW_* type of each slot, 0 if free
+    uint8_t  len[GDB_X86_NUM_DR];  ///< Length watched by each slot
+    uint32_t dr7;                  ///< Value to load into DR7
+    unsigned int gen;              ///< Bumped whenever the slots change
+    unsigned int hit;              ///< 1 + slot that stopped the target, 0 if none
+};
+
+static struct gdb_x86_dr gdb_x86_dr;
+
+/**
+ * @brief Write a debug register.
+ *
+ * @param n Debug register number: 0-3, 6 or 7
+ * @param val Value to write
+ */
+static void gdb_x86_write_dr(unsigned int n, uint32_t val)
+{
+    switch (n) {
+    case 0: asm volatile ("movl %0, %%dr0" : : "r" (val)); break;
+    case 1: asm volatile ("movl %0, %%dr1" : : "r" (val)); break;
+    case 2: asm volatile ("movl %0, %%dr2" : : "r" (val)); break;
+    case 3: asm volatile ("movl %0, %%dr3" : : "r" (val)); break;
+    case 6: asm volatile ("movl %0, %%dr6" : : "r" (val)); break;
+    case 7: asm volatile ("movl %0, %%dr7" : : "r" (val)); break;
+    }
+}
+
+/**
+ * @brief Read DR6, the debug status register.
+ *
+ * @return Contents of DR6
+ */
+static uint32_t gdb_x86_read_dr6(void)
+{
+    uint32_t val;
+
+    asm volatile (
+        "movl    %%dr6, %0"
+        /* Outputs  */ : "=r" (val)
+        /* Inputs   */ : /* None */
+        /* Clobbers */ : /* None */
+        );
+
+    return val;
+}
+
+/**
+ * @brief Size of the next naturally aligned piece of a watched region.
+ *
+ * @param addr Start of the rest of the region
+ * @param len Length of the rest of the region
+ * @return Piece size: 1, 2 or 4
+ */
+static unsigned int gdb_x86_dr_piece(address addr, unsigned int len)
+{
+    unsigned int size;
+
+    for (size = 4; size > len || (addr & (size-1)); size >>= 1) {
+    }
+    return size;
+}
+
+/**
+ * @brief Recompute DR7 from the slots.
+ */
+static void gdb_x86_dr_update(void)
+{
+    /* DR7 R/W bits per type, and LEN bits per length */
+    static const uint8_t rw[] = {
+        [GDB_HW_BREAK_EXEC]   = 0,
+        [GDB_HW_WATCH_WRITE]  = 1,
+        [GDB_HW_WATCH_ACCESS] = 3,
+    };
+    static const uint8_t len[] = { [1] = 0, [2] = 1, [4] = 3 };
+    unsigned int i;
+    uint32_t dr7;
+
+    dr7 = 0;
+    for (i = 0; i < GDB_X86_NUM_DR; i++) {
+        if (gdb_x86_dr.type[i]) {
+            dr7 |= (uint32_t)1 << (i*2);
+            dr7 |= (uint32_t)(rw[gdb_x86_dr.type[i]] |
+                              len[gdb_x86_dr.len[i]] << 2) << (16+i*4);
+        }
+    }
+    if (dr7) {
+        dr7 |= GDB_X86_DR7_LE;
+    }
+
+    gdb_x86_dr.dr7 = dr7;
+    gdb_x86_dr.gen += 1;
+}
+
+/**
+ * @brief Set a hardware breakpoint or watchpoint.
+ *
+ * Takes one debug register per aligned piece of the region, all or none.
+ *
+ * @param state Pointer to the gdb_state struct
+ * @param type GDB_HW_BREAK_EXEC, GDB_HW_WATCH_WRITE or GDB_HW_WATCH_ACCESS
+ * @param addr Address to break on or watch
+ * @param len Length to watch, ignored for breakpoints
+ * @return 0 on success, or GDB_EOF if there are not enough free slots
+ */
+int gdb_sys_hw_break_set(struct gdb_state *state, unsigned int type,
+                         address addr, unsigned int len)
+{
+    unsigned int i, size, pieces, free;
+    address pos;
+
+    if (type == GDB_HW_BREAK_EXEC) {
+        len = 1;
+    }
+    if (len == 0) {
+        return GDB_EOF;
+    }
+
+    pieces = 0;
+    for (pos = addr; pos-addr < len; pos += size) {
+        size = gdb_x86_dr_piece(pos, len-(pos-addr));
+        pieces += 1;
+    }
+
+    free = 0;
+    for (i = 0; i < GDB_X86_NUM_DR; i++) {
+        free += !gdb_x86_dr.type[i];
+    }
+    if (pieces > free) {
+        return GDB_EOF;
+    }
+
+    pos = addr;
+    for (i = 0; i < GDB_X86_NUM_DR && pos-addr < len; i++) {
+        if (!gdb_x86_dr.type[i]) {
+            size = gdb_x86_dr_piece(pos, len-(pos-addr));
+            gdb_x86_dr.addr[i] = pos;
+            gdb_x86_dr.type[i] = type;
+            gdb_x86_dr.len[i]  = size;
+            pos += size;
+        }
+    }
+
+    gdb_x86_dr_update();
+    return 0;
+}
+
+/**
+ * @brief Clear a hardware breakpoint or watchpoint.
+ *
+ * @param state Pointer to the gdb_state struct
+ * @param type Type the breakpoint or watchpoint was set with
+ * @param addr Address it was set with
+ * @param len Length it was set with
+ * @return Always returns 0
+ */
+int gdb_sys_hw_break_clear(struct gdb_state *state, unsigned int type,
+                           address addr, unsigned int len)
+{
+    unsigned int i, size;
+    address pos;
+
+    if (type == GDB_HW_BREAK_EXEC) {
+        len = 1;
+    }
+
+    for (pos = addr; pos-addr < len; pos += size) {
+        size = gdb_x86_dr_piece(pos, len-(pos-addr));
+        for (i = 0; i < GDB_X86_NUM_DR; i++) {
+            if (gdb_x86_dr.type[i] == type && gdb_x86_dr.addr[i] == pos &&
+                gdb_x86_dr.len[i] == size) {
+                gdb_x86_dr.type[i] = 0;
+                break;
+            }
+        }
+    }
+
+    gdb_x86_dr_update();
+    return 0;
+}
+
+/**
+ * @brief Report the hardware breakpoint or watchpoint that stopped the target.
+ *
+ * @param state Pointer to the gdb_state struct
+ * @param addr Set to the address of the slot that fired
+ * @return Its GDB_HW_* type, or 0 if none fired
+ */
+unsigned int gdb_sys_hw_break_hit(struct gdb_state *state, address *addr)
+{
+    if (!gdb_x86_dr.hit) {
+        return 0;
+    }
+
+    *addr = gdb_x86_dr.addr[gdb_x86_dr.hit-1];
+    return gdb_x86_dr.type[gdb_x86_dr.hit-1];
+}
+
+/**
+ * @brief Record which debug register, if any, raised the current trap.
+ *
+ * DR6 is sticky, so it is cleared for the next trap.
+ *
+ * @param vector Interrupt vector the stub was entered through
+ *
+ * @return 1 if the trap was a plain single step, 0 otherwise
+ */
+int gdb_x86_dr_stop(uint32_t vector)
+{
+    uint32_t dr6;
+    unsigned int i;
+
+    gdb_x86_dr.hit = 0;
+    if (vector != 1) {
+        return 0;
+    }
+
+    dr6 = gdb_x86_read_dr6();
+    for (i = 0; i < GDB_X86_NUM_DR; i++) {
+        if ((dr6 & (1<<i)) && gdb_x86_dr.type[i]) {
+            gdb_x86_dr.hit = i+1;
+            break;
+        }
+    }
+    gdb_x86_write_dr(6, GDB_X86_DR6_CLEAR);
+
+    return (dr6 & GDB_X86_DR6_BS) && !gdb_x86_dr.hit;
+}
+
+/**
+ * @brief Load this CPU's debug registers, if the slots changed since it last
+ * loaded them.
+ *
+ * Debug registers are per CPU, so every stopped CPU calls this as it resumes.
+ *
+ * @param gen Slot generation this CPU last loaded
+ * @return The generation now loaded
+ */
+unsigned int gdb_x86_dr_sync(unsigned int gen)
+{
+    unsigned int i;
+
+    if (gen == gdb_x86_dr.gen) {
+        return gen;
+    }
+
+    /* Disable first, so no half-loaded slot can fire */
+    gdb_x86_write_dr(7, 0);
+    for (i = 0; i < GDB_X86_NUM_DR; i++) {
+        if (gdb_x86_dr.type[i]) {
+            gdb_x86_write_dr(i, gdb_x86_dr.addr[i]);
+        }
+    }
+    gdb_x86_write_dr(7, gdb_x86_dr.dr7);
+    return gdb_x86_dr.gen;
+}
+
+/*****************************************************************************
+ * x86 Execution Control
+ ****************************************************************************/
+
+/// EFLAGS trap flag, raising a debug exception after each instruction
+#define GDB_X86_EFLAGS_TF (1<<8)
+
+extern uint32_t gdb_regs_dirty;
+
+int gdb_break_cond_check(struct gdb_state *state, address addr);
+int gdb_sw_break_lift(struct gdb_state *state, address addr, int insert);
+int gdb_trace_hit(struct gdb_state *state, address addr);
+
+/**
+ * @brief Software breakpoint a CPU is stepping over after its condition
+ * failed. Each CPU has its own, see gdb_x86_smp_step_over().
+ */
+struct gdb_x86_step_over {
+    int      active; ///< The original instruction is being single-stepped
+    address  addr;   ///< Breakpoint address
+    uint32_t tf;     ///< TF of the interrupted code, the debugger's own stepping
+};
+
+struct gdb_x86_step_over *gdb_x86_smp_step_over(void);
+void gdb_x86_smp_hold(int hold);
+
+/**
+ * @brief Resume from a breakpoint whose conditions are all false, or from a
+ * tracepoint once it has collected.
+ *
+ * Called on trap entry with the registers loaded. A hardware breakpoint is
+ * resumed with RF set. A software breakpoint has its instruction taken out
+ * and the original instruction single-stepped, and is put back on the next
+ * entry, whatever that entry is. The instruction is out of memory every CPU
+ * runs, so the other CPUs are held and this one keeps the stub until then.
+ *
+ * @param state Pointer to the gdb_state struct
+ * @param vector Interrupt vector the stub was entered through
+ * @param step Nonzero if the trap was a plain single step
+ * @param eip Saved EIP of the interrupt frame
+ * @param eflags Saved EFLAGS of the interrupt frame
+ * @return 1 if the target should resume without a stop, 2 if it should
+ *         resume still holding the stub, 0 otherwise
+ */
+int gdb_x86_break_filter(struct gdb_state *state, uint32_t vector, int step,
+                         uint32_t *eip, uint32_t *eflags)
+{
+    struct gdb_x86_step_over *over;
+    address addr;
+
+    over = gdb_x86_smp_step_over();
+    if (over->active) {
+        over->active = 0;
+        gdb_sw_break_lift(state, over->addr, 1);
+        gdb_x86_smp_hold(0);
+        if (!over->tf) {
+            *eflags &= ~GDB_X86_EFLAGS_TF;
+            state->registers[GDB_CPU_I386_REG_PS] = *eflags;
+            if (vector == 1 && step) {
+                return 1;
+            }
+        }
+    }
+
+    if (vector == 3) {
+        /* int3 traps with EIP past the instruction */
+        addr = *eip-1;
+        if (!gdb_trace_hit(state, addr) &&
+            gdb_break_cond_check(state, addr)) {
+            return 0;
+        }
+        gdb_x86_smp_hold(1);
+        if (gdb_sw_break_lift(state, addr, 0) == GDB_EOF) {
+            gdb_x86_smp_hold(0);
+            return 0;
+        }
+        over->active = 1;
+        over->addr   = addr;
+        over->tf     = *eflags & GDB_X86_EFLAGS_TF;
+        *eip     = addr;
+        *eflags |= GDB_X86_EFLAGS_TF;
+        return 2;
+    }
+
+    if (vector == 1 && gdb_x86_dr.hit &&
+        gdb_x86_dr.type[gdb_x86_dr.hit-1] == GDB_HW_BREAK_EXEC &&
+        !gdb_break_cond_check(state, *eip)) {
+        *eflags |= GDB_X86_EFLAGS_RF;
+        return 1;
+    }
+
+    return 0;
+}
+
+int gdb_x86_smp_hit(void);
+
+/**
+ * @brief Update the saved EFLAGS for resuming.
+ *
+ * Acts on the CPU whose registers are selected. Sets TF to single-step,
+ * and RF if that CPU stopped on a hardware breakpoint, so the instruction
+ * it stopped at runs instead of trapping again. EFLAGS is
+ * only marked dirty, and so only written back to the interrupt frame, if it
+ * actually changes.
+ *
+ * @param state Pointer to the gdb_state struct
+ * @param step Nonzero to single-step, zero to run freely
+ */
+static void gdb_x86_resume(struct gdb_state *state, int step)
+{
+    reg ps;
+
+    ps = state->registers[GDB_CPU_I386_REG_PS];
+    ps = step ? (ps | GDB_X86_EFLAGS_TF) : (ps & ~GDB_X86_EFLAGS_TF);
+    if (gdb_x86_smp_hit()) {
+        ps |= GDB_X86_EFLAGS_RF;
+    }
+
+    if (ps != state->registers[GDB_CPU_I386_REG_PS]) {
+        state->registers[GDB_CPU_I386_REG_PS] = ps;
+        gdb_regs_dirty |= (uint32_t)1 << GDB_CPU_I386_REG_PS;
+    }
+}
+
+/**
+ * @brief Continue execution.
+ *
+ * @param state Pointer to the gdb_state struct
+ * @return Always returns 0
+ */
+int gdb_sys_continue(struct gdb_state *state)
+{
+    gdb_x86_resume(state, 0);
+    return 0;
+}
+
+/**
+ * @brief Single step the next instruction.
+ *
+ * @param state Pointer to the gdb_state struct
+ * @return Always returns 0
+ */
+int gdb_sys_step(struct gdb_state *state)
+{
+    gdb_x86_resume(state, 1);
+    return 0;
+}
 
 #endif /* GDBSTUB_ARCH_X86 */
 
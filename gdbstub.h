@@ -0,0 +1,142 @@
+/*****************************************************************************
+ * GDB Stub Configuration
+ ****************************************************************************/
+
+/*
+ * Types, registers and system hooks shared by the stub sources. Exactly one
+ * of GDBSTUB_ARCH_MOCK or GDBSTUB_ARCH_X86 is defined before this is
+ * included, and the stub sources are then included after it, in order:
+ *
+ *     string_processing.functions
+ *     data_encoding_decoding.c
+ *     communication_functions.c
+ *     packet_functions.c
+ *     packet_creation.c
+ *     command_functions.h
+ *     debugging_system_functions.c
+ *     io_functions.c            (x86)
+ *     interupt_managment.c      (x86)
+ */
+
+#ifndef GDBSTUB_H
+#define GDBSTUB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef GDBSTUB_ARCH_MOCK
+#include <stdio.h>
+#include <string.h>
+#endif
+
+#ifdef GDBSTUB_ARCH_X86
+void *memcpy(void *dest, const void *src, size_t n);
+void *memset(void *s, int c, size_t n);
+int memcmp(const void *s1, const void *s2, size_t n);
+size_t strlen(const char *s);
+#endif
+
+/// Returned by stub and system functions on failure
+#define GDB_EOF (-1)
+
+#ifndef GDB_ASSERT
+#define GDB_ASSERT(x) do {} while (0)
+#endif
+
+#ifndef GDB_PRINT
+#ifdef GDBSTUB_ARCH_MOCK
+#define GDB_PRINT(...) printf(__VA_ARGS__)
+#else
+#define GDB_PRINT(...) do {} while (0)
+#endif
+#endif
+
+/*****************************************************************************
+ * Types
+ ****************************************************************************/
+
+#ifdef GDBSTUB_ARCH_MOCK
+typedef unsigned long address;
+#else
+typedef unsigned int address;
+#endif
+typedef unsigned int reg;
+
+/**
+ * @brief i386 registers, in the order gdb's 'g' packet sends them.
+ */
+enum GDB_REGISTER {
+    GDB_CPU_I386_REG_EAX = 0,
+    GDB_CPU_I386_REG_ECX = 1,
+    GDB_CPU_I386_REG_EDX = 2,
+    GDB_CPU_I386_REG_EBX = 3,
+    GDB_CPU_I386_REG_ESP = 4,
+    GDB_CPU_I386_REG_EBP = 5,
+    GDB_CPU_I386_REG_ESI = 6,
+    GDB_CPU_I386_REG_EDI = 7,
+    GDB_CPU_I386_REG_PC  = 8,
+    GDB_CPU_I386_REG_PS  = 9,
+    GDB_CPU_I386_REG_CS  = 10,
+    GDB_CPU_I386_REG_SS  = 11,
+    GDB_CPU_I386_REG_DS  = 12,
+    GDB_CPU_I386_REG_ES  = 13,
+    GDB_CPU_I386_REG_FS  = 14,
+    GDB_CPU_I386_REG_GS  = 15,
+    GDB_CPU_NUM_REGISTERS = 16
+};
+
+/// Register holding the program counter, for code common to all arches
+#define GDB_CPU_REG_PC GDB_CPU_I386_REG_PC
+
+/**
+ * @brief State of the stopped target.
+ */
+struct gdb_state {
+    int signum;                               ///< Signal the target stopped with
+    reg registers[GDB_CPU_NUM_REGISTERS];     ///< Registers of the stopped CPU
+};
+
+typedef int (*gdb_enc_func)(char *buf, unsigned int buf_len, const char *data,
+                            unsigned int data_len);
+typedef int (*gdb_dec_func)(const char *buf, unsigned int buf_len, char *data,
+                            unsigned int data_len);
+
+/*****************************************************************************
+ * System Hooks
+ ****************************************************************************/
+
+int gdb_main(struct gdb_state *state);
+
+int gdb_sys_getc(struct gdb_state *state);
+int gdb_sys_putchar(struct gdb_state *state, int ch);
+int gdb_sys_mem_readb(struct gdb_state *state, address addr, char *val);
+int gdb_sys_mem_writeb(struct gdb_state *state, address addr, char val);
+int gdb_sys_continue(struct gdb_state *state);
+int gdb_sys_step(struct gdb_state *state);
+
+/*****************************************************************************
+ * Stub Internals Used Ahead of Their Definition
+ ****************************************************************************/
+
+static int gdb_get_val(char digit, int base);
+static char gdb_get_digit(int val);
+
+#ifdef GDBSTUB_ARCH_MOCK
+struct gdb_buffer;
+extern struct gdb_buffer gdb_input, gdb_output;
+void gdb_buf_write(struct gdb_buffer *buf, int ch);
+int gdb_buf_read(struct gdb_buffer *buf);
+#endif
+
+#ifdef GDBSTUB_ARCH_X86
+/// Number of exception vectors the stub hooks
+#define NUM_IDT_ENTRIES 32
+
+extern struct gdb_state gdb_state;
+uint16_t gdb_x86_get_cs(void);
+
+struct gdb_interrupt_state;
+static void gdb_x86_interrupt(struct gdb_interrupt_state *istate);
+#endif
+
+#endif /* GDBSTUB_H */
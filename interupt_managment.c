@@ -69,6 +69,1011 @@ struct gdb_idt_gate
 
 extern void const * const gdb_x86_int_handlers[];
 
+/*
+ * Offset of each register in the saved interrupt frame.
+ */
+static const uint8_t gdb_x86_reg_offsets[GDB_CPU_NUM_REGISTERS] = {
+    [GDB_CPU_I386_REG_EAX] = __builtin_offsetof(struct gdb_interrupt_state, eax),
+    [GDB_CPU_I386_REG_ECX] = __builtin_offsetof(struct gdb_interrupt_state, ecx),
+    [GDB_CPU_I386_REG_EDX] = __builtin_offsetof(struct gdb_interrupt_state, edx),
+    [GDB_CPU_I386_REG_EBX] = __builtin_offsetof(struct gdb_interrupt_state, ebx),
+    [GDB_CPU_I386_REG_ESP] = __builtin_offsetof(struct gdb_interrupt_state, esp),
+    [GDB_CPU_I386_REG_EBP] = __builtin_offsetof(struct gdb_interrupt_state, ebp),
+    [GDB_CPU_I386_REG_ESI] = __builtin_offsetof(struct gdb_interrupt_state, esi),
+    [GDB_CPU_I386_REG_EDI] = __builtin_offsetof(struct gdb_interrupt_state, edi),
+    [GDB_CPU_I386_REG_PC]  = __builtin_offsetof(struct gdb_interrupt_state, eip),
+    [GDB_CPU_I386_REG_PS]  = __builtin_offsetof(struct gdb_interrupt_state, eflags),
+    [GDB_CPU_I386_REG_CS]  = __builtin_offsetof(struct gdb_interrupt_state, cs),
+    [GDB_CPU_I386_REG_SS]  = __builtin_offsetof(struct gdb_interrupt_state, ss),
+    [GDB_CPU_I386_REG_DS]  = __builtin_offsetof(struct gdb_interrupt_state, ds),
+    [GDB_CPU_I386_REG_ES]  = __builtin_offsetof(struct gdb_interrupt_state, es),
+    [GDB_CPU_I386_REG_FS]  = __builtin_offsetof(struct gdb_interrupt_state, fs),
+    [GDB_CPU_I386_REG_GS]  = __builtin_offsetof(struct gdb_interrupt_state, gs),
+};
+
+/*****************************************************************************
+ * Serial Interrupt
+ ****************************************************************************/
+
+/// Master 8259 PIC command and data ports
+#define GDB_X86_PIC1_CMD  0x20
+#define GDB_X86_PIC1_DATA 0x21
+#define GDB_X86_PIC_EOI   0x20
+
+/// Vector the master PIC delivers IRQ0 on
+#ifndef GDB_X86_PIC1_BASE
+#define GDB_X86_PIC1_BASE 0x20
+#endif
+
+/// IRQ of the debug UART on the master PIC (COM1)
+#ifndef GDB_X86_UART_IRQ
+#define GDB_X86_UART_IRQ 4
+#endif
+
+#define GDB_X86_UART_VECTOR (GDB_X86_PIC1_BASE+GDB_X86_UART_IRQ)
+
+#define GDB_X86_STR_(x) #x
+#define GDB_X86_STR(x)  GDB_X86_STR_(x)
+
+/*
+ * Entry for the UART receive interrupt. Builds the same frame as the
+ * exception handlers, with no error code, and hands it to
+ * gdb_x86_int_handler().
+ */
+asm (
+    ".text\n"
+    ".globl gdb_x86_uart_entry\n"
+    "gdb_x86_uart_entry:\n"
+    "    pushl   $0\n"
+    "    pushl   $" GDB_X86_STR(GDB_X86_UART_VECTOR) "\n"
+    "    pushal\n"
+    "    pushl   %ds\n"
+    "    pushl   %es\n"
+    "    pushl   %fs\n"
+    "    pushl   %gs\n"
+    "    pushl   %ss\n"
+    "    cld\n"
+    "    pushl   %esp\n"
+    "    call    gdb_x86_int_handler\n"
+    "    addl    $8, %esp\n"
+    "    popl    %gs\n"
+    "    popl    %fs\n"
+    "    popl    %es\n"
+    "    popl    %ds\n"
+    "    popal\n"
+    "    addl    $8, %esp\n"
+    "    iret\n"
+    );
+
+/*****************************************************************************
+ * SMP
+ ****************************************************************************/
+
+/*
+ * With more than one CPU, the CPU that takes a trap stops all the others
+ * with an NMI before entering gdb_main(), and lets them all go again when
+ * gdb resumes. Each CPU is a thread to gdb. CPUs are numbered by local APIC
+ * ID, which must be below GDB_X86_MAX_CPUS. Every CPU must load the stub's
+ * IDT with gdb_x86_init_idt() to be stopped.
+ *
+ * In non-stop mode a CPU that traps stops alone and queues its stop. The
+ * first to stop serves gdb until gdb resumes it, when another stopped CPU
+ * takes over. While waiting for gdb, the serving CPU lets go of the stub so
+ * that other CPUs can report their stops. With no CPU stopped, the CPU that
+ * takes the receive interrupt serves the packets that came in.
+ *
+ * In either mode, a CPU stepping over a breakpoint that doesn't stop it
+ * holds every other CPU in place for that one instruction, see
+ * gdb_x86_smp_hold().
+ */
+
+/// CPUs the stub can stop; 1 leaves the local APIC alone
+#ifndef GDB_X86_MAX_CPUS
+#define GDB_X86_MAX_CPUS 1
+#endif
+
+/// Base of the local APIC registers, which must be identity mapped
+#ifndef GDB_X86_APIC_BASE
+#define GDB_X86_APIC_BASE 0xfee00000
+#endif
+
+typedef char gdb_x86_max_cpus_check[
+    (GDB_X86_MAX_CPUS >= 1 && GDB_X86_MAX_CPUS <= 32) ? 1 : -1];
+
+#if GDB_HAVE_SYS_NONSTOP
+typedef char gdb_x86_nonstop_events_check[
+    (GDB_NONSTOP_EVENTS >= GDB_X86_MAX_CPUS) ? 1 : -1];
+#endif
+
+#define GDB_X86_APIC_ID             0x020      ///< Local APIC ID
+#define GDB_X86_APIC_ICR_LO         0x300      ///< Interrupt command, low half
+#define GDB_X86_APIC_ICR_HI         0x310      ///< Interrupt command, high half
+#define GDB_X86_APIC_ICR_NMI        0x00000400 ///< NMI to the CPU in ICR_HI
+#define GDB_X86_APIC_ICR_NMI_OTHERS 0x000c0400 ///< NMI to every CPU but self
+#define GDB_X86_APIC_ICR_PENDING    (1<<12)    ///< Last IPI not yet sent
+
+/// Per-CPU data is padded to this, so CPUs spinning on their own flags
+/// don't take the line from each other
+#define GDB_X86_CACHE_LINE 64
+
+/// gdb_x86_smp.lock: owning CPU plus one in the low byte, 0 if free, and
+/// the release generation above it
+#define GDB_X86_SMP_OWNER(lock) ((lock) & 0xff)
+#define GDB_X86_SMP_GEN(lock)   ((lock) >> 8)
+
+/**
+ * @brief One CPU's state while it is stopped.
+ */
+struct gdb_x86_cpu {
+    reg registers[GDB_CPU_NUM_REGISTERS];  ///< Registers, unless selected
+    struct gdb_interrupt_state *frame;     ///< Interrupt frame, NULL if running
+    uint32_t     dirty;  ///< Registers the debugger changed
+    unsigned int dr_gen; ///< Debug register generation this CPU has loaded
+    unsigned int parked; ///< Release generation waited for plus one, or 0
+    int          ipi;    ///< An NMI from the stub is on its way
+    int          busy;   ///< Inside gdb_x86_interrupt()
+    int          hit;    ///< Stopped on a hardware breakpoint
+    int          signum; ///< Signal it stopped with, in non-stop mode
+    int          stop;   ///< Non-stop: gdb asked it to stop
+    int          go;     ///< Non-stop: gdb resumed it
+    int          hold;   ///< An NMI to wait out a step-over is on its way
+    int          held;   ///< Waiting out the current step-over
+    struct gdb_x86_step_over step_over; ///< Breakpoint it is stepping over
+} __attribute__((aligned(GDB_X86_CACHE_LINE)));
+
+/**
+ * @brief CPUs known to the stub, and which of them holds it.
+ */
+struct gdb_x86_smp {
+    struct gdb_x86_cpu cpus[GDB_X86_MAX_CPUS];
+    unsigned int lock;     ///< Owner and release generation
+    uint32_t     online;   ///< CPUs that loaded the stub's IDT
+    unsigned int stopped;  ///< CPU running the stub, whose trap is reported
+    unsigned int selected; ///< CPU whose registers are in gdb_state.registers
+    unsigned int server;   ///< Non-stop: CPU serving gdb plus one, or 0
+    unsigned int lent;     ///< Non-stop: CPU the server had selected
+    int          lent_signum; ///< Non-stop: signal the server was reporting
+    int          visiting; ///< Non-stop: the server is a running CPU
+    unsigned int hold;     ///< CPU stepping over a breakpoint plus one, or 0
+};
+
+static struct gdb_x86_smp gdb_x86_smp;
+
+unsigned int gdb_x86_dr_sync(unsigned int gen);
+int gdb_x86_uart_pending(void);
+
+/*
+ * Number of the CPU this runs on.
+ */
+static unsigned int gdb_x86_cpu_id(void)
+{
+#if GDB_X86_MAX_CPUS > 1
+    return *(volatile uint32_t *)(GDB_X86_APIC_BASE+GDB_X86_APIC_ID) >> 24;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Make this CPU one the stub stops.
+ */
+static void gdb_x86_smp_online(void)
+{
+    __atomic_or_fetch(&gdb_x86_smp.online, (uint32_t)1 << gdb_x86_cpu_id(),
+                      __ATOMIC_RELEASE);
+}
+
+/*
+ * Whether gdb runs the target in non-stop mode.
+ */
+static int gdb_x86_smp_nonstop(void)
+{
+#if GDB_HAVE_SYS_NONSTOP
+    return gdb_nonstop_active();
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Wait out another CPU's step-over, see gdb_x86_smp_hold().
+ *
+ * Returns 1 if there was one, 0 otherwise.
+ */
+static int gdb_x86_smp_wait(unsigned int me)
+{
+    unsigned int hold;
+
+    hold = __atomic_load_n(&gdb_x86_smp.hold, __ATOMIC_ACQUIRE);
+    if (!hold || hold == me+1) {
+        return 0;
+    }
+
+    __atomic_store_n(&gdb_x86_smp.cpus[me].held, 1, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&gdb_x86_smp.hold, __ATOMIC_ACQUIRE)) {
+        __builtin_ia32_pause();
+    }
+    return 1;
+}
+
+/*
+ * Take the stub, waiting while another CPU holds it.
+ */
+static void gdb_x86_smp_lock(unsigned int me)
+{
+    unsigned int lock;
+
+    for (;;) {
+        lock = __atomic_load_n(&gdb_x86_smp.lock, __ATOMIC_ACQUIRE);
+        if (GDB_X86_SMP_OWNER(lock) == 0 &&
+            __atomic_compare_exchange_n(&gdb_x86_smp.lock, &lock, lock | (me+1),
+                                        0, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED)) {
+            return;
+        }
+        gdb_x86_smp_wait(me);
+        __builtin_ia32_pause();
+    }
+}
+
+/*
+ * Let go of the stub, leaving parked CPUs parked.
+ */
+static void gdb_x86_smp_unlock(void)
+{
+    unsigned int lock;
+
+    lock = __atomic_load_n(&gdb_x86_smp.lock, __ATOMIC_RELAXED);
+    __atomic_store_n(&gdb_x86_smp.lock, lock & ~0xffu, __ATOMIC_RELEASE);
+}
+
+#if GDB_HAVE_SYS_NONSTOP
+/*
+ * Let go of the stub for a moment, for CPUs waiting to take it.
+ */
+static void gdb_x86_smp_yield(void)
+{
+    unsigned int me;
+
+    me = gdb_x86_smp.stopped;
+    gdb_x86_smp_unlock();
+    __builtin_ia32_pause();
+    gdb_x86_smp_lock(me);
+}
+#endif
+
+/*
+ * Save the selected registers, and which of them changed, with a CPU.
+ */
+static void gdb_x86_smp_stash(struct gdb_state *state, struct gdb_x86_cpu *cpu)
+{
+    gdb_memcpy((char *)cpu->registers, (const char *)state->registers,
+               sizeof(cpu->registers));
+    cpu->dirty = gdb_regs_dirty;
+}
+
+/*
+ * Select the registers saved with a CPU.
+ */
+static void gdb_x86_smp_fetch(struct gdb_state *state, struct gdb_x86_cpu *cpu)
+{
+    gdb_memcpy((char *)state->registers, (const char *)cpu->registers,
+               sizeof(cpu->registers));
+    gdb_regs_dirty = cpu->dirty;
+}
+
+/*
+ * Save the registers of a CPU that parks without a trap to report.
+ */
+static void gdb_x86_smp_save(struct gdb_x86_cpu *cpu,
+                             struct gdb_interrupt_state *istate)
+{
+    unsigned int i;
+
+    for (i = 0; i < GDB_CPU_NUM_REGISTERS; i++) {
+        cpu->registers[i] =
+            *(uint32_t *)((char *)istate + gdb_x86_reg_offsets[i]);
+    }
+    cpu->dirty  = 0;
+    cpu->hit    = 0;
+    cpu->signum = 0;
+    cpu->frame  = istate;
+}
+
+/*
+ * Write back the registers the debugger changed while a CPU was parked.
+ */
+static void gdb_x86_smp_unpark(struct gdb_x86_cpu *cpu,
+                               struct gdb_interrupt_state *istate)
+{
+    unsigned int i;
+
+    cpu->go = 0;
+    cpu->dr_gen = gdb_x86_dr_sync(cpu->dr_gen);
+    while (cpu->dirty) {
+        i = __builtin_ctz(cpu->dirty);
+        cpu->dirty &= cpu->dirty-1;
+        *(uint32_t *)((char *)istate + gdb_x86_reg_offsets[i]) =
+            cpu->registers[i];
+    }
+    cpu->frame = NULL;
+    __atomic_store_n(&cpu->parked, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * Wait, with the registers saved, until the CPU holding the stub lets go of
+ * release generation gen.
+ *
+ * In non-stop mode gdb resumes parked CPUs one at a time instead. Should the
+ * stub be left free with no CPU serving gdb, a CPU allowed to serve takes
+ * over, and any other stops waiting so it can report its own trap.
+ *
+ * Returns 1 with the stub held to serve gdb, 0 to resume.
+ */
+static int gdb_x86_smp_park(struct gdb_x86_cpu *cpu,
+                            struct gdb_interrupt_state *istate,
+                            unsigned int me, unsigned int gen, int serve)
+{
+    unsigned int lock;
+
+    __atomic_store_n(&cpu->parked, gen+1, __ATOMIC_RELEASE);
+
+    for (;;) {
+        gdb_x86_smp_wait(me);
+        if (__atomic_load_n(&cpu->go, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+
+        lock = __atomic_load_n(&gdb_x86_smp.lock, __ATOMIC_ACQUIRE);
+        if (GDB_X86_SMP_GEN(lock) != gen) {
+            break;
+        }
+
+        if (gdb_x86_smp_nonstop() && GDB_X86_SMP_OWNER(lock) == 0 &&
+            !__atomic_load_n(&gdb_x86_smp.server, __ATOMIC_RELAXED)) {
+            if (!serve) {
+                break;
+            }
+            if (__atomic_compare_exchange_n(&gdb_x86_smp.lock, &lock,
+                                            lock | (me+1), 0,
+                                            __ATOMIC_ACQUIRE,
+                                            __ATOMIC_RELAXED)) {
+                if (!cpu->go && !gdb_x86_smp.server) {
+                    __atomic_store_n(&cpu->parked, 0, __ATOMIC_RELAXED);
+                    gdb_x86_smp.server   = me+1;
+                    gdb_x86_smp.stopped  = me;
+                    gdb_x86_smp.selected = me;
+                    gdb_x86_smp_fetch(&gdb_state, cpu);
+                    gdb_state.signum = cpu->signum;
+                    return 1;
+                }
+                gdb_x86_smp_unlock();
+            }
+        }
+
+        __builtin_ia32_pause();
+    }
+
+    if (gdb_x86_smp_nonstop()) {
+        /* The CPU serving gdb may be changing the debug registers */
+        gdb_x86_smp_lock(me);
+        gdb_x86_smp_unpark(cpu, istate);
+        gdb_x86_smp_unlock();
+    } else {
+        gdb_x86_smp_unpark(cpu, istate);
+    }
+    return 0;
+}
+
+/*
+ * Take the stub for this CPU. While another CPU holds it, this one parks
+ * and tries again once let go, so its own trap is reported in turn. In
+ * non-stop mode the stub is only held briefly, so it just waits, and an NMI
+ * from the stub is gdb asking this CPU to stop. Either way an NMI may also
+ * be another CPU's step-over to wait out, and the CPU stepping over comes
+ * back with the stub still held.
+ *
+ * Returns 1 once the stub is held to report a trap, 2 once held to serve
+ * gdb for this CPU stopped earlier, 0 if the CPU should just resume.
+ */
+static int gdb_x86_smp_enter(struct gdb_interrupt_state *istate)
+{
+    struct gdb_x86_cpu *cpu;
+    unsigned int me, lock;
+
+    me  = gdb_x86_cpu_id();
+    cpu = &gdb_x86_smp.cpus[me];
+
+    if (__atomic_load_n(&gdb_x86_smp.hold, __ATOMIC_RELAXED) == me+1) {
+        cpu->frame = istate;
+        return 1;
+    }
+
+    if (istate->vector == 2 &&
+        __atomic_exchange_n(&cpu->hold, 0, __ATOMIC_ACQUIRE)) {
+        gdb_x86_smp_wait(me);
+        if (!__atomic_load_n(&cpu->ipi, __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+    }
+
+    if (istate->vector == 2 && __atomic_load_n(&cpu->ipi, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&cpu->ipi, 0, __ATOMIC_RELAXED);
+        lock = __atomic_load_n(&gdb_x86_smp.lock, __ATOMIC_ACQUIRE);
+        if (gdb_x86_smp_nonstop()) {
+            /* Already stopping for a trap of its own */
+            if (cpu->busy) {
+                return 0;
+            }
+            cpu->stop = 1;
+        } else {
+            /* Already on its way to park, or a stop that is already over */
+            if (cpu->busy || GDB_X86_SMP_OWNER(lock) == 0 ||
+                GDB_X86_SMP_OWNER(lock) == me+1) {
+                return 0;
+            }
+            cpu->busy = 1;
+            gdb_x86_smp_save(cpu, istate);
+            if (gdb_x86_smp_park(cpu, istate, me, GDB_X86_SMP_GEN(lock), 1)) {
+                return 2;
+            }
+            cpu->busy = 0;
+            return 0;
+        }
+    }
+
+    cpu->busy = 1;
+    for (;;) {
+        lock = __atomic_load_n(&gdb_x86_smp.lock, __ATOMIC_ACQUIRE);
+        if (GDB_X86_SMP_OWNER(lock) == 0 &&
+            __atomic_compare_exchange_n(&gdb_x86_smp.lock, &lock, lock | (me+1),
+                                        0, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED)) {
+            break;
+        }
+        if (gdb_x86_smp_nonstop()) {
+            gdb_x86_smp_wait(me);
+            __builtin_ia32_pause();
+        } else {
+            gdb_x86_smp_save(cpu, istate);
+            gdb_x86_smp_park(cpu, istate, me, GDB_X86_SMP_GEN(lock), 0);
+        }
+    }
+
+    /* Put aside what the CPU serving gdb is looking at until it's back */
+    if (gdb_x86_smp.server) {
+        gdb_x86_smp.lent = gdb_x86_smp.selected;
+        gdb_x86_smp.lent_signum = gdb_state.signum;
+        gdb_x86_smp_stash(&gdb_state, &gdb_x86_smp.cpus[gdb_x86_smp.lent]);
+        gdb_regs_dirty = 0;
+    }
+
+    cpu->frame = istate;
+    gdb_x86_smp.stopped  = me;
+    gdb_x86_smp.selected = me;
+    return 1;
+}
+
+/*
+ * Note how this CPU stopped: whether on a hardware breakpoint, which it
+ * steps past on resume, and whether gdb asked it to.
+ */
+static void gdb_x86_smp_stopped_on(void)
+{
+    struct gdb_x86_cpu *cpu;
+    address addr;
+
+    cpu = &gdb_x86_smp.cpus[gdb_x86_smp.stopped];
+    cpu->hit = (gdb_sys_hw_break_hit(&gdb_state, &addr) == GDB_HW_BREAK_EXEC);
+    if (cpu->stop) {
+        cpu->stop = 0;
+        gdb_state.signum = 0;
+    }
+}
+
+#if GDB_X86_MAX_CPUS > 1
+/*
+ * Send an NMI to every other CPU.
+ */
+static void gdb_x86_smp_nmi_others(void)
+{
+    volatile uint32_t *icr;
+
+    icr = (volatile uint32_t *)(GDB_X86_APIC_BASE+GDB_X86_APIC_ICR_LO);
+    while (*icr & GDB_X86_APIC_ICR_PENDING) {
+        __builtin_ia32_pause();
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    *icr = GDB_X86_APIC_ICR_NMI_OTHERS;
+}
+#endif
+
+/*
+ * Stop every other CPU and wait until they have all parked.
+ */
+static void gdb_x86_smp_stop_others(void)
+{
+#if GDB_X86_MAX_CPUS > 1
+    uint32_t others, mask;
+    unsigned int i, gen;
+
+    others = __atomic_load_n(&gdb_x86_smp.online, __ATOMIC_ACQUIRE) &
+             ~((uint32_t)1 << gdb_x86_smp.stopped);
+    if (!others) {
+        return;
+    }
+
+    for (mask = others; mask; mask &= mask-1) {
+        __atomic_store_n(&gdb_x86_smp.cpus[__builtin_ctz(mask)].ipi, 1,
+                         __ATOMIC_RELEASE);
+    }
+    gdb_x86_smp_nmi_others();
+
+    gen = GDB_X86_SMP_GEN(gdb_x86_smp.lock);
+    for (mask = others; mask; mask &= mask-1) {
+        i = __builtin_ctz(mask);
+        while (__atomic_load_n(&gdb_x86_smp.cpus[i].parked,
+                               __ATOMIC_ACQUIRE) != gen+1) {
+            __builtin_ia32_pause();
+        }
+    }
+#endif
+}
+
+/*
+ * Let a stopped CPU gdb didn't resume itself run on: not single-stepping,
+ * and past the hardware breakpoint it stopped on, if any.
+ */
+static void gdb_x86_smp_run_on(reg *registers, uint32_t *dirty, int hit)
+{
+    reg ps;
+
+    ps = registers[GDB_CPU_I386_REG_PS] & ~GDB_X86_EFLAGS_TF;
+    if (hit) {
+        ps |= GDB_X86_EFLAGS_RF;
+    }
+    if (ps != registers[GDB_CPU_I386_REG_PS]) {
+        registers[GDB_CPU_I386_REG_PS] = ps;
+        *dirty |= (uint32_t)1 << GDB_CPU_I386_REG_PS;
+    }
+}
+
+/*
+ * Get every stopped CPU ready to resume after gdb_main(), leaving this
+ * CPU's registers in gdb_state.registers.
+ */
+static void gdb_x86_smp_resume(void)
+{
+    struct gdb_x86_cpu *cpu;
+    unsigned int i, resumed;
+
+    resumed = gdb_x86_smp.selected;
+    gdb_sys_cpu_select(&gdb_state, gdb_x86_smp.stopped);
+
+    for (i = 0; i < GDB_X86_MAX_CPUS; i++) {
+        cpu = &gdb_x86_smp.cpus[i];
+        if (!cpu->frame || i == resumed) {
+            continue;
+        }
+        if (i == gdb_x86_smp.stopped) {
+            gdb_x86_smp_run_on(gdb_state.registers, &gdb_regs_dirty,
+                               cpu->hit);
+        } else {
+            gdb_x86_smp_run_on(cpu->registers, &cpu->dirty, cpu->hit);
+        }
+    }
+}
+
+/*
+ * In non-stop mode, hand the CPU serving gdb back what it was looking at
+ * before a trap on another CPU borrowed the stub.
+ */
+static void gdb_x86_smp_give_back(void)
+{
+    if (!gdb_x86_smp.server || gdb_x86_smp.server == gdb_x86_smp.stopped+1) {
+        return;
+    }
+
+    gdb_x86_smp.stopped  = gdb_x86_smp.server-1;
+    gdb_x86_smp.selected = gdb_x86_smp.lent;
+    gdb_x86_smp_fetch(&gdb_state, &gdb_x86_smp.cpus[gdb_x86_smp.lent]);
+    gdb_state.signum = gdb_x86_smp.lent_signum;
+}
+
+/*
+ * Let go of the stub, and with it every parked CPU. In non-stop mode
+ * parked CPUs wait for gdb to resume them one by one instead.
+ */
+static void gdb_x86_smp_leave(void)
+{
+    struct gdb_x86_cpu *cpu;
+    unsigned int lock;
+
+    cpu = &gdb_x86_smp.cpus[gdb_x86_smp.stopped];
+    cpu->dr_gen = gdb_x86_dr_sync(cpu->dr_gen);
+    cpu->frame  = NULL;
+    cpu->busy   = 0;
+
+    if (gdb_x86_smp_nonstop()) {
+        gdb_x86_smp_give_back();
+        gdb_x86_smp_unlock();
+        return;
+    }
+
+    lock = __atomic_load_n(&gdb_x86_smp.lock, __ATOMIC_RELAXED);
+    __atomic_store_n(&gdb_x86_smp.lock, (GDB_X86_SMP_GEN(lock)+1) << 8,
+                     __ATOMIC_RELEASE);
+}
+
+#if GDB_HAVE_SYS_NONSTOP
+/*
+ * Report this CPU's stop in non-stop mode. It serves gdb if no other CPU
+ * does, and otherwise gives the stub back and parks.
+ *
+ * Returns 1 with the stub held to serve gdb, 0 once resumed.
+ */
+static int gdb_x86_nonstop_stop(struct gdb_interrupt_state *istate)
+{
+    struct gdb_x86_cpu *cpu;
+    unsigned int me, hit;
+    address addr;
+
+    me   = gdb_x86_smp.stopped;
+    cpu  = &gdb_x86_smp.cpus[me];
+    addr = 0;
+    hit  = gdb_sys_hw_break_hit(&gdb_state, &addr);
+    cpu->signum = gdb_state.signum;
+    cpu->go = 0;
+
+    if (!gdb_x86_smp.server) {
+        gdb_x86_smp.server = me+1;
+        gdb_nonstop_push(me+1, cpu->signum, hit, addr);
+        return 1;
+    }
+
+    gdb_x86_smp_stash(&gdb_state, cpu);
+    gdb_x86_smp_give_back();
+    gdb_x86_smp_unlock();
+
+    gdb_nonstop_push(me+1, cpu->signum, hit, addr);
+    if (gdb_x86_smp_park(cpu, istate, me,
+                         GDB_X86_SMP_GEN(__atomic_load_n(&gdb_x86_smp.lock,
+                                                         __ATOMIC_ACQUIRE)),
+                         1)) {
+        return 1;
+    }
+    cpu->busy = 0;
+    return 0;
+}
+#endif /* GDB_HAVE_SYS_NONSTOP */
+
+/*
+ * Stop for gdb: hold the other CPUs, or in non-stop mode report this one
+ * alone.
+ *
+ * Returns 1 with the stub held to enter gdb_main(), 0 if this CPU was
+ * resumed without it.
+ */
+static int gdb_x86_smp_stop(struct gdb_interrupt_state *istate)
+{
+#if GDB_HAVE_SYS_NONSTOP
+    if (gdb_nonstop_active()) {
+        return gdb_x86_nonstop_stop(istate);
+    }
+#endif
+
+    gdb_x86_smp_stop_others();
+    return 1;
+}
+
+/*
+ * Leave the stub after a receive interrupt that wasn't a break. In
+ * non-stop mode, with no stopped CPU to serve gdb, this one serves what
+ * came in first, staying a running thread to gdb.
+ */
+static void gdb_x86_smp_visit(void)
+{
+    if (gdb_x86_smp_nonstop() && !gdb_x86_smp.server &&
+        gdb_x86_uart_pending()) {
+        gdb_x86_smp.cpus[gdb_x86_smp.stopped].frame = NULL;
+        gdb_x86_smp.server   = gdb_x86_smp.stopped+1;
+        gdb_x86_smp.visiting = 1;
+
+        gdb_main(&gdb_state);
+
+        gdb_x86_smp_stash(&gdb_state,
+                          &gdb_x86_smp.cpus[gdb_x86_smp.selected]);
+        gdb_x86_smp.visiting = 0;
+        gdb_x86_smp.server   = 0;
+    }
+
+    gdb_x86_smp_leave();
+}
+
+/**
+ * @brief Wait a moment for gdb.
+ *
+ * Called while the stub waits for input. In non-stop mode the CPU serving
+ * gdb sends the next stop notification if one is due, and lets go of the
+ * stub for a moment so that CPUs that trap meanwhile can report their
+ * stops. A running CPU serving gdb stops waiting once a packet is done.
+ *
+ * @param between 1 if no packet is partly received, 0 otherwise
+ * @return 1 to keep waiting, 0 to give up
+ */
+int gdb_x86_smp_idle(int between)
+{
+    if (gdb_x86_smp.visiting) {
+        return !between;
+    }
+
+#if GDB_HAVE_SYS_NONSTOP
+    if (gdb_nonstop_active()) {
+        gdb_nonstop_notify(&gdb_state);
+        gdb_x86_smp_yield();
+        return 1;
+    }
+#endif
+
+    __builtin_ia32_pause();
+    return 1;
+}
+
+/**
+ * @brief Report whether gdb_state.registers belong to the CPU running the
+ * stub.
+ *
+ * @return 1 if they do, 0 if another stopped CPU is selected
+ */
+int gdb_x86_smp_local(void)
+{
+    return gdb_x86_smp.selected == gdb_x86_smp.stopped;
+}
+
+/**
+ * @brief Report whether the selected CPU stopped on a hardware breakpoint.
+ *
+ * @return 1 if it did, 0 otherwise
+ */
+int gdb_x86_smp_hit(void)
+{
+    return gdb_x86_smp.cpus[gdb_x86_smp.selected].hit;
+}
+
+/**
+ * @brief Get the breakpoint step-over state of the CPU running the stub.
+ *
+ * @return Its step-over state
+ */
+struct gdb_x86_step_over *gdb_x86_smp_step_over(void)
+{
+    return &gdb_x86_smp.cpus[gdb_x86_smp.stopped].step_over;
+}
+
+/**
+ * @brief Hold every other CPU while the CPU running the stub steps over a
+ * breakpoint, or let them go.
+ *
+ * The breakpoint instruction is out of memory every CPU runs until the step
+ * traps, and another CPU running through it would miss its stop. Holding
+ * doesn't stop anything gdb can see: each CPU takes an NMI, or notices
+ * wherever it already waits inside the stub, and spins there. The CPU
+ * stepping over keeps the stub and comes back holding it.
+ *
+ * @param hold Nonzero to hold, zero to let go
+ */
+void gdb_x86_smp_hold(int hold)
+{
+#if GDB_X86_MAX_CPUS > 1
+    uint32_t others, mask;
+#endif
+
+    if (!hold) {
+        __atomic_store_n(&gdb_x86_smp.hold, 0, __ATOMIC_RELEASE);
+        return;
+    }
+
+#if GDB_X86_MAX_CPUS > 1
+    others = __atomic_load_n(&gdb_x86_smp.online, __ATOMIC_ACQUIRE) &
+             ~((uint32_t)1 << gdb_x86_smp.stopped);
+    for (mask = others; mask; mask &= mask-1) {
+        gdb_x86_smp.cpus[__builtin_ctz(mask)].held = 0;
+        __atomic_store_n(&gdb_x86_smp.cpus[__builtin_ctz(mask)].hold, 1,
+                         __ATOMIC_RELEASE);
+    }
+#endif
+    __atomic_store_n(&gdb_x86_smp.hold, gdb_x86_smp.stopped+1,
+                     __ATOMIC_RELEASE);
+#if GDB_X86_MAX_CPUS > 1
+    if (!others) {
+        return;
+    }
+
+    gdb_x86_smp_nmi_others();
+    for (mask = others; mask; mask &= mask-1) {
+        while (!__atomic_load_n(&gdb_x86_smp.cpus[__builtin_ctz(mask)].held,
+                                __ATOMIC_ACQUIRE)) {
+            __builtin_ia32_pause();
+        }
+    }
+#endif
+}
+
+/**
+ * @brief Find the next CPU, stopped or, in non-stop mode, running.
+ *
+ * @param state Pointer to the gdb_state struct
+ * @param cpu CPU to start after, or GDB_EOF to start at the first
+ * @return The CPU number, or GDB_EOF if there are no more
+ */
+int gdb_sys_cpu_next(struct gdb_state *state, int cpu)
+{
+    uint32_t online;
+
+    online = __atomic_load_n(&gdb_x86_smp.online, __ATOMIC_ACQUIRE);
+    for (cpu += 1; cpu < GDB_X86_MAX_CPUS; cpu++) {
+        if ((online & ((uint32_t)1 << cpu)) || gdb_x86_smp.cpus[cpu].frame) {
+            return cpu;
+        }
+    }
+    return GDB_EOF;
+}
+
+/**
+ * @brief Get the CPU running the stub, whose trap stopped the target.
+ *
+ * @param state Pointer to the gdb_state struct
+ * @return The CPU number
+ */
+int gdb_sys_cpu_stopped(struct gdb_state *state)
+{
+    return gdb_x86_smp.stopped;
+}
+
+/**
+ * @brief Put a stopped CPU's registers in gdb_state.registers.
+ *
+ * @param state Pointer to the gdb_state struct
+ * @param cpu CPU number
+ * @return 0 on success, or GDB_EOF if the CPU isn't stopped
+ */
+int gdb_sys_cpu_select(struct gdb_state *state, int cpu)
+{
+    if (cpu < 0 || cpu >= GDB_X86_MAX_CPUS || !gdb_x86_smp.cpus[cpu].frame) {
+        return GDB_EOF;
+    }
+    if ((unsigned int)cpu == gdb_x86_smp.selected) {
+        return 0;
+    }
+
+    gdb_x86_smp_stash(state, &gdb_x86_smp.cpus[gdb_x86_smp.selected]);
+    gdb_x86_smp_fetch(state, &gdb_x86_smp.cpus[cpu]);
+    gdb_x86_smp.selected = cpu;
+    return 0;
+}
+
+#if GDB_HAVE_SYS_NONSTOP
+/**
+ * @brief Check whether a CPU is running, in non-stop mode.
+ *
+ * @param state Pointer to the gdb_state struct
+ * @param cpu CPU number
+ * @return 1 if it is, 0 if it is stopped or unknown
+ */
+int gdb_sys_cpu_running(struct gdb_state *state, int cpu)
+{
+    if (cpu < 0 || cpu >= GDB_X86_MAX_CPUS || gdb_x86_smp.cpus[cpu].frame) {
+        return 0;
+    }
+    return (__atomic_load_n(&gdb_x86_smp.online, __ATOMIC_ACQUIRE) >>
+            cpu) & 1;
+}
+
+/**
+ * @brief Get the signal a stopped CPU stopped with, in non-stop mode.
+ *
+ * @param state Pointer to the gdb_state struct
+ * @param cpu CPU number
+ * @return The signal, 0 if gdb stopped it or it isn't stopped
+ */
+int gdb_sys_cpu_signal(struct gdb_state *state, int cpu)
+{
+    if (cpu < 0 || cpu >= GDB_X86_MAX_CPUS || !gdb_x86_smp.cpus[cpu].frame) {
+        return 0;
+    }
+    return gdb_x86_smp.cpus[cpu].signum;
+}
+
+/**
+ * @brief Let a stopped CPU run on in non-stop mode.
+ *
+ * Its registers, as gdb_sys_continue() or gdb_sys_step() left them, go back
+ * with it, and the CPU running the stub is selected again.
+ *
+ * @param state Pointer to the gdb_state struct
+ * @param cpu CPU number
+ * @return 1 if it is the CPU running the stub, 0 otherwise
+ */
+int gdb_sys_cpu_resume(struct gdb_state *state, int cpu)
+{
+    struct gdb_x86_cpu *target;
+
+    if (cpu < 0 || cpu >= GDB_X86_MAX_CPUS || !gdb_x86_smp.cpus[cpu].frame) {
+        return 0;
+    }
+    if ((unsigned int)cpu == gdb_x86_smp.stopped) {
+        return 1;
+    }
+
+    target = &gdb_x86_smp.cpus[cpu];
+    if ((unsigned int)cpu == gdb_x86_smp.selected) {
+        gdb_x86_smp_stash(state, target);
+        gdb_x86_smp.selected = gdb_x86_smp.stopped;
+        gdb_x86_smp_fetch(state, &gdb_x86_smp.cpus[gdb_x86_smp.selected]);
+    }
+
+    target->frame = NULL;
+    __atomic_store_n(&target->go, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * @brief Ask a running CPU to stop, in non-stop mode.
+ *
+ * It takes an NMI and reports a stop with signal 0.
+ *
+ * @param state Pointer to the gdb_state struct
+ * @param cpu CPU number
+ * @return 0 on success, or GDB_EOF if it isn't running
+ */
+int gdb_sys_cpu_stop(struct gdb_state *state, int cpu)
+{
+#if GDB_X86_MAX_CPUS > 1
+    volatile uint32_t *icr;
+
+    if (!gdb_sys_cpu_running(state, cpu) ||
+        (unsigned int)cpu == gdb_x86_smp.stopped) {
+        return GDB_EOF;
+    }
+
+    __atomic_store_n(&gdb_x86_smp.cpus[cpu].ipi, 1, __ATOMIC_RELEASE);
+
+    icr = (volatile uint32_t *)(GDB_X86_APIC_BASE+GDB_X86_APIC_ICR_LO);
+    while (*icr & GDB_X86_APIC_ICR_PENDING) {
+        __builtin_ia32_pause();
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    *(volatile uint32_t *)(GDB_X86_APIC_BASE+GDB_X86_APIC_ICR_HI) =
+        (uint32_t)cpu << 24;
+    *icr = GDB_X86_APIC_ICR_NMI;
+    return 0;
+#else
+    return GDB_EOF;
+#endif
+}
+#endif /* GDB_HAVE_SYS_NONSTOP */
+
+/*****************************************************************************
+ * Interrupt Management Prototypes
+ ****************************************************************************/
+
+void gdb_x86_uart_entry(void);
+void gdb_x86_uart_init(void);
+int gdb_x86_uart_irq(void);
+#if GDB_PROFILE
+void gdb_x86_clock_init(void);
+#endif
+
+int gdb_x86_mem_fault(uint32_t *eip, uint32_t error_code);
+void gdb_x86_mem_invalidate(void);
+void gdb_x86_fpu_resume(void);
+int gdb_x86_dr_stop(uint32_t vector);
+int gdb_range_step_continue(struct gdb_state *state);
+int gdb_x86_break_filter(struct gdb_state *state, uint32_t vector, int step,
+                         uint32_t *eip, uint32_t *eflags);
+
+extern uint32_t gdb_regs_dirty;
+
 /*****************************************************************************
  * Interrupt Management Functions
  ****************************************************************************/
@@ -135,7 +1140,29 @@ static void gdb_x86_hook_idt(uint8_t vector, const void *function)
 }
 
 /*
- * Initialize IDT gates and load the new IDT.
+ * Route the debug UART's receive interrupt to the stub and start the UART.
+ * The vector is hooked in the current IDT, which must cover it.
+ *
+ * This is part of bringing up the stub: call it once, on one CPU, after the
+ * IDT that stays in use is loaded. Until then the UART is not programmed and
+ * gdb can't break into a running target; the stub only reads the UART when
+ * it is entered by a trap.
+ */
+void gdb_x86_hook_uart(void)
+{
+#if GDB_PROFILE
+    gdb_x86_clock_init();
+#endif
+    gdb_x86_hook_idt(GDB_X86_UART_VECTOR, gdb_x86_uart_entry);
+    gdb_x86_uart_init();
+    gdb_x86_io_write_8(GDB_X86_PIC1_DATA,
+                       gdb_x86_io_read_8(GDB_X86_PIC1_DATA) &
+                       ~(1 << GDB_X86_UART_IRQ));
+}
+
+/*
+ * Initialize IDT gates and load the new IDT. Each CPU calls this to be
+ * stopped along with the others.
  */
 static void gdb_x86_init_idt(void)
 {
@@ -145,6 +1172,7 @@ static void gdb_x86_init_idt(void)
     idtr.len = sizeof(gdb_idt_gates)-1;
     idtr.offset = (uint32_t)gdb_idt_gates;
     gdb_x86_load_idt(&idtr);
+    gdb_x86_smp_online();
 }
 
 /*
@@ -155,15 +1183,129 @@ void gdb_x86_int_handler(struct gdb_interrupt_state *istate)
     gdb_x86_interrupt(istate);
 }
 
+#if GDB_PROFILE
+/*
+ * Break-in latency, in gdb_sys_clock() nanoseconds: from entry of the UART
+ * interrupt that carried gdb's break byte to entry of gdb_main(). This
+ * includes draining the UART FIFO, waiting for the stub and stopping the
+ * other CPUs, but not the byte's time on the wire. Print it from gdb once it
+ * has broken in.
+ */
+struct gdb_x86_break_profile {
+    unsigned long irq;   ///< Clock at entry of the last UART interrupt
+    unsigned long count; ///< Breaks measured
+    unsigned long last;  ///< Latency of the last break
+    unsigned long max;   ///< Worst latency seen
+    unsigned long total; ///< Sum of all latencies, for the mean
+};
+
+struct gdb_x86_break_profile gdb_x86_break_profile;
+
+/*
+ * Account a break that is about to enter gdb_main().
+ */
+static void gdb_x86_break_profile_end(void)
+{
+    unsigned long delta;
+
+    delta = gdb_sys_clock(&gdb_state)-gdb_x86_break_profile.irq;
+    gdb_x86_break_profile.count += 1;
+    gdb_x86_break_profile.last   = delta;
+    gdb_x86_break_profile.total += delta;
+    if (delta > gdb_x86_break_profile.max) {
+        gdb_x86_break_profile.max = delta;
+    }
+}
+#endif
+
+/*
+ * Resume after gdb_main(): every stopped CPU, or in non-stop mode just
+ * this one.
+ */
+static void gdb_x86_finish(struct gdb_interrupt_state *istate)
+{
+    uint32_t dirty;
+    unsigned int i;
+
+    /* Restore FPU/vector state, if the debugger changed it */
+    gdb_x86_fpu_resume();
+
+    /* Back to this CPU's registers, with the others ready to run */
+    if (gdb_x86_smp_nonstop()) {
+        gdb_x86_smp.server = 0;
+        gdb_sys_cpu_select(&gdb_state, gdb_x86_smp.stopped);
+    } else {
+        gdb_x86_smp_resume();
+    }
+
+    /* Restore the registers the debugger changed */
+    dirty = gdb_regs_dirty;
+    gdb_regs_dirty = 0;
+    while (dirty) {
+        i = __builtin_ctz(dirty);
+        dirty &= dirty-1;
+        *(uint32_t *)((char *)istate + gdb_x86_reg_offsets[i]) =
+            gdb_state.registers[i];
+    }
+
+    gdb_x86_smp_leave();
+}
+
 /*
  * Debug interrupt handler.
  */
 static void gdb_x86_interrupt(struct gdb_interrupt_state *istate)
 {
+    int step;
+    int brk;
+
+#if GDB_PROFILE
+    /* Break-in latency counts from here */
+    if (istate->vector == GDB_X86_UART_VECTOR) {
+        gdb_x86_break_profile.irq = gdb_sys_clock(&gdb_state);
+    }
+#endif
+
+    /* A page fault in a guarded stub memory access just ends the access */
+    if (istate->vector == 14 &&
+        gdb_x86_mem_fault(&istate->eip, istate->error_code)) {
+        return;
+    }
+
+    /* One CPU at a time runs the stub, the others wait their turn */
+    switch (gdb_x86_smp_enter(istate)) {
+    case 0:
+        return;
+    case 2:
+        /* Stopped earlier, and now serving gdb in non-stop mode */
+        gdb_main(&gdb_state);
+        gdb_x86_finish(istate);
+        return;
+    }
+
+    /* Received data is queued for the next packet, the target runs on
+     * unless gdb sent a break */
+    if (istate->vector == GDB_X86_UART_VECTOR) {
+        brk = gdb_x86_uart_irq();
+        gdb_x86_io_write_8(GDB_X86_PIC1_CMD, GDB_X86_PIC_EOI);
+        if (!brk) {
+            gdb_x86_smp_visit();
+            return;
+        }
+    }
+
+    /* The debuggee may have changed its mappings while it ran */
+    gdb_x86_mem_invalidate();
+
+    /* Note which debug register, if any, fired */
+    step = gdb_x86_dr_stop(istate->vector);
+
     /* Translate vector to signal */
     switch (istate->vector) {
     case 1:  gdb_state.signum = 5; break;
     case 3:  gdb_state.signum = 5; break;
+    case 14: gdb_state.signum = 11; break;
+    case GDB_X86_UART_VECTOR: gdb_state.signum = 2; break;
     default: gdb_state.signum = 7;
     }
 
@@ -185,23 +1327,38 @@ static void gdb_x86_interrupt(struct gdb_interrupt_state *istate)
     gdb_state.registers[GDB_CPU_I386_REG_FS]  = istate->fs;
     gdb_state.registers[GDB_CPU_I386_REG_GS]  = istate->gs;
 
+    /* Breakpoints with false conditions resume without a stop, stepping
+     * over a software one with the stub still held */
+    switch (gdb_x86_break_filter(&gdb_state, istate->vector, step,
+                                 &istate->eip, &istate->eflags)) {
+    case 1:
+        gdb_x86_smp_leave();
+        return;
+    case 2:
+        return;
+    }
+
+    /* Still inside a 'vCont;r' range, TF is still set, so just step again */
+    if (step && gdb_range_step_continue(&gdb_state)) {
+        gdb_x86_smp_leave();
+        return;
+    }
+
+    gdb_x86_smp_stopped_on();
+
+    /* Hold the other CPUs while gdb looks at the target, or in non-stop
+     * mode report this one alone */
+    if (!gdb_x86_smp_stop(istate)) {
+        return;
+    }
+
+#if GDB_PROFILE
+    if (istate->vector == GDB_X86_UART_VECTOR) {
+        gdb_x86_break_profile_end();
+    }
+#endif
+
     gdb_main(&gdb_state); // Not sure if this will cause problems seperated in h file here.
 
-    /* Restore Registers */
-    istate->eax    = gdb_state.registers[GDB_CPU_I386_REG_EAX];
-    istate->ecx    = gdb_state.registers[GDB_CPU_I386_REG_ECX];
-    istate->edx    = gdb_state.registers[GDB_CPU_I386_REG_EDX];
-    istate->ebx    = gdb_state.registers[GDB_CPU_I386_REG_EBX];
-    istate->esp    = gdb_state.registers[GDB_CPU_I386_REG_ESP];
-    istate->ebp    = gdb_state.registers[GDB_CPU_I386_REG_EBP];
-    istate->esi    = gdb_state.registers[GDB_CPU_I386_REG_ESI];
-    istate->edi    = gdb_state.registers[GDB_CPU_I386_REG_EDI];
-    istate->eip    = gdb_state.registers[GDB_CPU_I386_REG_PC];
-    istate->cs     = gdb_state.registers[GDB_CPU_I386_REG_CS];
-    istate->eflags = gdb_state.registers[GDB_CPU_I386_REG_PS];
-    istate->ss     = gdb_state.registers[GDB_CPU_I386_REG_SS];
-    istate->ds     = gdb_state.registers[GDB_CPU_I386_REG_DS];
-    istate->es     = gdb_state.registers[GDB_CPU_I386_REG_ES];
-    istate->fs     = gdb_state.registers[GDB_CPU_I386_REG_FS];
-    istate->gs     = gdb_state.registers[GDB_CPU_I386_REG_GS];
+    gdb_x86_finish(istate);
 }
@@ -0,0 +1,551 @@
+/*****************************************************************************
+ * Packet Engine Benchmark
+ ****************************************************************************/
+
+/*
+ * Host benchmark for the packet engine, on the mock architecture. Build and
+ * run it from the source directory with
+ *
+ *     make bench
+ *
+ * or run ./packet_benchmark [rounds] after 'make packet_benchmark'.
+ *
+ * Recorded sessions are replayed through gdb_input/gdb_output. The rings
+ * are made big enough for a whole session, which is written in before and
+ * the replies read out after, so the figures are for the stub alone and
+ * don't depend on how the host schedules threads. Each session reports
+ * packets/s and bytes/s both ways, latency percentiles per command from the
+ * GDB_PROFILE histograms, and heap allocations made while it ran.
+ * Reads of 4 KB, 64 KB and 1 MB, as 'dump memory' sends them, are then
+ * reported in target bytes read per second. The encoders, decoders,
+ * gdb_checksum() and gdb_strtol() are then timed on their own.
+ */
+
+#define GDBSTUB_ARCH_MOCK
+#define GDB_PROFILE 1
+
+/// Rings big enough for every session, in and out
+#define GDB_BUF_SIZE (1 << 22)
+
+/// Mock memory big enough for the largest read
+#define GDB_MOCK_MEM_SIZE 0x101000
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gdbstub.h"
+#include "string_processing.functions"
+#include "data_encoding_decoding.c"
+#include "communication_functions.c"
+#include "packet_functions.c"
+#include "packet_creation.c"
+#include "command_functions.h"
+#include "debugging_system_functions.c"
+
+/*****************************************************************************
+ * Target
+ ****************************************************************************/
+
+/*
+ * The mock target never runs: resuming returns straight to gdb_main(), as
+ * if it had trapped again at once.
+ */
+int gdb_sys_continue(struct gdb_state *state)
+{
+    return 0;
+}
+
+int gdb_sys_step(struct gdb_state *state)
+{
+    return 0;
+}
+
+/*****************************************************************************
+ * Allocation Counting
+ ****************************************************************************/
+
+/*
+ * With glibc, malloc() and friends are interposed to count the calls made
+ * while a session replays. The stub itself should never make one.
+ */
+static int bench_counting;
+static unsigned long bench_allocs;
+
+#ifdef __GLIBC__
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+    bench_allocs += bench_counting;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    bench_allocs += bench_counting;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    bench_allocs += bench_counting;
+    return __libc_realloc(ptr, size);
+}
+#define BENCH_ALLOCS_COUNTED 1
+#else
+#define BENCH_ALLOCS_COUNTED 0
+#endif
+
+/*****************************************************************************
+ * Sessions
+ ****************************************************************************/
+
+/// Largest memory transfer gdb puts in one packet, given our PacketSize
+#define BENCH_CHUNK ((GDB_PACKET_SIZE-32)/2)
+
+/// Start of the region the sessions dump and load
+#define BENCH_MEM_BASE 0x1000
+
+/// Size of the region the sessions dump and load
+#define BENCH_MEM_SIZE 0x8000
+
+/**
+ * @brief A session as gdb would send it, framed and ready to replay.
+ */
+struct bench_session {
+    const char   *name; ///< Name it is reported under
+    char         *buf;  ///< Framed packets, acknowledgements included
+    unsigned int  len;  ///< Bytes in buf
+    unsigned int  size; ///< Bytes allocated for buf
+    int           ack;  ///< Replies are still acknowledged
+};
+
+static void bench_put_raw(struct bench_session *s, const char *data,
+                          unsigned int len)
+{
+    if (s->len+len > s->size) {
+        s->size = (s->len+len)*2;
+        s->buf  = realloc(s->buf, s->size);
+    }
+    memcpy(s->buf+s->len, data, len);
+    s->len += len;
+}
+
+/*
+ * Frame one packet. Its reply is acknowledged until QStartNoAckMode, and
+ * the stop reply that follows a resume takes the place of the reply.
+ */
+static void bench_put_packet(struct bench_session *s, const char *pkt,
+                             unsigned int len)
+{
+    char trailer[4];
+
+    bench_put_raw(s, "$", 1);
+    bench_put_raw(s, pkt, len);
+    snprintf(trailer, sizeof(trailer), "#%02x",
+             gdb_checksum(pkt, len) & 0xff);
+    bench_put_raw(s, trailer, 3);
+    if (s->ack) {
+        bench_put_raw(s, "+", 1);
+    }
+    if (len == 15 && !memcmp(pkt, "QStartNoAckMode", 15)) {
+        s->ack = 0;
+    }
+}
+
+static void bench_put(struct bench_session *s, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void bench_put(struct bench_session *s, const char *fmt, ...)
+{
+    char pkt[GDB_PACKET_SIZE];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(pkt, sizeof(pkt), fmt, ap);
+    va_end(ap);
+    bench_put_packet(s, pkt, len);
+}
+
+/*
+ * Start a session the way gdb attaches: the stop reply gdb_main() sends on
+ * entry is acknowledged first.
+ */
+static void bench_begin(struct bench_session *s, const char *name)
+{
+    memset(s, 0, sizeof(*s));
+    s->name = name;
+    s->ack  = 1;
+    bench_put_raw(s, "+", 1);
+    bench_put(s, "qSupported:multiprocess+;swbreak+;hwbreak+;qRelocInsn+;"
+              "fork-events+;vfork-events+;exec-events+;vContSupported+;"
+              "QThreadEvents+;no-resumed+;binary-upload+");
+    bench_put(s, "QStartNoAckMode");
+    bench_put(s, "vMustReplyEmpty");
+    bench_put(s, "Hg0");
+    bench_put(s, "qTStatus");
+    bench_put(s, "?");
+    bench_put(s, "qfThreadInfo");
+    bench_put(s, "qsThreadInfo");
+    bench_put(s, "qAttached");
+    bench_put(s, "Hc-1");
+    bench_put(s, "qC");
+    bench_put(s, "qOffsets");
+    bench_put(s, "g");
+}
+
+/*
+ * Attach, unwind a few frames, detach.
+ */
+static void bench_attach(struct bench_session *s)
+{
+    unsigned int i;
+
+    bench_begin(s, "attach");
+    for (i = 0; i < 8; i++) {
+        bench_put(s, "m%x,40", BENCH_MEM_BASE+i*0x40);
+        bench_put(s, "m%x,4", BENCH_MEM_BASE+0x200+i*4);
+    }
+    bench_put(s, "qSymbol::");
+    bench_put(s, "D");
+
+    /* Detaching ends no-ack mode, so the stop reply the stub sends when the
+     * target traps again is acknowledged */
+    bench_put_raw(s, "+", 1);
+}
+
+/*
+ * Dump the region, as 'dump memory' does.
+ */
+static void bench_dump(struct bench_session *s)
+{
+    unsigned int pos, len;
+
+    bench_begin(s, "dump");
+    for (pos = 0; pos < BENCH_MEM_SIZE; pos += len) {
+        len = BENCH_MEM_SIZE-pos < BENCH_CHUNK ? BENCH_MEM_SIZE-pos :
+                                                  BENCH_CHUNK;
+        bench_put(s, "m%x,%x", BENCH_MEM_BASE+pos, len);
+    }
+}
+
+/*
+ * Dump the region with binary reads, as gdb does once it has seen
+ * binary-upload.
+ */
+static void bench_dump_bin(struct bench_session *s)
+{
+    unsigned int pos, len;
+
+    bench_begin(s, "dump x");
+    for (pos = 0; pos < BENCH_MEM_SIZE; pos += len) {
+        len = BENCH_MEM_SIZE-pos < BENCH_CHUNK ? BENCH_MEM_SIZE-pos :
+                                                  BENCH_CHUNK;
+        bench_put(s, "x%x,%x", BENCH_MEM_BASE+pos, len);
+    }
+}
+
+/*
+ * Read len bytes from the start of the region, as 'dump memory' does.
+ */
+static void bench_read(struct bench_session *s, const char *name,
+                       unsigned int len)
+{
+    unsigned int pos, chunk;
+
+    bench_begin(s, name);
+    for (pos = 0; pos < len; pos += chunk) {
+        chunk = len-pos < BENCH_CHUNK ? len-pos : BENCH_CHUNK;
+        bench_put(s, "m%x,%x", BENCH_MEM_BASE+pos, chunk);
+    }
+}
+
+/*
+ * Load the region twice, as 'restore' does with 'M' and 'load' with 'X'.
+ */
+static void bench_load(struct bench_session *s)
+{
+    static char data[BENCH_CHUNK];
+    char pkt[GDB_PACKET_SIZE];
+    unsigned int pos, len, i;
+    int size, n;
+
+    for (i = 0; i < sizeof(data); i++) {
+        data[i] = (char)(i*31+7);
+    }
+
+    bench_begin(s, "load");
+    for (pos = 0; pos < BENCH_MEM_SIZE; pos += len) {
+        len = BENCH_MEM_SIZE-pos < BENCH_CHUNK ? BENCH_MEM_SIZE-pos :
+                                                  BENCH_CHUNK;
+        size = snprintf(pkt, sizeof(pkt), "M%x,%x:", BENCH_MEM_BASE+pos, len);
+        gdb_enc_hex(pkt+size, sizeof(pkt)-size, data, len);
+        bench_put_packet(s, pkt, size+len*2);
+    }
+
+    /* 'X' payloads are escaped, so fewer bytes fit in one */
+    for (pos = 0; pos < BENCH_MEM_SIZE; pos += len) {
+        len = BENCH_MEM_SIZE-pos < BENCH_CHUNK ? BENCH_MEM_SIZE-pos :
+                                                  BENCH_CHUNK;
+        size = snprintf(pkt, sizeof(pkt), "X%x,%x:", BENCH_MEM_BASE+pos, len);
+        n = gdb_enc_bin(pkt+size, sizeof(pkt)-size, data, len);
+        bench_put_packet(s, pkt, size+n);
+    }
+}
+
+/*
+ * Step and continue across a dozen breakpoints, reading registers and the
+ * code around the PC at each stop, as stepping through a function does.
+ */
+static void bench_stepping(struct bench_session *s)
+{
+    unsigned int i, j, addr;
+
+    bench_begin(s, "stepping");
+    for (i = 0; i < 12; i++) {
+        bench_put(s, "Z0,%x,1", BENCH_MEM_BASE+i*0x40);
+    }
+    for (i = 0; i < 12; i++) {
+        addr = BENCH_MEM_BASE+i*0x40;
+        for (j = 0; j < 8; j++) {
+            bench_put(s, "s");
+            bench_put(s, "g");
+            bench_put(s, "m%x,10", addr+j*2);
+            bench_put(s, "p8");
+        }
+        bench_put(s, "z0,%x,1", addr);
+        bench_put(s, "vCont;c");
+        bench_put(s, "g");
+        bench_put(s, "m%x,40", addr);
+        bench_put(s, "Z0,%x,1", addr);
+    }
+    for (i = 0; i < 12; i++) {
+        bench_put(s, "z0,%x,1", BENCH_MEM_BASE+i*0x40);
+    }
+}
+
+/*****************************************************************************
+ * Replay
+ ****************************************************************************/
+
+/*
+ * Replay a session, as gdb, and report on it. Resuming the mock target just
+ * reenters gdb_main(), until the session runs out. Returns the nanoseconds
+ * all rounds took, or 0 if the session couldn't be replayed.
+ */
+static unsigned long bench_replay(struct bench_session *s, unsigned int rounds)
+{
+    static const char cmds[] = "?DHMXZcgmpqsvxz";
+    struct gdb_state state;
+    unsigned long start, elapsed, packets, rx_bytes, tx_bytes;
+    unsigned int round;
+    const char *cmd;
+    double secs;
+
+    memset(&gdb_profile, 0, sizeof(gdb_profile));
+    elapsed = packets = rx_bytes = tx_bytes = 0;
+    bench_allocs = 0;
+
+    for (round = 0; round < rounds; round++) {
+        memset(&gdb_input, 0, sizeof(gdb_input));
+        memset(&gdb_output, 0, sizeof(gdb_output));
+        memset(&gdb_stats, 0, sizeof(gdb_stats));
+        memset(&gdb_mock_stats, 0, sizeof(gdb_mock_stats));
+        memset(&state, 0, sizeof(state));
+        state.signum = 5;
+        gdb_no_ack_mode = 0;
+
+        if (gdb_buf_write_bulk(&gdb_input, s->buf, s->len) != s->len) {
+            printf("%-10s doesn't fit in GDB_BUF_SIZE\n", s->name);
+            return 0;
+        }
+        gdb_buf_close(&gdb_input);
+
+        bench_counting = 1;
+        start = gdb_sys_clock(&state);
+        while (gdb_main(&state) != GDB_EOF) {
+            /* Resumed, and trapped again at once */
+        }
+        elapsed += gdb_sys_clock(&state)-start;
+        bench_counting = 0;
+
+        packets  += gdb_stats.rx_packets;
+        rx_bytes += gdb_mock_stats.rx_bytes;
+        tx_bytes += gdb_mock_stats.tx_bytes;
+    }
+
+    secs = elapsed/1e9;
+    printf("%-10s %7lu packets %10.0f packets/s %8.1f MB/s in %8.1f MB/s out"
+           "  allocs %s%lu\n",
+           s->name, packets/rounds, packets/secs, rx_bytes/secs/1e6,
+           tx_bytes/secs/1e6, BENCH_ALLOCS_COUNTED ? "" : "uncounted ",
+           bench_allocs);
+    for (cmd = cmds; *cmd; cmd++) {
+        if (!gdb_profile_percentile(*cmd, 100)) {
+            continue;
+        }
+        printf("    %c  p50 <= %6lu ns  p90 <= %6lu ns  p99 <= %6lu ns\n",
+               *cmd, gdb_profile_percentile(*cmd, 50),
+               gdb_profile_percentile(*cmd, 90),
+               gdb_profile_percentile(*cmd, 99));
+    }
+    return elapsed;
+}
+
+/*
+ * Time reads of increasing size, each a session of its own.
+ */
+static void bench_reads(unsigned int rounds)
+{
+    static const struct {
+        const char   *name;
+        unsigned int  len;
+    } reads[] = {
+        { "read 4K",  4 << 10 },
+        { "read 64K", 64 << 10 },
+        { "read 1M",  1 << 20 },
+    };
+    struct bench_session s;
+    unsigned long elapsed;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(reads)/sizeof(reads[0]); i++) {
+        bench_read(&s, reads[i].name, reads[i].len);
+        elapsed = bench_replay(&s, rounds);
+        free(s.buf);
+        if (elapsed) {
+            printf("    %u bytes read %8.1f MB/s\n", reads[i].len,
+                   (double)reads[i].len*rounds/elapsed*1e3);
+        }
+    }
+}
+
+/*****************************************************************************
+ * Microbenchmarks
+ ****************************************************************************/
+
+/// Bytes run through each encoder and decoder per timing
+#define BENCH_CODEC_BYTES (64u << 20)
+
+static volatile int bench_sink;
+
+static void bench_report(const char *name, unsigned int len,
+                         unsigned long calls, unsigned long elapsed)
+{
+    printf("%-14s %5u bytes %8.1f ns/call %8.1f MB/s\n", name, len,
+           (double)elapsed/calls, (double)len*calls/elapsed*1e3);
+}
+
+static void bench_codecs(void)
+{
+    static char data[GDB_PACKET_SIZE], hex[2*GDB_PACKET_SIZE],
+                bin[2*GDB_PACKET_SIZE];
+    static const unsigned int sizes[] = { 16, 256, 2040 };
+    unsigned long start, calls, i;
+    unsigned int k, len;
+    int hex_len, bin_len;
+
+    for (i = 0; i < sizeof(data); i++) {
+        data[i] = (char)(i*131+(i >> 3));
+    }
+
+    for (k = 0; k < sizeof(sizes)/sizeof(sizes[0]); k++) {
+        len   = sizes[k];
+        calls = BENCH_CODEC_BYTES/len;
+        hex_len = gdb_enc_hex(hex, sizeof(hex), data, len);
+        bin_len = gdb_enc_bin(bin, sizeof(bin), data, len);
+
+        start = gdb_sys_clock(NULL);
+        for (i = 0; i < calls; i++) {
+            bench_sink = gdb_enc_hex(hex, sizeof(hex), data, len);
+        }
+        bench_report("gdb_enc_hex", len, calls, gdb_sys_clock(NULL)-start);
+
+        start = gdb_sys_clock(NULL);
+        for (i = 0; i < calls; i++) {
+            bench_sink = gdb_dec_hex(hex, hex_len, data, len);
+        }
+        bench_report("gdb_dec_hex", len, calls, gdb_sys_clock(NULL)-start);
+
+        start = gdb_sys_clock(NULL);
+        for (i = 0; i < calls; i++) {
+            bench_sink = gdb_enc_bin(bin, sizeof(bin), data, len);
+        }
+        bench_report("gdb_enc_bin", len, calls, gdb_sys_clock(NULL)-start);
+
+        start = gdb_sys_clock(NULL);
+        for (i = 0; i < calls; i++) {
+            bench_sink = gdb_dec_bin(bin, bin_len, data, len);
+        }
+        bench_report("gdb_dec_bin", len, calls, gdb_sys_clock(NULL)-start);
+
+        start = gdb_sys_clock(NULL);
+        for (i = 0; i < calls; i++) {
+            bench_sink = gdb_checksum(hex, len);
+        }
+        bench_report("gdb_checksum", len, calls, gdb_sys_clock(NULL)-start);
+    }
+}
+
+static void bench_strtol(void)
+{
+    static const char *const strs[] = { "0", "40", "1000", "deadbeef" };
+    unsigned long start, calls, i;
+    const char *end;
+    unsigned int k, len;
+
+    calls = 1ul << 24;
+    for (k = 0; k < sizeof(strs)/sizeof(strs[0]); k++) {
+        len = strlen(strs[k]);
+        start = gdb_sys_clock(NULL);
+        for (i = 0; i < calls; i++) {
+            bench_sink = gdb_strtol(strs[k], len, 16, &end);
+        }
+        bench_report("gdb_strtol", len, calls, gdb_sys_clock(NULL)-start);
+    }
+}
+
+/*****************************************************************************
+ * Main
+ ****************************************************************************/
+
+int main(int argc, char *argv[])
+{
+    struct bench_session sessions[5];
+    unsigned int rounds, i;
+
+    rounds = (argc > 1) ? strtoul(argv[1], NULL, 0) : 200;
+    if (!rounds) {
+        rounds = 1;
+    }
+
+    /* Give reads something run-length encoding can't shrink */
+    for (i = 0; i < sizeof(gdb_mock_mem); i++) {
+        gdb_mock_mem[i] = (char)(i*131+(i >> 3));
+    }
+
+    bench_attach(&sessions[0]);
+    bench_dump(&sessions[1]);
+    bench_dump_bin(&sessions[2]);
+    bench_load(&sessions[3]);
+    bench_stepping(&sessions[4]);
+
+    printf("Sessions, %u rounds each, latencies per command:\n", rounds);
+    for (i = 0; i < sizeof(sessions)/sizeof(sessions[0]); i++) {
+        bench_replay(&sessions[i], rounds);
+        free(sessions[i].buf);
+    }
+
+    printf("\nReads, %u rounds each:\n", rounds);
+    bench_reads(rounds);
+
+    printf("\nCodecs:\n");
+    bench_codecs();
+    bench_strtol();
+    return 0;
+}
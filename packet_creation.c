@@ -2,6 +2,158 @@
  * Packet Creation Helpers
  ****************************************************************************/
 
+/*
+ * Architectures with hardware breakpoints or watchpoints provide the
+ * gdb_sys_hw_break_*() hooks, set GDB_HAVE_SYS_HW_BREAK and list the 'Z'
+ * types they handle in GDB_HW_BREAK_TYPES, one bit per type.
+ *
+ * gdb_sys_hw_break_set() returns GDB_EOF when it runs out of resources, and
+ * gdb_sys_hw_break_hit() returns the type of the breakpoint or watchpoint
+ * that stopped the target, 0 if none, and sets addr to its address.
+ */
+#define GDB_HW_BREAK_EXEC   1 ///< 'Z1' hardware breakpoint
+#define GDB_HW_WATCH_WRITE  2 ///< 'Z2' write watchpoint
+#define GDB_HW_WATCH_READ   3 ///< 'Z3' read watchpoint
+#define GDB_HW_WATCH_ACCESS 4 ///< 'Z4' access watchpoint
+
+#ifndef GDB_HAVE_SYS_HW_BREAK
+#ifdef GDBSTUB_ARCH_X86
+#define GDB_HAVE_SYS_HW_BREAK 1
+#else
+#define GDB_HAVE_SYS_HW_BREAK 0
+#endif
+#endif
+
+#if GDB_HAVE_SYS_HW_BREAK
+#ifndef GDB_HW_BREAK_TYPES
+/* x86 debug registers can't trap reads alone */
+#define GDB_HW_BREAK_TYPES ((1<<GDB_HW_BREAK_EXEC)  | \
+                            (1<<GDB_HW_WATCH_WRITE) | \
+                            (1<<GDB_HW_WATCH_ACCESS))
+#endif
+
+int gdb_sys_hw_break_set(struct gdb_state *state, unsigned int type,
+                         address addr, unsigned int len);
+int gdb_sys_hw_break_clear(struct gdb_state *state, unsigned int type,
+                           address addr, unsigned int len);
+unsigned int gdb_sys_hw_break_hit(struct gdb_state *state, address *addr);
+#else
+#define GDB_HW_BREAK_TYPES 0
+#endif
+
+/*
+ * Architectures that evaluate breakpoint conditions, by calling
+ * gdb_break_cond_check() from their breakpoint trap, set
+ * GDB_HAVE_SYS_BREAK_COND. Only then are conditions offered to gdb, which
+ * otherwise evaluates them itself.
+ */
+#ifndef GDB_HAVE_SYS_BREAK_COND
+#ifdef GDBSTUB_ARCH_X86
+#define GDB_HAVE_SYS_BREAK_COND 1
+#else
+#define GDB_HAVE_SYS_BREAK_COND 0
+#endif
+#endif
+
+/*
+ * Architectures that can keep some CPUs stopped while the others run set
+ * GDB_HAVE_SYS_NONSTOP, see the non-stop commands for the hooks it needs.
+ */
+#ifndef GDB_HAVE_SYS_NONSTOP
+#ifdef GDBSTUB_ARCH_X86
+#define GDB_HAVE_SYS_NONSTOP 1
+#else
+#define GDB_HAVE_SYS_NONSTOP 0
+#endif
+#endif
+
+/*
+ * Optional commands come in features, each built in while its GDB_FEATURE_*
+ * macro is 1. A small stub, such as one in boot firmware, sets the ones it
+ * doesn't need to 0 in its configuration: their commands are left out of the
+ * dispatch tables, their handlers and the helpers only those use out of the
+ * build, and qSupported stops advertising them. gdb gets the empty reply
+ * for a left out command, which tells it the command is unsupported.
+ */
+#ifndef GDB_FEATURE_NO_ACK
+#define GDB_FEATURE_NO_ACK 1  ///< 'QStartNoAckMode'
+#endif
+
+#ifndef GDB_FEATURE_MEM_BIN
+#define GDB_FEATURE_MEM_BIN 1 ///< 'X' and 'x', binary memory transfers
+#endif
+
+#ifndef GDB_FEATURE_BREAK
+#define GDB_FEATURE_BREAK 1   ///< 'Z' and 'z', breakpoints and watchpoints
+#endif
+
+#ifndef GDB_FEATURE_TRACE
+#define GDB_FEATURE_TRACE 1   ///< 'QT' and 'qT', tracepoints
+#endif
+
+#ifndef GDB_FEATURE_THREADS
+#define GDB_FEATURE_THREADS 1 ///< Thread list and selection, with GDB_HAVE_SYS_CPUS
+#endif
+
+#ifndef GDB_FEATURE_VCONT
+#define GDB_FEATURE_VCONT 1   ///< 'vCont', per-thread and range stepping
+#endif
+
+#ifndef GDB_FEATURE_NONSTOP
+#define GDB_FEATURE_NONSTOP GDB_HAVE_SYS_NONSTOP ///< 'QNonStop' and 'vStopped'
+#endif
+
+#if GDB_HAVE_SYS_NONSTOP
+/// Largest notification, framing included
+#ifndef GDB_NOTIFY_SIZE
+#define GDB_NOTIFY_SIZE 64
+#endif
+
+/**
+ * @brief Transmit an asynchronous notification.
+ *
+ * Notification structure: %<name>:<data>#<checksum>
+ *
+ * Notifications are never acknowledged, so there is nothing to wait for and
+ * nothing to resend. They are framed in a buffer of their own rather than
+ * the staging buffer: one can go out while the stub waits for the
+ * acknowledgement of a reply, which must stay staged in case it is resent.
+ *
+ * @param state Pointer to the gdb_state structure containing debugging state information.
+ * @param name Notification name, e.g. "Stop".
+ * @param data Pointer to the notification data.
+ * @param len Length of the notification data.
+ * @return 0 if the notification was transmitted, GDB_EOF otherwise.
+ */
+static int gdb_send_notification(struct gdb_state *state, const char *name,
+                                 const char *data, unsigned int len)
+{
+    char buf[GDB_NOTIFY_SIZE];
+    unsigned int name_len, size;
+    char csum;
+
+    name_len = gdb_strlen(name);
+    if (name_len+len+5 > sizeof(buf)) {
+        return GDB_EOF;
+    }
+
+    buf[0] = '%';
+    gdb_memcpy(buf+1, name, name_len);
+    buf[1+name_len] = ':';
+    gdb_memcpy(buf+2+name_len, data, len);
+    size = 2+name_len+len;
+
+    csum = gdb_checksum(buf+1, size-1);
+    buf[size] = '#';
+    gdb_enc_hex(buf+size+1, 2, &csum, 1);
+    size += 3;
+
+    gdb_stats.tx_packets += 1;
+    gdb_stats.tx_bytes += size;
+    return gdb_write(state, buf, size);
+}
+#endif
+
 /**
  * @brief Send an 'OK' packet to the debugging console.
  *
@@ -51,7 +203,120 @@ static int gdb_send_signal_packet(struct gdb_state *state, char *buf,
     unsigned int size;
     int status;
 
-    // ... (your code here)
+    if (buf_len < 3) {
+        /* Buffer too small */
+        return GDB_EOF;
+    }
+
+    buf[0] = 'S';
+    size = 1;
+
+    status = gdb_enc_hex(buf+size, buf_len-size, &signal, 1);
+    if (status == GDB_EOF) {
+        return GDB_EOF;
+    }
+    size += status;
+
+    return gdb_send_packet(state, buf, size);
+}
+
+/**
+ * @brief Format a stop reply using the 'T AA reason:r;thread:t;' format.
+ *
+ * The same text is the payload of a non-stop "%Stop" notification.
+ *
+ * @param buf The buffer to format into.
+ * @param buf_len The length of the buffer.
+ * @param signal The signal code.
+ * @param reason The stop reason, such as "watch" or "hwbreak", or NULL for none.
+ * @param addr The address that goes with the reason, or NULL for none.
+ * @param thread The thread that stopped, or 0 to leave it out.
+ * @return Length of the stop reply, or GDB_EOF if it does not fit.
+ */
+static int gdb_fmt_stop_packet(char *buf, unsigned int buf_len, char signal,
+                               const char *reason, const address *addr,
+                               int thread)
+{
+    unsigned int size;
+    int status;
+
+    if (buf_len < 3) {
+        /* Buffer too small */
+        return GDB_EOF;
+    }
+
+    buf[0] = 'T';
+    size = 1;
+
+    status = gdb_enc_hex(buf+size, buf_len-size, &signal, 1);
+    if (status == GDB_EOF) {
+        return GDB_EOF;
+    }
+    size += status;
+
+    if (reason) {
+        status = gdb_strcpy(buf+size, buf_len-size, reason);
+        if (status == GDB_EOF || size+status >= buf_len) {
+            return GDB_EOF;
+        }
+        size += status;
+        buf[size++] = ':';
+
+        if (addr) {
+            status = gdb_utoa(buf+size, buf_len-size, *addr, 16);
+            if (status == GDB_EOF) {
+                return GDB_EOF;
+            }
+            size += status;
+        }
+
+        if (size >= buf_len) {
+            return GDB_EOF;
+        }
+        buf[size++] = ';';
+    }
+
+    if (thread) {
+        status = gdb_strcpy(buf+size, buf_len-size, "thread:");
+        if (status == GDB_EOF) {
+            return GDB_EOF;
+        }
+        size += status;
+
+        status = gdb_utoa(buf+size, buf_len-size, thread, 16);
+        if (status == GDB_EOF || size+status >= buf_len) {
+            return GDB_EOF;
+        }
+        size += status;
+        buf[size++] = ';';
+    }
+
+    return size;
+}
+
+/**
+ * @brief Send a stop reply using the 'T AA reason:r;thread:t;' format.
+ *
+ * @param state The gdb_state structure containing debugging state information.
+ * @param buf The buffer used to store packet data.
+ * @param buf_len The length of the buffer.
+ * @param signal The signal code.
+ * @param reason The stop reason, such as "watch" or "hwbreak", or NULL for none.
+ * @param addr The address that goes with the reason, or NULL for none.
+ * @param thread The thread that stopped, or 0 to leave it out.
+ * @return Status of the packet sending operation.
+ */
+static int gdb_send_stop_packet(struct gdb_state *state, char *buf,
+                                unsigned int buf_len, char signal,
+                                const char *reason, const address *addr,
+                                int thread)
+{
+    int size;
+
+    size = gdb_fmt_stop_packet(buf, buf_len, signal, reason, addr, thread);
+    if (size == GDB_EOF) {
+        return GDB_EOF;
+    }
 
     return gdb_send_packet(state, buf, size);
 }
@@ -71,7 +336,106 @@ static int gdb_send_error_packet(struct gdb_state *state, char *buf,
     unsigned int size;
     int status;
 
-    // ... (your code here)
+    if (buf_len < 3) {
+        /* Buffer too small */
+        return GDB_EOF;
+    }
+
+    buf[0] = 'E';
+    size = 1;
+
+    status = gdb_enc_hex(buf+size, buf_len-size, &error, 1);
+    if (status == GDB_EOF) {
+        return GDB_EOF;
+    }
+    size += status;
+
+    return gdb_send_packet(state, buf, size);
+}
+
+/**
+ * @brief Send the reply to 'qSupported' listing the features of this stub.
+ *
+ * @param state The gdb_state structure containing debugging state information.
+ * @param buf The buffer used to store packet data.
+ * @param buf_len The length of the buffer.
+ * @return Status of the packet sending operation.
+ */
+static int gdb_send_supported_packet(struct gdb_state *state, char *buf,
+                                     unsigned int buf_len)
+{
+    unsigned int size;
+    int status;
+
+    /* Let gdb fill the receive buffer with 'M' and 'X' packets */
+    status = gdb_strcpy(buf, buf_len, "PacketSize=");
+    if (status == GDB_EOF) {
+        return GDB_EOF;
+    }
+    size = status;
+
+    status = gdb_utoa(buf+size, buf_len-size, GDB_PACKET_SIZE, 16);
+    if (status == GDB_EOF) {
+        return GDB_EOF;
+    }
+    size += status;
+
+#if GDB_FEATURE_MEM_BIN
+    /* Binary memory reads through 'x' */
+    status = gdb_strcpy(buf+size, buf_len-size, ";binary-upload+");
+    if (status == GDB_EOF) {
+        return GDB_EOF;
+    }
+    size += status;
+#endif
+
+#if GDB_FEATURE_NO_ACK
+    /* Skip acknowledgements on reliable links */
+    status = gdb_strcpy(buf+size, buf_len-size, ";QStartNoAckMode+");
+    if (status == GDB_EOF) {
+        return GDB_EOF;
+    }
+    size += status;
+#endif
+
+#if GDB_FEATURE_BREAK
+#if GDB_HW_BREAK_TYPES & (1<<GDB_HW_BREAK_EXEC)
+    /* Stop replies may name a hardware breakpoint hit */
+    status = gdb_strcpy(buf+size, buf_len-size, ";hwbreak+");
+    if (status == GDB_EOF) {
+        return GDB_EOF;
+    }
+    size += status;
+#endif
+
+#if GDB_HAVE_SYS_BREAK_COND
+    /* Breakpoint conditions are evaluated on the target */
+    status = gdb_strcpy(buf+size, buf_len-size, ";ConditionalBreakpoints+");
+    if (status == GDB_EOF) {
+        return GDB_EOF;
+    }
+    size += status;
+#endif
+#endif
+
+#if GDB_FEATURE_TRACE
+    /* Tracepoint conditions and the tracenz opcode as well */
+    status = gdb_strcpy(buf+size, buf_len-size,
+                        ";ConditionalTracepoints+;tracenz+");
+    if (status == GDB_EOF) {
+        return GDB_EOF;
+    }
+    size += status;
+#endif
+
+#if GDB_FEATURE_NONSTOP
+    /* Threads can stop and resume independently */
+    status = gdb_strcpy(buf+size, buf_len-size, ";QNonStop+");
+    if (status == GDB_EOF) {
+        return GDB_EOF;
+    }
+    size += status;
+#endif
 
     return gdb_send_packet(state, buf, size);
 }
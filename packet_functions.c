@@ -15,7 +15,7 @@ static int gdb_recv_ack(struct gdb_state *state)
     int response;
 
     /* Wait for packet ack */
-    switch (response = gdb_sys_getc(state)) {
+    switch (response = gdb_rx_getc(state)) {
     case '+':
         /* Packet acknowledged */
         return 0;
@@ -32,6 +32,8 @@ static int gdb_recv_ack(struct gdb_state *state)
 /**
  * @brief Calculate 8-bit checksum of a buffer.
  *
+ * Whole blocks are summed lane-wise with the vector kernels when available.
+ *
  * @param buf Pointer to the buffer.
  * @param len Length of the buffer.
  * @return 8-bit checksum of the buffer.
@@ -39,9 +41,23 @@ static int gdb_recv_ack(struct gdb_state *state)
 static int gdb_checksum(const char *buf, unsigned int len)
 {
     unsigned char csum;
+#ifdef GDB_SIMD_BLOCK
+    gdb_simd_sum block_sum;
+#endif
 
     csum = 0;
 
+#ifdef GDB_SIMD_BLOCK
+    if (len >= GDB_SIMD_BLOCK) {
+        block_sum = gdb_block_sum_zero();
+        for (; len >= GDB_SIMD_BLOCK; len -= GDB_SIMD_BLOCK) {
+            block_sum = gdb_block_sum(block_sum, buf);
+            buf += GDB_SIMD_BLOCK;
+        }
+        csum = gdb_block_sum_fold(block_sum);
+    }
+#endif
+
     while (len--) {
         csum += *buf++;
     }
@@ -49,141 +65,570 @@ static int gdb_checksum(const char *buf, unsigned int len)
     return csum;
 }
 
+/// Run-length encode replies once the debugger has negotiated its features
+#ifndef GDB_USE_RLE
+#define GDB_USE_RLE 1
+#endif
+
 /**
- * @brief Transmit a packet of data.
+ * @brief Packet engine counters.
+ */
+struct gdb_stats {
+    unsigned long tx_packets; ///< Packets sent
+    unsigned long tx_bytes;   ///< Bytes sent, including framing
+    unsigned long rx_packets; ///< Packets received with a valid checksum
+    unsigned long rle_saved;  ///< Bytes saved by run-length encoding
+};
+
+static struct gdb_stats gdb_stats;
+
+/// Record per-command latency histograms, timed with the gdb_sys_clock() hook
+#ifndef GDB_PROFILE
+#define GDB_PROFILE 0
+#endif
+
+#if GDB_PROFILE
+
+/// Number of power-of-two latency buckets kept per command
+#define GDB_PROFILE_BUCKETS 32
+
+unsigned long gdb_sys_clock(struct gdb_state *state);
+
+/**
+ * @brief Per-command latency histograms.
  *
- * Packet structure: $<packet-data>#<checksum>
+ * A command is timed from receipt of its packet to the next call to
+ * gdb_recv_packet(), so the figure covers both handling and the reply.
+ * Commands that resume the target are left out, as that time is mostly the
+ * target running. Commands are keyed by their first byte.
+ */
+struct gdb_profile {
+    unsigned long start; ///< Clock when the current command was received
+    unsigned int cmd;    ///< First byte of the current command
+    int active;          ///< Nonzero while a command is being timed
+    unsigned long hist[128][GDB_PROFILE_BUCKETS]; ///< Counts by command and log2 of latency
+};
+
+static struct gdb_profile gdb_profile;
+
+/**
+ * @brief Stop timing the current command and add it to its histogram.
  *
  * @param state Pointer to the gdb_state structure containing debugging state information.
- * @param pkt_data Pointer to the packet data.
- * @param pkt_len Length of the packet data.
- * @return 0 if the packet was transmitted and acknowledged, 1 if not acknowledged, GDB_EOF otherwise.
  */
-static int gdb_send_packet(struct gdb_state *state, const char *pkt_data,
-                           unsigned int pkt_len)
+static void gdb_profile_end(struct gdb_state *state)
 {
-    char buf[3];
-    char csum;
+    unsigned long delta;
+    unsigned int bucket;
 
-    /* Send packet start */
-    if (gdb_sys_putchar(state, '$') == GDB_EOF) {
-        return GDB_EOF;
+    if (!gdb_profile.active) {
+        return;
+    }
+
+    delta = gdb_sys_clock(state) - gdb_profile.start;
+    for (bucket = 0; delta > 1 && bucket < GDB_PROFILE_BUCKETS-1; bucket++) {
+        delta >>= 1;
+    }
+    gdb_profile.hist[gdb_profile.cmd][bucket] += 1;
+    gdb_profile.active = 0;
+}
+
+/**
+ * @brief Stop timing the current command without recording it.
+ */
+static void gdb_profile_cancel(void)
+{
+    gdb_profile.active = 0;
+}
+
+/**
+ * @brief Estimate a latency percentile for one command.
+ *
+ * @param cmd First byte of the command.
+ * @param pct Percentile, 1-100.
+ * @return Upper bound of the bucket holding the percentile, in
+ *         gdb_sys_clock() ticks, or 0 if the command was never seen.
+ */
+static unsigned long gdb_profile_percentile(int cmd, unsigned int pct)
+{
+    unsigned long total, target, seen;
+    unsigned int bucket;
+
+    total = 0;
+    for (bucket = 0; bucket < GDB_PROFILE_BUCKETS; bucket++) {
+        total += gdb_profile.hist[cmd & 0x7f][bucket];
+    }
+    if (total == 0) {
+        return 0;
     }
 
+    target = (total*pct + 99)/100;
+    seen = 0;
+    for (bucket = 0; bucket < GDB_PROFILE_BUCKETS-1; bucket++) {
+        seen += gdb_profile.hist[cmd & 0x7f][bucket];
+        if (seen >= target) {
+            break;
+        }
+    }
+    return 2UL << bucket;
+}
+
+#endif /* GDB_PROFILE */
+
+/// Nonzero once QStartNoAckMode is in effect; packets are no longer acknowledged
+static int gdb_no_ack_mode;
+
+/// Times a packet that fits the staging buffer is resent after a NACK
+#ifndef GDB_TX_RETRIES
+#define GDB_TX_RETRIES 3
+#endif
+
+/// Size of the transmit staging buffer, including the "$" and "#xx" framing
+#ifndef GDB_TX_BUF_SIZE
+#define GDB_TX_BUF_SIZE 1024
+#endif
+
+/// Smallest amount of free staging space worth encoding into before a flush
+#define GDB_TX_MIN_SPACE 32
+
+/**
+ * @brief Transmit staging buffer.
+ *
+ * Outgoing packets are framed here so that a whole "$<data>#<checksum>"
+ * reaches the transport in a single gdb_write() call. Replies larger than the
+ * buffer are streamed: the staged part is flushed and the checksum carries
+ * over until gdb_tx_end().
+ */
+struct gdb_tx_buf {
+    char          buf[GDB_TX_BUF_SIZE];
+    unsigned int  pos;      ///< Offset of the next free byte
+    unsigned int  start;    ///< Offset of the packet data not yet sent
+    unsigned char csum;     ///< Running checksum of the packet data
+    unsigned char rle_csum; ///< Running checksum of the run-length encoded data
+    int           rle;      ///< Run-length encode packet data before sending
+};
+
+static struct gdb_tx_buf gdb_tx;
+
+/**
+ * @brief Start a new outgoing packet.
+ */
+static void gdb_tx_begin(void)
+{
+    gdb_tx.buf[0]   = '$';
+    gdb_tx.pos      = 1;
+    gdb_tx.start    = 1;
+    gdb_tx.csum     = 0;
+    gdb_tx.rle_csum = 0;
+
+#if DEBUG
+    GDB_PRINT("-> ");
+#endif
+}
+
+/**
+ * @brief Free space in the staging buffer, keeping room for the trailer.
+ *
+ * Packet data may be encoded directly at gdb_tx.buf+gdb_tx.pos and then
+ * accounted for with gdb_tx_commit().
+ *
+ * @return Number of packet data bytes that fit before a flush is needed.
+ */
+static unsigned int gdb_tx_space(void)
+{
+    return sizeof(gdb_tx.buf)-3-gdb_tx.pos;
+}
+
+/**
+ * @brief Account for len bytes of packet data placed at gdb_tx.buf+gdb_tx.pos
+ * whose checksum the producer has already added to gdb_tx.csum.
+ *
+ * @param len Number of bytes placed.
+ */
+static void gdb_tx_commit_summed(unsigned int len)
+{
 #if DEBUG
     {
         unsigned int p;
-        GDB_PRINT("-> ");
-        for (p = 0; p < pkt_len; p++) {
-            if (gdb_is_printable_char(pkt_data[p])) {
-                GDB_PRINT("%c", pkt_data[p]);
+        for (p = gdb_tx.pos; p < gdb_tx.pos+len; p++) {
+            if (gdb_is_printable_char(gdb_tx.buf[p])) {
+                GDB_PRINT("%c", gdb_tx.buf[p]);
             } else {
-                GDB_PRINT("\\x%02x", pkt_data[p]&0xff);
+                GDB_PRINT("\\x%02x", gdb_tx.buf[p]&0xff);
             }
         }
-        GDB_PRINT("\n");
     }
 #endif
 
-    /* Send packet data */
-    if (gdb_write(state, pkt_data, pkt_len) == GDB_EOF) {
-        return GDB_EOF;
+    gdb_tx.pos += len;
+}
+
+/**
+ * @brief Account for len bytes of packet data placed at gdb_tx.buf+gdb_tx.pos.
+ *
+ * @param len Number of bytes placed.
+ */
+static void gdb_tx_commit(unsigned int len)
+{
+    gdb_tx.csum += gdb_checksum(gdb_tx.buf+gdb_tx.pos, len);
+    gdb_tx_commit_summed(len);
+}
+
+/**
+ * @brief Copy packet data into the staging buffer, summing it on the way.
+ *
+ * @param data Pointer to the packet data.
+ * @param len Length of the packet data, at most gdb_tx_space().
+ */
+static void gdb_tx_copy(const char *data, unsigned int len)
+{
+    unsigned int pos;
+    unsigned char csum;
+    char *out;
+
+    out  = gdb_tx.buf+gdb_tx.pos;
+    csum = 0;
+    for (pos = 0; pos < len; pos++) {
+        out[pos] = data[pos];
+        csum += data[pos];
     }
 
-    /* Send the checksum */
-    buf[0] = '#';
-    csum = gdb_checksum(pkt_data, pkt_len);
-    if ((gdb_enc_hex(buf+1, sizeof(buf)-1, &csum, 1) == GDB_EOF) ||
-        (gdb_write(state, buf, sizeof(buf)) == GDB_EOF)) {
-        return GDB_EOF;
+    gdb_tx.csum += csum;
+    gdb_tx_commit_summed(len);
+}
+
+/**
+ * @brief Run-length encode the packet data staged since the last flush.
+ *
+ * Runs that straddle a flush are encoded as two runs.
+ */
+static void gdb_tx_pack(void)
+{
+    unsigned int len;
+
+    if (!gdb_tx.rle) {
+        return;
     }
 
-    return gdb_recv_ack(state);
+    len = gdb_enc_rle_csum(gdb_tx.buf+gdb_tx.start, gdb_tx.pos-gdb_tx.start,
+                           &gdb_tx.rle_csum);
+    gdb_stats.rle_saved += gdb_tx.pos-gdb_tx.start-len;
+    gdb_tx.pos = gdb_tx.start+len;
 }
 
 /**
- * @brief Receive a packet of data, assuming a 7-bit clean connection.
+ * @brief Send the staging buffer as is.
  *
  * @param state Pointer to the gdb_state structure containing debugging state information.
- * @param pkt_buf Buffer to store the received packet data.
- * @param pkt_buf_len Length of the buffer.
- * @param pkt_len Length of the received packet.
- * @return 0 if the packet was received successfully, GDB_EOF otherwise.
+ * @return 0 on success, GDB_EOF otherwise.
  */
-static int gdb_recv_packet(struct gdb_state *state, char *pkt_buf,
-                           unsigned int pkt_buf_len, unsigned int *pkt_len)
+static int gdb_tx_send(struct gdb_state *state)
 {
-    int data;
-    char expected_csum, actual_csum;
-    char buf[2];
+    unsigned int len;
 
-    /* Wait for packet start */
-    actual_csum = 0;
+    len = gdb_tx.pos;
+    gdb_tx.pos   = 0;
+    gdb_tx.start = 0;
+    gdb_stats.tx_bytes += len;
+    return gdb_write(state, gdb_tx.buf, len);
+}
 
-    while (1) {
-        data = gdb_sys_getc(state);
-        if (data == GDB_EOF) {
+/**
+ * @brief Send everything staged so far.
+ *
+ * @param state Pointer to the gdb_state structure containing debugging state information.
+ * @return 0 on success, GDB_EOF otherwise.
+ */
+static int gdb_tx_flush(struct gdb_state *state)
+{
+    gdb_tx_pack();
+    return gdb_tx_send(state);
+}
+
+/**
+ * @brief Append packet data, flushing as the staging buffer fills up.
+ *
+ * @param state Pointer to the gdb_state structure containing debugging state information.
+ * @param data Pointer to the packet data.
+ * @param len Length of the packet data.
+ * @return 0 on success, GDB_EOF otherwise.
+ */
+static int gdb_tx_data(struct gdb_state *state, const char *data,
+                       unsigned int len)
+{
+    unsigned int chunk;
+
+    while (len) {
+        chunk = gdb_tx_space();
+        if (chunk == 0) {
+            if (gdb_tx_flush(state) == GDB_EOF) {
+                return GDB_EOF;
+            }
+            continue;
+        }
+        if (chunk > len) {
+            chunk = len;
+        }
+        gdb_tx_copy(data, chunk);
+        data += chunk;
+        len  -= chunk;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Finish the outgoing packet and wait for it to be acknowledged.
+ *
+ * A packet that was never flushed is still whole in the staging buffer and is
+ * resent when the debugger answers with a NACK. A streamed packet is gone by
+ * then, so 1 is returned straight away and its producer has to generate it
+ * again, see gdb_tx_resend(). In no-ack mode there is nothing to wait for.
+ *
+ * @param state Pointer to the gdb_state structure containing debugging state information.
+ * @return 0 if the packet was transmitted and acknowledged, 1 if not acknowledged, GDB_EOF otherwise.
+ */
+static int gdb_tx_end(struct gdb_state *state)
+{
+    unsigned int len, tries;
+    int status, whole;
+    char csum;
+
+#if DEBUG
+    GDB_PRINT("\n");
+#endif
+
+    gdb_tx_pack();
+
+    /* Stage the checksum, gdb_tx_space() always leaves room for it */
+    csum = gdb_tx.rle ? gdb_tx.rle_csum : gdb_tx.csum;
+    gdb_tx.buf[gdb_tx.pos++] = '#';
+    gdb_enc_hex(gdb_tx.buf+gdb_tx.pos, 2, &csum, 1);
+    gdb_tx.pos += 2;
+
+    /* Send the rest of the framed packet */
+    gdb_stats.tx_packets += 1;
+    whole = (gdb_tx.start != 0);
+    len   = gdb_tx.pos;
+    for (tries = 0; ; tries++) {
+        gdb_tx.pos = len;
+        if (gdb_tx_send(state) == GDB_EOF) {
             return GDB_EOF;
-        } else if (data == '$') {
-            /* Detected start of packet. */
-            break;
         }
+
+        if (gdb_no_ack_mode) {
+            return 0;
+        }
+
+        status = gdb_recv_ack(state);
+        if (status != 1 || !whole || tries >= GDB_TX_RETRIES) {
+            return status;
+        }
+
+        /* Negative acknowledgement, retransmit */
+        GDB_PRINT("retransmitting packet\n");
     }
+}
 
-    /* Read until checksum */
-    *pkt_len = 0;
-    while (1) {
-        data = gdb_sys_getc(state);
+/**
+ * @brief Whether a packet that gdb_tx_end() reported as not acknowledged
+ * should be generated and sent again.
+ *
+ * @param status Return value of gdb_tx_end().
+ * @param streamed Nonzero if the packet was flushed before gdb_tx_end().
+ * @param tries Number of times the packet was generated again so far.
+ * @return Nonzero if the packet should be sent again.
+ */
+static int gdb_tx_resend(int status, int streamed, unsigned int tries)
+{
+    if (status != 1 || !streamed || tries >= GDB_TX_RETRIES) {
+        return 0;
+    }
 
-        if (data == GDB_EOF) {
-            /* Error receiving character */
+    GDB_PRINT("regenerating packet\n");
+    return 1;
+}
+
+/**
+ * @brief Transmit a packet of data.
+ *
+ * Packet structure: $<packet-data>#<checksum>
+ *
+ * The packet is framed in the staging buffer and handed to the transport in
+ * one call. Packets larger than the staging buffer are sent in buffer-sized
+ * chunks, and sent again from the start if the debugger NACKs them.
+ *
+ * @param state Pointer to the gdb_state structure containing debugging state information.
+ * @param pkt_data Pointer to the packet data.
+ * @param pkt_len Length of the packet data.
+ * @return 0 if the packet was transmitted and acknowledged, 1 if not acknowledged, GDB_EOF otherwise.
+ */
+static int gdb_send_packet(struct gdb_state *state, const char *pkt_data,
+                           unsigned int pkt_len)
+{
+    unsigned int tries;
+    int status, streamed;
+
+    for (tries = 0; ; tries++) {
+        gdb_tx_begin();
+
+        if (gdb_tx_data(state, pkt_data, pkt_len) == GDB_EOF) {
             return GDB_EOF;
-        } else if (data == '#') {
-            /* End of packet */
+        }
+
+        streamed = (gdb_tx.start == 0);
+        status   = gdb_tx_end(state);
+        if (!gdb_tx_resend(status, streamed, tries)) {
+            return status;
+        }
+    }
+}
+
+/**
+ * @brief Wait for a complete frame in the receive buffer.
+ *
+ * Anything in front of the frame's '$' is discarded. On return the frame
+ * starts at gdb_rx.head; it is only moved to the front of the buffer if it
+ * needs the room to grow into.
+ *
+ * @param state Pointer to the gdb_state structure containing debugging state information.
+ * @return Offset of the frame's '#', followed by both checksum digits, or GDB_EOF.
+ */
+static int gdb_rx_frame(struct gdb_state *state)
+{
+    const char *ptr;
+    unsigned int scan;
+
+    /* Wait for packet start, discarding anything in front of it */
+    while (1) {
+        ptr = gdb_memchr(gdb_rx.buf+gdb_rx.head, '$',
+                         gdb_rx.tail-gdb_rx.head);
+        if (ptr) {
+            /* Detected start of packet. */
+            gdb_rx.head = ptr-gdb_rx.buf;
             break;
+        }
+
+        gdb_rx.head = gdb_rx.tail = 0;
+        if (gdb_rx_fill(state) == GDB_EOF) {
+            return GDB_EOF;
+        }
+    }
+
+    /* Read until the end of packet and both checksum digits are present */
+    scan = gdb_rx.head+1;
+    while (1) {
+        ptr = gdb_memchr(gdb_rx.buf+scan, '#', gdb_rx.tail-scan);
+        if (ptr) {
+            scan = ptr-gdb_rx.buf;
+            if (scan+3 <= gdb_rx.tail) {
+                /* End of packet */
+                return scan;
+            }
         } else {
-            /* Check for space */
-            if (*pkt_len >= pkt_buf_len) {
+            scan = gdb_rx.tail;
+        }
+
+        if (gdb_rx.tail >= sizeof(gdb_rx.buf)) {
+            if (gdb_rx.head == 0) {
                 GDB_PRINT("packet buffer overflow\n");
+                gdb_rx.head = gdb_rx.tail = 0;
                 return GDB_EOF;
             }
 
-            /* Store character and update checksum */
-            pkt_buf[(*pkt_len)++] = (char) data;
+            /* Give the frame the whole buffer to grow into */
+            scan -= gdb_rx.head;
+            gdb_rx_compact();
+        }
+
+        if (gdb_rx_fill(state) == GDB_EOF) {
+            /* Error receiving character */
+            return GDB_EOF;
         }
     }
+}
+
+/**
+ * @brief Receive a packet of data, assuming a 7-bit clean connection.
+ *
+ * The packet is framed in place in the receive buffer. The returned pointer
+ * stays valid, and may be modified by the caller, until the next call to
+ * gdb_recv_packet(). Packets with a bad checksum are NACKed, unless in no-ack
+ * mode, and skipped.
+ *
+ * @param state Pointer to the gdb_state structure containing debugging state information.
+ * @param pkt_buf Set to the start of the received packet data.
+ * @param pkt_len Length of the received packet.
+ * @return 0 if the packet was received successfully, GDB_EOF otherwise.
+ */
+static int gdb_recv_packet(struct gdb_state *state, char **pkt_buf,
+                           unsigned int *pkt_len)
+{
+    unsigned int scan;
+    int status;
+    char expected_csum, actual_csum;
+
+#if GDB_PROFILE
+    gdb_profile_end(state);
+#endif
+
+    while (1) {
+        /* Release the previous packet */
+        gdb_rx.pinned = 0;
+
+        /* Find the next complete frame */
+        status = gdb_rx_frame(state);
+        if (status == GDB_EOF) {
+            return GDB_EOF;
+        }
+        scan = status;
+
+        *pkt_buf = gdb_rx.buf+gdb_rx.head+1;
+        *pkt_len = scan-gdb_rx.head-1;
+        gdb_rx.head = scan+3;
 
 #if DEBUG
-    {
-        unsigned int p;
-        GDB_PRINT("<- ");
-        for (p = 0; p < *pkt_len; p++) {
-            if (gdb_is_printable_char(pkt_buf[p])) {
-                GDB_PRINT("%c", pkt_buf[p]);
-            } else {
-                GDB_PRINT("\\x%02x", pkt_buf[p] & 0xff);
+        {
+            unsigned int p;
+            GDB_PRINT("<- ");
+            for (p = 0; p < *pkt_len; p++) {
+                if (gdb_is_printable_char((*pkt_buf)[p])) {
+                    GDB_PRINT("%c", (*pkt_buf)[p]);
+                } else {
+                    GDB_PRINT("\\x%02x", (*pkt_buf)[p] & 0xff);
+                }
             }
+            GDB_PRINT("\n");
         }
-        GDB_PRINT("\n");
-    }
 #endif
 
-    /* Receive the checksum */
-    if ((gdb_read(state, buf, sizeof(buf), 2) == GDB_EOF) ||
-        (gdb_dec_hex(buf, 2, &expected_csum, 1) == GDB_EOF)) {
-        return GDB_EOF;
-    }
+        /* Verify checksum */
+        actual_csum = gdb_checksum(*pkt_buf, *pkt_len);
+        if ((gdb_dec_hex(gdb_rx.buf+scan+1, 2, &expected_csum, 1) != GDB_EOF) &&
+            (actual_csum == expected_csum)) {
+            break;
+        }
 
-    /* Verify checksum */
-    actual_csum = gdb_checksum(pkt_buf, *pkt_len);
-    if (actual_csum != expected_csum) {
-        /* Send packet nack */
         GDB_PRINT("received packet with bad checksum\n");
-        gdb_sys_putchar(state, '-');
-        return GDB_EOF;
+        if (!gdb_no_ack_mode) {
+            /* Send packet nack, the debugger retransmits */
+            gdb_sys_putchar(state, '-');
+        }
+    }
+
+    gdb_stats.rx_packets += 1;
+    gdb_rx.pinned = 1;
+
+#if GDB_PROFILE
+    gdb_profile.cmd = *pkt_len ? ((*pkt_buf)[0] & 0x7f) : 0;
+    gdb_profile.active = 1;
+    gdb_profile.start = gdb_sys_clock(state);
+#endif
+
+    if (!gdb_no_ack_mode) {
+        /* Send packet ack */
+        gdb_sys_putchar(state, '+');
     }
 
-    /* Send packet ack */
-    gdb_sys_putchar(state, '+');
     return 0;
 }